@@ -0,0 +1,29 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   Benchmark harness for vfs_glusterfs.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/* bench_smbd.c */
+void bench_set_debuglevel(int level);
+bool bench_set_parm(const char *option);
+void bench_free_tos(void);
+const struct vfs_fn_pointers *bench_vfs_fns(void);
+
+#endif /* _BENCH_H */
@@ -0,0 +1,586 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   The smbd functions vfs_glusterfs uses, for the benchmark harness.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The module is built to be loaded into smbd and takes these from it.
+ * The benchmark is linked with -rdynamic, so that the module finds them
+ * here instead. Only what the module needs is provided, as simply as
+ * the benchmark allows: parameters come from the command line, DEBUG
+ * goes to stderr, and there is a single share and no other clients.
+ */
+
+#include "includes.h"
+#include "smbd/smbd.h"
+#include "bench.h"
+
+/* debug */
+
+static int bench_debug_levels[64];
+int *DEBUGLEVEL_CLASS = bench_debug_levels;
+
+void bench_set_debuglevel(int level)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bench_debug_levels); i++) {
+		bench_debug_levels[i] = level;
+	}
+}
+
+bool dbghdrclass(int level, int cls, const char *location, const char *func)
+{
+	fprintf(stderr, "[%d] %s: ", level, func);
+	return true;
+}
+
+bool dbgtext(const char *format_str, ...)
+{
+	va_list ap;
+
+	va_start(ap, format_str);
+	vfprintf(stderr, format_str, ap);
+	va_end(ap);
+
+	return true;
+}
+
+/* parameters, glusterfs:name = value */
+
+struct bench_parm {
+	struct bench_parm *next;
+	char *name;
+	char *value;
+};
+
+static struct bench_parm *bench_parms;
+
+bool bench_set_parm(const char *option)
+{
+	struct bench_parm *p;
+	const char *eq = strchr(option, '=');
+
+	if (eq == NULL || eq == option) {
+		return false;
+	}
+
+	p = talloc_zero(NULL, struct bench_parm);
+	if (p == NULL) {
+		return false;
+	}
+	p->name = talloc_strndup(p, option, eq - option);
+	p->value = talloc_strdup(p, eq + 1);
+	if (p->name == NULL || p->value == NULL) {
+		TALLOC_FREE(p);
+		return false;
+	}
+
+	/* later settings win */
+	p->next = bench_parms;
+	bench_parms = p;
+
+	return true;
+}
+
+static const char *bench_parm(const char *type, const char *option)
+{
+	struct bench_parm *p;
+
+	if (strcmp(type, "glusterfs") != 0) {
+		return NULL;
+	}
+
+	for (p = bench_parms; p != NULL; p = p->next) {
+		if (strcmp(p->name, option) == 0) {
+			return p->value;
+		}
+	}
+
+	return NULL;
+}
+
+const char *lp_parm_const_string(int snum, const char *type,
+				 const char *option, const char *def)
+{
+	const char *value = bench_parm(type, option);
+
+	return (value != NULL) ? value : def;
+}
+
+char *lp_parm_talloc_string(int snum, const char *type, const char *option,
+			    const char *def)
+{
+	const char *value = lp_parm_const_string(snum, type, option, def);
+
+	return (value != NULL) ? talloc_strdup(talloc_tos(), value) : NULL;
+}
+
+const char **lp_parm_string_list(int snum, const char *type,
+				 const char *option, const char **def)
+{
+	static const char **list;
+	const char *value = bench_parm(type, option);
+	const char *p;
+	char *tok;
+	int count = 0;
+
+	if (value == NULL) {
+		return def;
+	}
+
+	/* like loadparm, the list stays valid until the next call */
+	TALLOC_FREE(list);
+	list = talloc_zero_array(NULL, const char *, strlen(value) / 2 + 2);
+	if (list == NULL) {
+		return def;
+	}
+
+	p = value;
+	while (next_token_talloc(list, &p, &tok, " \t,")) {
+		list[count++] = tok;
+	}
+
+	return list;
+}
+
+int lp_parm_int(int snum, const char *type, const char *option, int def)
+{
+	const char *value = bench_parm(type, option);
+
+	return (value != NULL) ? (int)strtol(value, NULL, 0) : def;
+}
+
+unsigned long lp_parm_ulong(int snum, const char *type, const char *option,
+			    unsigned long def)
+{
+	const char *value = bench_parm(type, option);
+
+	return (value != NULL) ? strtoul(value, NULL, 0) : def;
+}
+
+bool lp_parm_bool(int snum, const char *type, const char *option, bool def)
+{
+	const char *value = bench_parm(type, option);
+
+	if (value == NULL) {
+		return def;
+	}
+
+	return (strcasecmp(value, "yes") == 0) ||
+	       (strcasecmp(value, "true") == 0) ||
+	       (strcasecmp(value, "on") == 0) ||
+	       (strcmp(value, "1") == 0);
+}
+
+char *lock_path(const char *name)
+{
+	const char *dir = getenv("TMPDIR");
+
+	return talloc_asprintf(talloc_tos(), "%s/%s",
+			       (dir != NULL) ? dir : "/tmp", name);
+}
+
+/* lib/util */
+
+static TALLOC_CTX *bench_tos;
+
+TALLOC_CTX *talloc_tos(void)
+{
+	if (bench_tos == NULL) {
+		bench_tos = talloc_new(NULL);
+	}
+	return bench_tos;
+}
+
+/* the end of an smbd request */
+void bench_free_tos(void)
+{
+	TALLOC_FREE(bench_tos);
+}
+
+size_t str_list_length(const char * const *list)
+{
+	size_t i;
+
+	for (i = 0; list != NULL && list[i] != NULL; i++) {
+		/* count */
+	}
+
+	return i;
+}
+
+const char **str_list_copy(TALLOC_CTX *mem_ctx, const char **list)
+{
+	const char **copy;
+	size_t i, count = str_list_length(list);
+
+	if (list == NULL) {
+		return NULL;
+	}
+
+	copy = talloc_zero_array(mem_ctx, const char *, count + 1);
+	if (copy == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		copy[i] = talloc_strdup(copy, list[i]);
+		if (copy[i] == NULL) {
+			TALLOC_FREE(copy);
+			return NULL;
+		}
+	}
+
+	return copy;
+}
+
+bool next_token_talloc(TALLOC_CTX *ctx, const char **ptr, char **pp_buff,
+		       const char *sep)
+{
+	const char *s = *ptr;
+	size_t len;
+
+	s += strspn(s, sep);
+	if (*s == '\0') {
+		return false;
+	}
+
+	len = strcspn(s, sep);
+	*pp_buff = talloc_strndup(ctx, s, len);
+	if (*pp_buff == NULL) {
+		return false;
+	}
+	*ptr = s + len;
+
+	return true;
+}
+
+char *strlower_talloc(TALLOC_CTX *ctx, const char *src)
+{
+	char *dest = talloc_strdup(ctx, src);
+	char *p;
+
+	for (p = dest; p != NULL && *p != '\0'; p++) {
+		*p = tolower((unsigned char)*p);
+	}
+
+	return dest;
+}
+
+#ifndef HAVE_STRLCPY
+size_t strlcpy(char *d, const char *s, size_t bufsize)
+{
+	size_t len = strlen(s);
+	size_t n = len;
+
+	if (bufsize == 0) {
+		return len;
+	}
+	if (n >= bufsize) {
+		n = bufsize - 1;
+	}
+	memcpy(d, s, n);
+	d[n] = '\0';
+
+	return len;
+}
+#endif
+
+void clock_gettime_mono(struct timespec *tp)
+{
+	clock_gettime(CLOCK_MONOTONIC, tp);
+}
+
+int64_t nsec_time_diff(const struct timespec *p1, const struct timespec *p2)
+{
+	return ((int64_t)p1->tv_sec - (int64_t)p2->tv_sec) * 1000000000LL +
+	       ((int64_t)p1->tv_nsec - (int64_t)p2->tv_nsec);
+}
+
+bool null_timespec(struct timespec ts)
+{
+	return (ts.tv_sec == 0) || (ts.tv_sec == (time_t)0xFFFFFFFF) ||
+	       (ts.tv_sec == (time_t)-1);
+}
+
+int timespec_compare(const struct timespec *ts1, const struct timespec *ts2)
+{
+	if (ts1->tv_sec != ts2->tv_sec) {
+		return (ts1->tv_sec > ts2->tv_sec) ? 1 : -1;
+	}
+	if (ts1->tv_nsec != ts2->tv_nsec) {
+		return (ts1->tv_nsec > ts2->tv_nsec) ? 1 : -1;
+	}
+	return 0;
+}
+
+struct timeval timeval_current_ofs_msec(uint32_t msecs)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	tv.tv_sec += msecs / 1000;
+	tv.tv_usec += (msecs % 1000) * 1000;
+	if (tv.tv_usec >= 1000000) {
+		tv.tv_sec++;
+		tv.tv_usec -= 1000000;
+	}
+
+	return tv;
+}
+
+int set_blocking(int fd, bool set)
+{
+	int val = fcntl(fd, F_GETFL, 0);
+
+	if (val == -1) {
+		return -1;
+	}
+	if (set) {
+		val &= ~O_NONBLOCK;
+	} else {
+		val |= O_NONBLOCK;
+	}
+
+	return fcntl(fd, F_SETFL, val);
+}
+
+ssize_t sys_read(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(fd, buf, count);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+ssize_t sys_write(int fd, const void *buf, size_t count)
+{
+	ssize_t ret;
+
+	do {
+		ret = write(fd, buf, count);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+ssize_t write_data(int fd, const char *buffer, size_t N)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < N) {
+		ret = sys_write(fd, buffer + total, N - total);
+		if (ret <= 0) {
+			return -1;
+		}
+		total += ret;
+	}
+
+	return total;
+}
+
+ssize_t write_data_iov(int fd, const struct iovec *orig_iov, int iovcnt)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		ret = write_data(fd, orig_iov[i].iov_base, orig_iov[i].iov_len);
+		if (ret == -1) {
+			return -1;
+		}
+		total += ret;
+	}
+
+	return total;
+}
+
+NTSTATUS map_nt_error_from_unix(int unix_error)
+{
+	return (unix_error == 0) ? NT_STATUS_OK : NT_STATUS_UNSUCCESSFUL;
+}
+
+/* smbd */
+
+static struct tevent_context *bench_ev;
+
+struct tevent_context *server_event_context(void)
+{
+	if (bench_ev == NULL) {
+		bench_ev = tevent_context_init(NULL);
+	}
+	return bench_ev;
+}
+
+struct messaging_context *server_messaging_context(void)
+{
+	return NULL;
+}
+
+static const struct vfs_fn_pointers *bench_registered_fns;
+
+NTSTATUS smb_register_vfs(int version, const char *name,
+			  const struct vfs_fn_pointers *fns)
+{
+	if (version != SMB_VFS_INTERFACE_VERSION) {
+		fprintf(stderr, "module %s has VFS interface %d, not %d\n",
+			name, version, SMB_VFS_INTERFACE_VERSION);
+		return NT_STATUS_OBJECT_TYPE_MISMATCH;
+	}
+
+	bench_registered_fns = fns;
+	return NT_STATUS_OK;
+}
+
+const struct vfs_fn_pointers *bench_vfs_fns(void)
+{
+	return bench_registered_fns;
+}
+
+/* as in smbd/vfs.c */
+struct vfs_fsp_data {
+	struct vfs_fsp_data *next;
+	struct vfs_handle_struct *owner;
+	void (*destroy)(void *p_data);
+	void *_dummy_;
+};
+
+#define EXT_DATA_AREA(e) ((uint8 *)(e) + sizeof(struct vfs_fsp_data))
+
+void *vfs_add_fsp_extension_notype(vfs_handle_struct *handle,
+				   files_struct *fsp, size_t ext_size,
+				   void (*destroy_fn)(void *p_data))
+{
+	struct vfs_fsp_data *ext;
+
+	ext = talloc_zero_size(handle->conn,
+			       sizeof(struct vfs_fsp_data) + ext_size);
+	if (ext == NULL) {
+		return NULL;
+	}
+
+	ext->owner = handle;
+	ext->destroy = destroy_fn;
+	ext->next = fsp->vfs_extension;
+	fsp->vfs_extension = ext;
+
+	return EXT_DATA_AREA(ext);
+}
+
+void vfs_remove_fsp_extension(vfs_handle_struct *handle, files_struct *fsp)
+{
+	struct vfs_fsp_data **p, *ext;
+
+	for (p = &fsp->vfs_extension; *p != NULL; p = &(*p)->next) {
+		ext = *p;
+		if (ext->owner == handle) {
+			*p = ext->next;
+			if (ext->destroy != NULL) {
+				ext->destroy(EXT_DATA_AREA(ext));
+			}
+			TALLOC_FREE(ext);
+			return;
+		}
+	}
+}
+
+void *vfs_fetch_fsp_extension(vfs_handle_struct *handle, files_struct *fsp)
+{
+	struct vfs_fsp_data *ext;
+
+	for (ext = fsp->vfs_extension; ext != NULL; ext = ext->next) {
+		if (ext->owner == handle) {
+			return EXT_DATA_AREA(ext);
+		}
+	}
+
+	return NULL;
+}
+
+/* the module is the only one, there is nothing below it */
+
+bool smb_vfs_call_strict_lock(struct vfs_handle_struct *handle,
+			      struct files_struct *fsp,
+			      struct lock_struct *plock)
+{
+	return true;
+}
+
+void smb_vfs_call_strict_unlock(struct vfs_handle_struct *handle,
+				struct files_struct *fsp,
+				struct lock_struct *plock)
+{
+}
+
+NTSTATUS smb_vfs_call_fsctl(struct vfs_handle_struct *handle,
+			    struct files_struct *fsp, TALLOC_CTX *ctx,
+			    uint32_t function, uint16_t req_flags,
+			    const uint8_t *_in_data, uint32_t in_len,
+			    uint8_t **_out_data, uint32_t max_out_len,
+			    uint32_t *out_len)
+{
+	return NT_STATUS_NOT_SUPPORTED;
+}
+
+void init_strict_lock_struct(files_struct *fsp, uint64_t smblctx,
+			     br_off start, br_off size,
+			     enum brl_type lock_type,
+			     struct lock_struct *plock)
+{
+	ZERO_STRUCTP(plock);
+}
+
+/* the benchmark does not track its files by file id */
+files_struct *file_find_di_first(struct smbd_server_connection *sconn,
+				 struct file_id id)
+{
+	return NULL;
+}
+
+files_struct *file_find_di_next(files_struct *start_fsp)
+{
+	return NULL;
+}
+
+const char *fsp_str_dbg(const struct files_struct *fsp)
+{
+	return fsp->fsp_name->base_name;
+}
+
+uint64_t smb_roundup(connection_struct *conn, uint64_t val)
+{
+	/* the default allocation roundup size */
+	uint64_t rval = 1024 * 1024;
+
+	return ((val + rval - 1) / rval) * rval;
+}
+
+void break_kernel_oplock(struct messaging_context *msg_ctx,
+			 files_struct *fsp)
+{
+	DEBUG(1, ("oplock break for %s\n", fsp_str_dbg(fsp)));
+}
+
+/* the benchmark does no asynchronous I/O */
+void smbd_aio_complete_aio_ex(struct aio_extra *aio_ex)
+{
+}
@@ -0,0 +1,770 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   Benchmark harness for vfs_glusterfs.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Loads the module like smbd does and drives its vfs_fn_pointers
+ * directly against a real volume, on one fake share and connection. All
+ * work happens in a scratch directory, removed at the end. Every call
+ * is timed on its own; each workload reports the number of calls, calls
+ * and MB per second, and latency percentiles.
+ *
+ *   vfs_glusterfs_bench -m .libs/vfs_glusterfs.so -s server -v volume \
+ *	[-p path] [-o option=value ...] [-w workload,...] [-n count] \
+ *	[-b size,...] [-f filesize] [-e entries] [-a aces,...] [-d level]
+ *
+ * -o sets glusterfs:option for the share as in smb.conf, so the same
+ * workload can be run with and without a cache or stage of the module.
+ */
+
+#include "includes.h"
+#include "smbd/smbd.h"
+#include "bench.h"
+#include <dlfcn.h>
+#include <getopt.h>
+
+#define DEFAULT_COUNT 1000
+#define DEFAULT_FILESIZE (64 * 1024 * 1024)
+#define DEFAULT_ENTRIES 1000
+
+struct bench {
+	const struct vfs_fn_pointers *fns;
+	struct vfs_handle_struct *handle;
+	struct share_params params;
+	connection_struct *conn;
+	const char *volume;
+	const char *path;
+
+	char *dir;
+	int fnum;
+
+	int count;
+	size_t sizes[16];
+	int num_sizes;
+	off_t filesize;
+	int entries;
+	int aces[16];
+	int num_aces;
+};
+
+struct bench_stats {
+	const char *name;
+	uint64_t *lat;
+	size_t count;
+	size_t alloc;
+	uint64_t bytes;
+	uint64_t errors;
+	struct timespec start;
+	struct timespec end;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_start(struct bench_stats *s, const char *name)
+{
+	ZERO_STRUCTP(s);
+	s->name = name;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+}
+
+static void stats_add(struct bench_stats *s, uint64_t start, ssize_t ret)
+{
+	uint64_t ns = bench_now() - start;
+	uint64_t *lat;
+
+	if (ret < 0) {
+		s->errors++;
+		return;
+	}
+	s->bytes += ret;
+
+	if (s->count == s->alloc) {
+		s->alloc = MAX(1024, s->alloc * 2);
+		lat = realloc(s->lat, s->alloc * sizeof(*lat));
+		if (lat == NULL) {
+			return;
+		}
+		s->lat = lat;
+	}
+	s->lat[s->count++] = ns;
+}
+
+static int uint64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double stats_pct(const struct bench_stats *s, double pct)
+{
+	size_t i = (size_t)(pct / 100.0 * (s->count - 1) + 0.5);
+
+	return s->lat[i] / 1000.0;
+}
+
+static void stats_report(struct bench_stats *s, bool show_bytes)
+{
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->end);
+	secs = nsec_time_diff(&s->end, &s->start) / 1e9;
+
+	if (s->count == 0) {
+		printf("%-24s no successful calls, %llu errors\n", s->name,
+		       (unsigned long long)s->errors);
+		SAFE_FREE(s->lat);
+		return;
+	}
+
+	qsort(s->lat, s->count, sizeof(*s->lat), uint64_cmp);
+
+	printf("%-24s %8zu calls %10.1f/s", s->name, s->count,
+	       s->count / secs);
+	if (show_bytes) {
+		printf(" %9.1f MB/s", s->bytes / secs / (1024 * 1024));
+	}
+	printf("  usec p50 %.1f p90 %.1f p99 %.1f max %.1f",
+	       stats_pct(s, 50), stats_pct(s, 90), stats_pct(s, 99),
+	       stats_pct(s, 100));
+	if (s->errors) {
+		printf("  (%llu errors)", (unsigned long long)s->errors);
+	}
+	printf("\n");
+
+	SAFE_FREE(s->lat);
+}
+
+/* share and files */
+
+static int bench_connect(struct bench *b)
+{
+	connection_struct *conn;
+	struct vfs_handle_struct *handle;
+
+	conn = talloc_zero(NULL, connection_struct);
+	handle = talloc_zero(conn, struct vfs_handle_struct);
+	if (conn == NULL || handle == NULL) {
+		TALLOC_FREE(conn);
+		return -1;
+	}
+
+	b->params.service = 0;
+	conn->params = &b->params;
+	conn->connectpath = talloc_strdup(conn, b->path);
+	conn->vfs_handles = handle;
+
+	handle->conn = conn;
+	handle->fns = b->fns;
+
+	if (b->fns->connect_fn(handle, b->volume, "bench") != 0) {
+		fprintf(stderr, "connect to %s failed\n", b->volume);
+		TALLOC_FREE(conn);
+		return -1;
+	}
+
+	/* as smbd does for every tree connect */
+	if (b->fns->chdir(handle, b->path) != 0) {
+		fprintf(stderr, "chdir(%s) failed: %s\n", b->path,
+			strerror(errno));
+		b->fns->disconnect(handle);
+		TALLOC_FREE(conn);
+		return -1;
+	}
+
+	b->conn = conn;
+	b->handle = handle;
+
+	return 0;
+}
+
+static void bench_disconnect(struct bench *b)
+{
+	b->fns->disconnect(b->handle);
+	if (b->handle->free_data != NULL) {
+		b->handle->free_data(&b->handle->data);
+	}
+	TALLOC_FREE(b->conn);
+	b->handle = NULL;
+	bench_free_tos();
+}
+
+static struct smb_filename *bench_fname(TALLOC_CTX *mem_ctx, const char *name)
+{
+	struct smb_filename *smb_fname;
+
+	smb_fname = talloc_zero(mem_ctx, struct smb_filename);
+	if (smb_fname != NULL) {
+		smb_fname->base_name = talloc_strdup(smb_fname, name);
+	}
+	if (smb_fname == NULL || smb_fname->base_name == NULL) {
+		TALLOC_FREE(smb_fname);
+	}
+
+	return smb_fname;
+}
+
+static files_struct *bench_open(struct bench *b, const char *name, int flags,
+				mode_t mode)
+{
+	files_struct *fsp;
+	int fd;
+
+	fsp = talloc_zero(b->conn, files_struct);
+	if (fsp == NULL) {
+		return NULL;
+	}
+	fsp->fh = talloc_zero(fsp, struct fd_handle);
+	fsp->fsp_name = bench_fname(fsp, name);
+	if (fsp->fh == NULL || fsp->fsp_name == NULL) {
+		TALLOC_FREE(fsp);
+		return NULL;
+	}
+	fsp->conn = b->conn;
+	fsp->fnum = ++b->fnum;
+	fsp->can_write = ((flags & O_ACCMODE) != O_RDONLY);
+
+	fd = b->fns->open_fn(b->handle, fsp->fsp_name, fsp, flags, mode);
+	if (fd == -1) {
+		fprintf(stderr, "open(%s) failed: %s\n", name, strerror(errno));
+		TALLOC_FREE(fsp);
+		return NULL;
+	}
+	fsp->fh->fd = fd;
+
+	return fsp;
+}
+
+static int bench_close(struct bench *b, files_struct *fsp)
+{
+	int ret = b->fns->close_fn(b->handle, fsp);
+
+	TALLOC_FREE(fsp);
+	return ret;
+}
+
+static char *bench_path(struct bench *b, const char *fmt, int i)
+{
+	char *name = talloc_asprintf(talloc_tos(), fmt, i);
+
+	return talloc_asprintf(talloc_tos(), "%s/%s", b->dir, name);
+}
+
+static int bench_unlink(struct bench *b, const char *name)
+{
+	struct smb_filename *smb_fname = bench_fname(talloc_tos(), name);
+	int ret;
+
+	if (smb_fname == NULL) {
+		return -1;
+	}
+	ret = b->fns->unlink(b->handle, smb_fname);
+	TALLOC_FREE(smb_fname);
+
+	return ret;
+}
+
+/* workloads */
+
+static void bench_connect_loop(struct bench *b)
+{
+	struct bench_stats s;
+	uint64_t start;
+	int i;
+
+	/* the connection of the other workloads keeps the graph alive */
+	bench_disconnect(b);
+
+	stats_start(&s, "connect+disconnect");
+	for (i = 0; i < b->count / 100 + 1; i++) {
+		start = bench_now();
+		if (bench_connect(b) != 0) {
+			stats_add(&s, start, -1);
+			break;
+		}
+		bench_disconnect(b);
+		stats_add(&s, start, 0);
+	}
+	stats_report(&s, false);
+
+	if (bench_connect(b) != 0) {
+		exit(1);
+	}
+}
+
+/* Write the test file of filesize, sequentially with size. */
+static void bench_write(struct bench *b, const char *name, size_t size,
+			bool random)
+{
+	struct bench_stats s;
+	files_struct *fsp;
+	char *buf;
+	char *label;
+	uint64_t start;
+	off_t blocks = MAX(1, b->filesize / size);
+	off_t off;
+	ssize_t ret;
+	unsigned int seed = 1;
+	int i;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		return;
+	}
+	memset(buf, 'x', size);
+
+	fsp = bench_open(b, name, O_RDWR | O_CREAT, 0644);
+	if (fsp == NULL) {
+		free(buf);
+		return;
+	}
+
+	label = talloc_asprintf(talloc_tos(), "%s pwrite %zu",
+				random ? "random" : "seq", size);
+	stats_start(&s, label);
+	for (i = 0; i < (random ? b->count : blocks); i++) {
+		off = random ? (rand_r(&seed) % blocks) * size : i * size;
+		start = bench_now();
+		ret = b->fns->pwrite(b->handle, fsp, buf, size, off);
+		stats_add(&s, start, ret);
+	}
+	/* what write behind still holds is part of the cost */
+	start = bench_now();
+	stats_add(&s, start, b->fns->fsync(b->handle, fsp));
+	stats_report(&s, true);
+
+	bench_close(b, fsp);
+	free(buf);
+}
+
+static void bench_read(struct bench *b, const char *name, size_t size,
+		       bool random)
+{
+	struct bench_stats s;
+	files_struct *fsp;
+	char *buf;
+	char *label;
+	uint64_t start;
+	off_t blocks = MAX(1, b->filesize / size);
+	off_t off;
+	unsigned int seed = 2;
+	int i;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		return;
+	}
+
+	fsp = bench_open(b, name, O_RDONLY, 0);
+	if (fsp == NULL) {
+		free(buf);
+		return;
+	}
+
+	label = talloc_asprintf(talloc_tos(), "%s pread %zu",
+				random ? "random" : "seq", size);
+	stats_start(&s, label);
+	for (i = 0; i < (random ? b->count : blocks); i++) {
+		off = random ? (rand_r(&seed) % blocks) * size : i * size;
+		start = bench_now();
+		stats_add(&s, start,
+			  b->fns->pread(b->handle, fsp, buf, size, off));
+	}
+	stats_report(&s, true);
+
+	bench_close(b, fsp);
+	free(buf);
+}
+
+static void bench_io(struct bench *b)
+{
+	char *name = bench_path(b, "io", 0);
+	int i;
+
+	for (i = 0; i < b->num_sizes; i++) {
+		bench_write(b, name, b->sizes[i], false);
+		bench_read(b, name, b->sizes[i], false);
+		bench_write(b, name, b->sizes[i], true);
+		bench_read(b, name, b->sizes[i], true);
+		bench_free_tos();
+		name = bench_path(b, "io", 0);
+	}
+
+	bench_unlink(b, name);
+}
+
+static int bench_create_entries(struct bench *b, const char *dir)
+{
+	files_struct *fsp;
+	char *name;
+	int i;
+
+	if (b->fns->mkdir(b->handle, dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "mkdir(%s) failed: %s\n", dir,
+			strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < b->entries; i++) {
+		name = talloc_asprintf(talloc_tos(), "%s/f%07d", dir, i);
+		fsp = bench_open(b, name, O_RDWR | O_CREAT, 0644);
+		if (fsp == NULL) {
+			return -1;
+		}
+		bench_close(b, fsp);
+		TALLOC_FREE(name);
+	}
+
+	return 0;
+}
+
+static void bench_readdir(struct bench *b, const char *dir)
+{
+	struct bench_stats s;
+	SMB_STRUCT_DIR *dirp;
+	SMB_STRUCT_DIRENT *dirent;
+	SMB_STRUCT_STAT sbuf;
+	uint64_t start;
+	int i;
+
+	stats_start(&s, "readdir");
+	for (i = 0; i < MAX(1, b->count / b->entries); i++) {
+		dirp = b->fns->opendir(b->handle, dir, NULL, 0);
+		if (dirp == NULL) {
+			s.errors++;
+			break;
+		}
+		do {
+			start = bench_now();
+			dirent = b->fns->readdir(b->handle, dirp, &sbuf);
+			if (dirent != NULL) {
+				stats_add(&s, start, 0);
+			}
+		} while (dirent != NULL);
+		b->fns->closedir(b->handle, dirp);
+	}
+	stats_report(&s, false);
+}
+
+static void bench_stat(struct bench *b, const char *dir)
+{
+	struct bench_stats s;
+	struct smb_filename *smb_fname;
+	char *name;
+	uint64_t start;
+	int i;
+
+	stats_start(&s, "stat");
+	for (i = 0; i < b->count; i++) {
+		name = talloc_asprintf(talloc_tos(), "%s/f%07d", dir,
+				       i % b->entries);
+		smb_fname = bench_fname(talloc_tos(), name);
+		start = bench_now();
+		stats_add(&s, start, b->fns->stat(b->handle, smb_fname));
+		TALLOC_FREE(smb_fname);
+		TALLOC_FREE(name);
+	}
+	stats_report(&s, false);
+}
+
+static void bench_remove_entries(struct bench *b, const char *dir)
+{
+	struct bench_stats s;
+	char *name;
+	uint64_t start;
+	int i;
+
+	stats_start(&s, "unlink");
+	for (i = 0; i < b->entries; i++) {
+		name = talloc_asprintf(talloc_tos(), "%s/f%07d", dir, i);
+		start = bench_now();
+		stats_add(&s, start, bench_unlink(b, name));
+		TALLOC_FREE(name);
+	}
+	start = bench_now();
+	stats_add(&s, start, b->fns->rmdir(b->handle, dir));
+	stats_report(&s, false);
+}
+
+static void bench_metadata(struct bench *b)
+{
+	char *dir = bench_path(b, "dir", 0);
+
+	if (bench_create_entries(b, dir) != 0) {
+		return;
+	}
+	bench_readdir(b, dir);
+	bench_stat(b, dir);
+	bench_remove_entries(b, dir);
+}
+
+/* An access ACL with the base entries and named users. */
+static SMB_ACL_T bench_acl(int named)
+{
+	SMB_ACL_T acl;
+	int count = named + 4;
+	int i;
+
+	acl = SMB_MALLOC(sizeof(struct smb_acl_t) +
+			 count * sizeof(struct smb_acl_entry));
+	if (acl == NULL) {
+		return NULL;
+	}
+	acl->size = count;
+	acl->count = count;
+	acl->next = -1;
+
+	acl->acl[0].a_type = SMB_ACL_USER_OBJ;
+	acl->acl[0].a_perm = SMB_ACL_READ | SMB_ACL_WRITE;
+	acl->acl[1].a_type = SMB_ACL_GROUP_OBJ;
+	acl->acl[1].a_perm = SMB_ACL_READ;
+	acl->acl[2].a_type = SMB_ACL_MASK;
+	acl->acl[2].a_perm = SMB_ACL_READ | SMB_ACL_WRITE;
+	acl->acl[3].a_type = SMB_ACL_OTHER;
+	acl->acl[3].a_perm = 0;
+	for (i = 0; i < named; i++) {
+		acl->acl[4 + i].a_type = SMB_ACL_USER;
+		acl->acl[4 + i].a_perm = SMB_ACL_READ;
+		acl->acl[4 + i].uid = 100000 + i;
+	}
+
+	return acl;
+}
+
+static void bench_acls(struct bench *b)
+{
+	struct bench_stats set, get;
+	files_struct *fsp;
+	SMB_ACL_T acl, result;
+	char *name = bench_path(b, "acl", 0);
+	uint64_t start;
+	int i, j;
+
+	fsp = bench_open(b, name, O_RDWR | O_CREAT, 0644);
+	if (fsp == NULL) {
+		return;
+	}
+	bench_close(b, fsp);
+
+	for (j = 0; j < b->num_aces; j++) {
+		acl = bench_acl(b->aces[j]);
+		if (acl == NULL) {
+			break;
+		}
+
+		stats_start(&set, talloc_asprintf(talloc_tos(),
+				"acl set %d", b->aces[j]));
+		for (i = 0; i < b->count / 10 + 1; i++) {
+			start = bench_now();
+			stats_add(&set, start,
+				  b->fns->sys_acl_set_file(b->handle, name,
+						SMB_ACL_TYPE_ACCESS, acl));
+		}
+		stats_report(&set, false);
+
+		stats_start(&get, talloc_asprintf(talloc_tos(),
+				"acl get %d", b->aces[j]));
+		for (i = 0; i < b->count; i++) {
+			start = bench_now();
+			result = b->fns->sys_acl_get_file(b->handle, name,
+						SMB_ACL_TYPE_ACCESS);
+			stats_add(&get, start, (result != NULL) ? 0 : -1);
+			SAFE_FREE(result);
+		}
+		stats_report(&get, false);
+
+		SAFE_FREE(acl);
+	}
+
+	bench_unlink(b, name);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(struct bench *b);
+} workloads[] = {
+	{ "connect", bench_connect_loop },
+	{ "io", bench_io },
+	{ "metadata", bench_metadata },
+	{ "acl", bench_acls },
+};
+
+static int parse_list(const char *arg, long *vals, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (*arg != '\0' && n < max) {
+		vals[n] = strtol(arg, &end, 0);
+		if (end == arg || vals[n] < 0) {
+			return -1;
+		}
+		switch (*end) {
+		case 'k': case 'K': vals[n] *= 1024; end++; break;
+		case 'm': case 'M': vals[n] *= 1024 * 1024; end++; break;
+		}
+		n++;
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return -1;
+		}
+		arg = end;
+	}
+
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -m module.so -s server -v volume [-p path]\n"
+		"\t[-o option=value]... [-w connect,io,metadata,acl]\n"
+		"\t[-n count] [-b size,...] [-f filesize] [-e entries]\n"
+		"\t[-a aces,...] [-d debuglevel]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	const char *module = NULL;
+	const char *server = NULL;
+	const char *wl = "connect,io,metadata,acl";
+	NTSTATUS (*init)(void);
+	void *dl;
+	long vals[16];
+	int i, n, opt;
+	bool found;
+
+	ZERO_STRUCT(b);
+	b.path = "/";
+	b.count = DEFAULT_COUNT;
+	b.filesize = DEFAULT_FILESIZE;
+	b.entries = DEFAULT_ENTRIES;
+	b.sizes[0] = 4096;
+	b.sizes[1] = 64 * 1024;
+	b.sizes[2] = 1024 * 1024;
+	b.num_sizes = 3;
+	b.aces[0] = 1;
+	b.aces[1] = 10;
+	b.aces[2] = 500;
+	b.num_aces = 3;
+
+	while ((opt = getopt(argc, argv, "m:s:v:p:o:w:n:b:f:e:a:d:")) != -1) {
+		switch (opt) {
+		case 'm': module = optarg; break;
+		case 's': server = optarg; break;
+		case 'v': b.volume = optarg; break;
+		case 'p': b.path = optarg; break;
+		case 'w': wl = optarg; break;
+		case 'n': b.count = MAX(1, atoi(optarg)); break;
+		case 'f': b.filesize = strtoll(optarg, NULL, 0); break;
+		case 'e': b.entries = MAX(1, atoi(optarg)); break;
+		case 'd': bench_set_debuglevel(atoi(optarg)); break;
+		case 'o':
+			if (!bench_set_parm(optarg)) {
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			n = parse_list(optarg, vals, ARRAY_SIZE(vals));
+			if (n <= 0) {
+				usage(argv[0]);
+			}
+			for (i = 0; i < n; i++) {
+				b.sizes[i] = MAX(1, vals[i]);
+			}
+			b.num_sizes = n;
+			break;
+		case 'a':
+			n = parse_list(optarg, vals, ARRAY_SIZE(vals));
+			if (n <= 0) {
+				usage(argv[0]);
+			}
+			for (i = 0; i < n; i++) {
+				b.aces[i] = vals[i];
+			}
+			b.num_aces = n;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (module == NULL || server == NULL || b.volume == NULL) {
+		usage(argv[0]);
+	}
+
+	/* what smb.conf would say */
+	bench_set_parm(talloc_asprintf(NULL, "volfile_server=%s", server));
+	bench_set_parm(talloc_asprintf(NULL, "volume=%s", b.volume));
+
+	dl = dlopen(module, RTLD_NOW);
+	if (dl == NULL) {
+		fprintf(stderr, "%s\n", dlerror());
+		return 1;
+	}
+	init = (NTSTATUS (*)(void))dlsym(dl, "init_samba_module");
+	if (init == NULL || !NT_STATUS_IS_OK(init()) ||
+	    (b.fns = bench_vfs_fns()) == NULL) {
+		fprintf(stderr, "%s is not a usable VFS module\n", module);
+		return 1;
+	}
+
+	if (bench_connect(&b) != 0) {
+		return 1;
+	}
+
+	b.dir = talloc_asprintf(NULL, "vfs_bench.%d", (int)getpid());
+	if (b.fns->mkdir(b.handle, b.dir, 0755) != 0) {
+		fprintf(stderr, "mkdir(%s) failed: %s\n", b.dir,
+			strerror(errno));
+		bench_disconnect(&b);
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(workloads); i++) {
+		found = false;
+		for (n = 0; wl[n] != '\0'; n += strcspn(wl + n, ",")) {
+			if (wl[n] == ',') {
+				n++;
+			}
+			if (strncmp(wl + n, workloads[i].name,
+				    strlen(workloads[i].name)) == 0) {
+				found = true;
+				break;
+			}
+		}
+		if (found) {
+			workloads[i].fn(&b);
+			bench_free_tos();
+		}
+	}
+
+	b.fns->rmdir(b.handle, b.dir);
+	bench_disconnect(&b);
+
+	return 0;
+}
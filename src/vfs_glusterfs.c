@@ -25,11 +25,6 @@
  * @date   May 2013
  * @brief  Samba VFS module for glusterfs
  *
- * @todo
- *   - AIO support\n
- *     See, for example \c vfs_aio_linux.c in the \c sourc3/modules directory
- *   - sendfile/recvfile support
- *
  * A Samba VFS module for GlusterFS, based on Gluster's libgfapi.
  * This is a "bottom" vfs module (not something to be stacked on top of
  * another module), and translates (most) calls to the closest actions
@@ -40,17 +35,30 @@
 #include "includes.h"
 #include "smbd/smbd.h"
 #include <stdio.h>
+#include <poll.h>
+#include <sys/mman.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include "api/glfs.h"
+/* object handles, for the handle cache and for change notify */
+#if defined(HAVE_GLFS_UPCALL_REGISTER) || defined(HAVE_GLFS_HANDLES)
+#include "api/glfs-handles.h"
+#endif
 
 #define DEFAULT_VOLFILE_SERVER "localhost"
 
 /**
- * Helper to convert struct stat to struct stat_ex.
+ * Helper to convert struct stat to struct stat_ex, writing every field
+ * once.
+ *
+ * gfapi reports no birth time. As smbd does for such file systems, the
+ * earliest of the other times is used and flagged as calculated, so that
+ * smbd replaces it by the creation time kept in the DOS attributes where
+ * there is one, instead of clients seeing it change with every write.
  */
 static void smb_stat_ex_from_stat(struct stat_ex *dst, const struct stat *src)
 {
-	ZERO_STRUCTP(dst);
-
 	dst->st_ex_dev = src->st_dev;
 	dst->st_ex_ino = src->st_ino;
 	dst->st_ex_mode = src->st_mode;
@@ -62,872 +70,8268 @@ static void smb_stat_ex_from_stat(struct stat_ex *dst, const struct stat *src)
 	dst->st_ex_atime.tv_sec = src->st_atime;
 	dst->st_ex_mtime.tv_sec = src->st_mtime;
 	dst->st_ex_ctime.tv_sec = src->st_ctime;
-	dst->st_ex_btime.tv_sec = src->st_mtime;
-	dst->st_ex_blksize = src->st_blksize;
-	dst->st_ex_blocks = src->st_blocks;
 #ifdef STAT_HAVE_NSEC
 	dst->st_ex_atime.tv_nsec = src->st_atime_nsec;
 	dst->st_ex_mtime.tv_nsec = src->st_mtime_nsec;
 	dst->st_ex_ctime.tv_nsec = src->st_ctime_nsec;
-	dst->st_ex_btime.tv_nsec = src->st_mtime_nsec;
+#else
+	dst->st_ex_atime.tv_nsec = 0;
+	dst->st_ex_mtime.tv_nsec = 0;
+	dst->st_ex_ctime.tv_nsec = 0;
 #endif
+
+	dst->st_ex_btime = (timespec_compare(&dst->st_ex_ctime,
+					     &dst->st_ex_mtime) < 0) ?
+			   dst->st_ex_ctime : dst->st_ex_mtime;
+	/* a zero atime is most likely not maintained, ignore it */
+	if (!null_timespec(dst->st_ex_atime) &&
+	    timespec_compare(&dst->st_ex_atime, &dst->st_ex_btime) < 0) {
+		dst->st_ex_btime = dst->st_ex_atime;
+	}
+	dst->st_ex_calculated_birthtime = true;
+
+	dst->st_ex_blksize = src->st_blksize;
+	dst->st_ex_blocks = src->st_blocks;
+	dst->st_ex_flags = 0;
+	dst->st_ex_mask = 0;
 }
 
 /* pre-opened glfs_t */
 
-static struct glfs_preopened {
+/*
+ * Initialized glfs_t are kept in a hash table keyed by (volume,
+ * connectpath), so a tree connect to a share that is already mounted in
+ * this process finds its graph without scanning every export. Entries
+ * are reference counted by the tree connects using them.
+ *
+ * With glusterfs:share_volume_graph all shares of a volume register with
+ * an empty connectpath and so share one glfs_t. The shares then only
+ * differ by the directory smbd changes into on each tree switch.
+ *
+ * Shares tuned with different xlator options can not use the same
+ * graph, the options they were built with are part of the key.
+ */
+
+#define GLFS_PREOPENED_HASH_SIZE 64
+
+#define GLUSTER_HASH_INIT 2166136261U
+
+struct glfs_preopened {
 	char *volume;
 	char *connectpath;
+	char *options;
+	uint32_t hash;
 	glfs_t *fs;
 	int ref;
+	/* upcalls are registered once per graph, from the main thread */
+	bool upcall_registered;
+	/* and only tried once */
+	bool upcall_failed;
+	/* cached statvfs results, see below */
+	struct glfs_statvfs_entry *statvfs;
+	/* main thread only, see the snapshot code */
+	struct glfs_snapshot_list *snapshots;
 	struct glfs_preopened *next, *prev;
-} *glfs_preopened;
+};
+
+static struct glfs_preopened *glfs_preopened[GLFS_PREOPENED_HASH_SIZE];
+static pthread_mutex_t glfs_preopened_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * FNV-1a, including the terminating NUL so that consecutive calls hash
+ * ("ab", "c") and ("a", "bc") differently.
+ */
+static uint32_t gluster_hash_str(uint32_t hash, const char *str)
+{
+	const unsigned char *p = (const unsigned char *)str;
+
+	do {
+		hash ^= *p;
+		hash *= 16777619U;
+	} while (*p++ != '\0');
+
+	return hash;
+}
 
+static uint32_t glfs_preopened_hash(const char *volume,
+				    const char *connectpath,
+				    const char *options)
+{
+	uint32_t hash;
+
+	hash = gluster_hash_str(GLUSTER_HASH_INIT, volume);
+	hash = gluster_hash_str(hash, connectpath);
+
+	return gluster_hash_str(hash, options);
+}
 
-static int glfs_set_preopened(const char *volume, const char *connectpath, glfs_t *fs)
+static struct glfs_preopened *glfs_set_preopened(const char *volume,
+						 const char *connectpath,
+						 const char *options,
+						 glfs_t *fs)
 {
 	struct glfs_preopened *entry = NULL;
+	struct glfs_preopened **bucket;
 
 	entry = talloc_zero(NULL, struct glfs_preopened);
 	if (!entry) {
 		errno = ENOMEM;
-		return -1;
+		return NULL;
 	}
 
 	entry->volume = talloc_strdup(entry, volume);
 	if (!entry->volume) {
 		talloc_free(entry);
 		errno = ENOMEM;
-		return -1;
+		return NULL;
 	}
 
 	entry->connectpath = talloc_strdup(entry, connectpath);
 	if (entry->connectpath == NULL) {
 		talloc_free(entry);
 		errno = ENOMEM;
-		return -1;
+		return NULL;
+	}
+
+	entry->options = talloc_strdup(entry, options);
+	if (entry->options == NULL) {
+		talloc_free(entry);
+		errno = ENOMEM;
+		return NULL;
 	}
 
+	entry->hash = glfs_preopened_hash(volume, connectpath, options);
 	entry->fs = fs;
 	entry->ref = 1;
 
-	DLIST_ADD(glfs_preopened, entry);
+	bucket = &glfs_preopened[entry->hash % GLFS_PREOPENED_HASH_SIZE];
 
-	return 0;
+	pthread_mutex_lock(&glfs_preopened_mutex);
+	DLIST_ADD(*bucket, entry);
+	pthread_mutex_unlock(&glfs_preopened_mutex);
+
+	return entry;
 }
 
-static glfs_t *glfs_find_preopened(const char *volume, const char *connectpath)
+static struct glfs_preopened *glfs_find_preopened(const char *volume,
+						  const char *connectpath,
+						  const char *options)
 {
 	struct glfs_preopened *entry = NULL;
+	uint32_t hash;
+
+	hash = glfs_preopened_hash(volume, connectpath, options);
 
-	for (entry = glfs_preopened; entry; entry = entry->next) {
-		if (strcmp(entry->volume, volume) == 0 &&
-		    strcmp(entry->connectpath, connectpath) == 0)
+	pthread_mutex_lock(&glfs_preopened_mutex);
+
+	for (entry = glfs_preopened[hash % GLFS_PREOPENED_HASH_SIZE];
+	     entry; entry = entry->next) {
+		if (entry->hash == hash &&
+		    strcmp(entry->volume, volume) == 0 &&
+		    strcmp(entry->connectpath, connectpath) == 0 &&
+		    strcmp(entry->options, options) == 0)
 		{
 			entry->ref++;
-			return entry->fs;
+			break;
 		}
 	}
 
-	return NULL;
+	pthread_mutex_unlock(&glfs_preopened_mutex);
+
+	return entry;
 }
 
-static void glfs_clear_preopened(glfs_t *fs)
+static void glfs_statvfs_cache_stop(struct glfs_preopened *preopened);
+
+static void glfs_clear_preopened(struct glfs_preopened *entry)
 {
-	struct glfs_preopened *entry = NULL;
+	struct glfs_preopened **bucket;
 
-	for (entry = glfs_preopened; entry; entry = entry->next) {
-		if (entry->fs == fs) {
-			if (--entry->ref)
-				return;
+	bucket = &glfs_preopened[entry->hash % GLFS_PREOPENED_HASH_SIZE];
 
-			DLIST_REMOVE(glfs_preopened, entry);
+	pthread_mutex_lock(&glfs_preopened_mutex);
 
-			glfs_fini(entry->fs);
-			talloc_free(entry);
-		}
+	if (--entry->ref) {
+		pthread_mutex_unlock(&glfs_preopened_mutex);
+		return;
 	}
-}
 
-/* Disk Operations */
+	DLIST_REMOVE(*bucket, entry);
 
-static int vfs_gluster_connect(struct vfs_handle_struct *handle,
-			       const char *service,
-			       const char *user)
+	pthread_mutex_unlock(&glfs_preopened_mutex);
+
+	glfs_statvfs_cache_stop(entry);
+	glfs_fini(entry->fs);
+	talloc_free(entry);
+}
+
+/* Start a thread with all signals blocked, they are for smbd. */
+static int glusterfs_thread_create(pthread_t *thread,
+				   void *(*fn)(void *), void *arg)
 {
-	const char *volfile_server;
-	const char *volume;
-	char *logfile;
-	int loglevel;
-	glfs_t *fs = NULL;
-	int ret = 0;
+	sigset_t set, old;
+	int ret;
 
-	logfile = lp_parm_talloc_string(SNUM(handle->conn), "glusterfs",
-				       "logfile", NULL);
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(thread, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-	loglevel = lp_parm_int(SNUM(handle->conn), "glusterfs", "loglevel", -1);
+	return ret;
+}
 
-	volfile_server = lp_parm_const_string(SNUM(handle->conn), "glusterfs",
-					       "volfile_server", NULL);
-	if (volfile_server == NULL) {
-		volfile_server = DEFAULT_VOLFILE_SERVER;
-	}
+/* worker pool */
 
-	volume = lp_parm_const_string(SNUM(handle->conn), "glusterfs", "volume",
-				      NULL);
-	if (volume == NULL) {
-		volume = service;
-	}
+/*
+ * Threads for short gfapi calls the caller waits for, e.g. reading
+ * several xattrs at once. They are started on first use, up to
+ * POOL_MAX_THREADS per process, and live as long as the process; a
+ * forked child starts its own. Work is queued in batches, the caller
+ * waits for the batch. Work functions only call gfapi and must not
+ * queue work themselves.
+ */
 
-	fs = glfs_find_preopened(volume, handle->conn->connectpath);
-	if (fs) {
-		goto done;
-	}
+#define POOL_MAX_THREADS 8
 
-	fs = glfs_new(volume);
-	if (fs == NULL) {
-		ret = -1;
-		goto done;
-	}
+struct glusterfs_batch {
+	/* queued and not yet done, under glusterfs_pool_mutex */
+	int pending;
+};
 
-	ret = glfs_set_volfile_server(fs, "tcp", volfile_server, 0);
-	if (ret < 0) {
-		DEBUG(0, ("Failed to set volfile_server %s\n", volfile_server));
-		goto done;
-	}
+struct glusterfs_work {
+	struct glusterfs_work *next;
+	void (*fn)(void *private_data);
+	void *private_data;
+	struct glusterfs_batch *batch;
+};
 
-	ret = glfs_set_xlator_option(fs, "*-md-cache", "cache-posix-acl",
-				     "true");
-	if (ret < 0) {
-		DEBUG(0, ("%s: Failed to set xlator options\n", volume));
-		goto done;
-	}
+static pthread_mutex_t glusterfs_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* work to pick up */
+static pthread_cond_t glusterfs_pool_work = PTHREAD_COND_INITIALIZER;
+/* a batch is done */
+static pthread_cond_t glusterfs_pool_done = PTHREAD_COND_INITIALIZER;
+static struct glusterfs_work *glusterfs_pool_head, *glusterfs_pool_tail;
+static int glusterfs_pool_threads;
+/* the threads belong to this process */
+static pid_t glusterfs_pool_pid;
+
+static void *glusterfs_pool_thread(void *private_data)
+{
+	struct glusterfs_work *w;
+	struct glusterfs_batch *batch;
+
+	pthread_mutex_lock(&glusterfs_pool_mutex);
+	for (;;) {
+		while (glusterfs_pool_head == NULL) {
+			pthread_cond_wait(&glusterfs_pool_work,
+					  &glusterfs_pool_mutex);
+		}
+		w = glusterfs_pool_head;
+		glusterfs_pool_head = w->next;
+		if (glusterfs_pool_head == NULL) {
+			glusterfs_pool_tail = NULL;
+		}
+		pthread_mutex_unlock(&glusterfs_pool_mutex);
 
+		/* w may be gone once its batch is done */
+		batch = w->batch;
+		w->fn(w->private_data);
 
-	ret = glfs_set_xlator_option(fs, "*-snapview-client",
-				     "snapdir-entry-path",
-				     handle->conn->connectpath);
-	if (ret < 0) {
-		DEBUG(0, ("%s: Failed to set xlator option:"
-			  " snapdir-entry-path\n", volume));
-		glfs_fini(fs);
-		return -1;
+		pthread_mutex_lock(&glusterfs_pool_mutex);
+		if (--batch->pending == 0) {
+			pthread_cond_broadcast(&glusterfs_pool_done);
+		}
 	}
 
-	ret = glfs_set_logging(fs, logfile, loglevel);
-	if (ret < 0) {
-		DEBUG(0, ("%s: Failed to set logfile %s loglevel %d\n",
-			  volume, logfile, loglevel));
-		goto done;
-	}
+	return NULL;
+}
 
-	ret = glfs_init(fs);
-	if (ret < 0) {
-		DEBUG(0, ("%s: Failed to initialize volume (%s)\n",
-			  volume, strerror(errno)));
-		goto done;
+/* Have up to threads workers, false if there are none. */
+static bool glusterfs_pool_start(int threads)
+{
+	pthread_t thread;
+	bool ret;
+	int err;
+
+	threads = MIN(threads, POOL_MAX_THREADS);
+
+	pthread_mutex_lock(&glusterfs_pool_mutex);
+	if (glusterfs_pool_pid != getpid()) {
+		/* forked, the threads stayed with the parent */
+		glusterfs_pool_pid = getpid();
+		glusterfs_pool_threads = 0;
+		glusterfs_pool_head = glusterfs_pool_tail = NULL;
 	}
-
-	ret = glfs_set_preopened(volume, handle->conn->connectpath, fs);
-	if (ret < 0) {
-		DEBUG(0, ("%s: Failed to register volume (%s)\n",
-			  volume, strerror(errno)));
-		goto done;
+	while (glusterfs_pool_threads < threads) {
+		err = glusterfs_thread_create(&thread, glusterfs_pool_thread,
+					      NULL);
+		if (err != 0) {
+			DEBUG(1, ("Failed to start worker thread: %s\n",
+				  strerror(err)));
+			break;
+		}
+		pthread_detach(thread);
+		glusterfs_pool_threads++;
 	}
-done:
-	talloc_free(logfile);
-	if (ret < 0) {
-		if (fs)
-			glfs_fini(fs);
-		return -1;
+	ret = (glusterfs_pool_threads > 0);
+	pthread_mutex_unlock(&glusterfs_pool_mutex);
+
+	return ret;
+}
+
+/* Queue w to run fn(private_data) as part of batch. */
+static void glusterfs_pool_queue(struct glusterfs_batch *batch,
+				 struct glusterfs_work *w,
+				 void (*fn)(void *private_data),
+				 void *private_data)
+{
+	w->next = NULL;
+	w->fn = fn;
+	w->private_data = private_data;
+	w->batch = batch;
+
+	pthread_mutex_lock(&glusterfs_pool_mutex);
+	batch->pending++;
+	if (glusterfs_pool_tail != NULL) {
+		glusterfs_pool_tail->next = w;
 	} else {
-		DEBUG(0, ("%s: Initialized volume from server %s\n",
-                         volume, volfile_server));
-		handle->data = fs;
-		return 0;
+		glusterfs_pool_head = w;
 	}
+	glusterfs_pool_tail = w;
+	pthread_cond_signal(&glusterfs_pool_work);
+	pthread_mutex_unlock(&glusterfs_pool_mutex);
 }
 
-static void vfs_gluster_disconnect(struct vfs_handle_struct *handle)
+static void glusterfs_pool_wait(struct glusterfs_batch *batch)
 {
-	glfs_t *fs = NULL;
+	pthread_mutex_lock(&glusterfs_pool_mutex);
+	while (batch->pending > 0) {
+		pthread_cond_wait(&glusterfs_pool_done,
+				  &glusterfs_pool_mutex);
+	}
+	pthread_mutex_unlock(&glusterfs_pool_mutex);
+}
 
-	fs = handle->data;
+/* statvfs cache */
 
-	glfs_clear_preopened(fs);
-}
+/*
+ * A statvfs of a distributed volume goes to every brick, and clients ask
+ * for the free space all the time. With glusterfs:statvfs_cache_ttl the
+ * results are kept per glfs_t and path for the TTL. Older results are
+ * still returned for up to statvfs_cache_max_age while a thread fetches
+ * fresh ones, so that only the first call, or one after a long idle
+ * time, waits for the bricks.
+ */
 
-static uint64_t vfs_gluster_disk_free(struct vfs_handle_struct *handle,
-				      const char *path, bool small_query,
-				      uint64_t *bsize_p, uint64_t *dfree_p,
-				      uint64_t *dsize_p)
+#define DEFAULT_STATVFS_MAX_AGE_FACTOR 10
+
+struct glfs_statvfs_entry {
+	struct glfs_statvfs_entry *prev, *next;
+	glfs_t *fs;
+	/* absolute, the refresh thread does not follow chdir */
+	char *path;
+
+	/* all below under glfs_statvfs_mutex */
+	struct statvfs st;
+	struct timespec fetched;
+	bool valid;
+	bool refreshing;
+	bool thread_started;
+	pthread_t thread;
+};
+
+static pthread_mutex_t glfs_statvfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *glfs_statvfs_refresh_thread(void *private_data)
 {
-	struct statvfs statvfs = { 0, };
+	struct glfs_statvfs_entry *e = private_data;
+	struct statvfs st;
 	int ret;
 
-	ret = glfs_statvfs(handle->data, path, &statvfs);
-	if (ret < 0) {
-		DEBUG(0, ("glfs_statvfs(%s) failed: %s\n",
-			  path, strerror(errno)));
-		return -1;
-	}
+	ret = glfs_statvfs(e->fs, e->path, &st);
 
-	if (bsize_p != NULL) {
-		*bsize_p = (uint64_t)statvfs.f_bsize; /* Block size */
-	}
-	if (dfree_p != NULL) {
-		*dfree_p = (uint64_t)statvfs.f_bavail; /* Available Block units */
-	}
-	if (dsize_p != NULL) {
-		*dsize_p = (uint64_t)statvfs.f_blocks; /* Total Block units */
+	pthread_mutex_lock(&glfs_statvfs_mutex);
+	if (ret == 0) {
+		e->st = st;
+		clock_gettime_mono(&e->fetched);
+		e->valid = true;
 	}
+	e->refreshing = false;
+	pthread_mutex_unlock(&glfs_statvfs_mutex);
 
-	return (uint64_t)statvfs.f_bavail;
+	return NULL;
 }
 
-static int vfs_gluster_get_quota(struct vfs_handle_struct *handle,
-				 enum SMB_QUOTA_TYPE qtype, unid_t id,
-				 SMB_DISK_QUOTA *qt)
+/* Called with glfs_statvfs_mutex held. */
+static void glfs_statvfs_refresh(struct glfs_statvfs_entry *e)
 {
-	errno = ENOSYS;
-	return -1;
-}
+	if (e->refreshing) {
+		return;
+	}
 
-static int
-vfs_gluster_set_quota(struct vfs_handle_struct *handle,
-		      enum SMB_QUOTA_TYPE qtype, unid_t id, SMB_DISK_QUOTA *qt)
-{
-	errno = ENOSYS;
-	return -1;
+	if (e->thread_started) {
+		/* done with it, the join does not wait */
+		pthread_join(e->thread, NULL);
+		e->thread_started = false;
+	}
+
+	e->refreshing = true;
+	e->thread_started = (glusterfs_thread_create(&e->thread,
+					glfs_statvfs_refresh_thread, e) == 0);
+	if (!e->thread_started) {
+		/* try again with the next call */
+		e->refreshing = false;
+	}
 }
 
-static int vfs_gluster_statvfs(struct vfs_handle_struct *handle,
-			       const char *path,
-			       struct vfs_statvfs_struct *vfs_statvfs)
+/*
+ * The statvfs of path from the cache of preopened, ttl and max_age in
+ * msec. False if the caller has to ask the volume.
+ */
+static bool glfs_statvfs_cache_fetch(struct glfs_preopened *preopened,
+				     const char *path, int ttl, int max_age,
+				     struct statvfs *st)
 {
-	struct statvfs statvfs = { 0, };
-	int ret;
+	struct glfs_statvfs_entry *e;
+	struct timespec now;
+	int64_t age;
+	bool found = false;
 
-	ret = glfs_statvfs(handle->data, path, &statvfs);
-	if (ret < 0) {
-		DEBUG(0, ("glfs_statvfs(%s) failed: %s\n",
-			  path, strerror(errno)));
-		return -1;
+	pthread_mutex_lock(&glfs_statvfs_mutex);
+
+	for (e = preopened->statvfs; e != NULL; e = e->next) {
+		if (strcmp(e->path, path) == 0) {
+			break;
+		}
 	}
 
-	ZERO_STRUCTP(vfs_statvfs);
+	if (e != NULL && e->valid) {
+		clock_gettime_mono(&now);
+		age = nsec_time_diff(&now, &e->fetched) / 1000000;
 
-	vfs_statvfs->OptimalTransferSize = statvfs.f_frsize;
-	vfs_statvfs->BlockSize = statvfs.f_bsize;
-	vfs_statvfs->TotalBlocks = statvfs.f_blocks;
-	vfs_statvfs->BlocksAvail = statvfs.f_bfree;
-	vfs_statvfs->UserBlocksAvail = statvfs.f_bavail;
-	vfs_statvfs->TotalFileNodes = statvfs.f_files;
-	vfs_statvfs->FreeFileNodes = statvfs.f_ffree;
-	vfs_statvfs->FsIdentifier = statvfs.f_fsid;
-	vfs_statvfs->FsCapabilities =
-	    FILE_CASE_SENSITIVE_SEARCH | FILE_CASE_PRESERVED_NAMES;
+		if (age < max_age) {
+			*st = e->st;
+			found = true;
+		}
+		if (found && age >= ttl) {
+			glfs_statvfs_refresh(e);
+		}
+	}
 
-	return ret;
+	pthread_mutex_unlock(&glfs_statvfs_mutex);
+
+	return found;
 }
 
-static uint32_t vfs_gluster_fs_capabilities(struct vfs_handle_struct *handle,
-					    enum timestamp_set_resolution *p_ts_res)
+static void glfs_statvfs_cache_store(struct glfs_preopened *preopened,
+				     const char *path,
+				     const struct statvfs *st)
 {
-	uint32_t caps = FILE_CASE_SENSITIVE_SEARCH | FILE_CASE_PRESERVED_NAMES;
-
-#ifdef STAT_HAVE_NSEC
-	*p_ts_res = TIMESTAMP_SET_NT_OR_BETTER;
-#endif
+	struct glfs_statvfs_entry *e;
 
-	return caps;
-}
+	pthread_mutex_lock(&glfs_statvfs_mutex);
 
-static DIR *vfs_gluster_opendir(struct vfs_handle_struct *handle,
-				const char *path, const char *mask,
-				uint32 attributes)
-{
-	glfs_fd_t *fd;
+	for (e = preopened->statvfs; e != NULL; e = e->next) {
+		if (strcmp(e->path, path) == 0) {
+			break;
+		}
+	}
 
-	fd = glfs_opendir(handle->data, path);
-	if (fd == NULL) {
-		DEBUG(0, ("glfs_opendir(%s) failed: %s\n",
-			  path, strerror(errno)));
+	if (e == NULL) {
+		e = talloc_zero(preopened, struct glfs_statvfs_entry);
+		if (e != NULL) {
+			e->path = talloc_strdup(e, path);
+		}
+		if (e == NULL || e->path == NULL) {
+			TALLOC_FREE(e);
+			pthread_mutex_unlock(&glfs_statvfs_mutex);
+			return;
+		}
+		e->fs = preopened->fs;
+		DLIST_ADD(preopened->statvfs, e);
 	}
 
-	return (DIR *) fd;
-}
+	e->st = *st;
+	clock_gettime_mono(&e->fetched);
+	e->valid = true;
 
-static DIR *vfs_gluster_fdopendir(struct vfs_handle_struct *handle,
-				  files_struct *fsp, const char *mask,
-				  uint32 attributes)
-{
-	return (DIR *) *(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp);
+	pthread_mutex_unlock(&glfs_statvfs_mutex);
 }
 
-static int vfs_gluster_closedir(struct vfs_handle_struct *handle, DIR *dirp)
+/* Wait for the refresh threads of preopened, before glfs_fini. */
+static void glfs_statvfs_cache_stop(struct glfs_preopened *preopened)
 {
-	return glfs_closedir((void *)dirp);
+	struct glfs_statvfs_entry *e;
+
+	/* no more callers, the threads only need the mutex to finish */
+	for (e = preopened->statvfs; e != NULL; e = e->next) {
+		if (e->thread_started) {
+			pthread_join(e->thread, NULL);
+			e->thread_started = false;
+		}
+	}
 }
 
-static SMB_STRUCT_DIRENT *vfs_gluster_readdir(struct vfs_handle_struct *handle,
-					      SMB_STRUCT_DIR *dirp,
-					      SMB_STRUCT_STAT *sbuf)
+/* metadata cache */
+
+/*
+ * A bounded, TTL based cache of talloc'ed values keyed by path, used by
+ * the per connection metadata caches. Entries are hashed for lookup and
+ * kept on an LRU list, the least recently used entry is evicted when the
+ * cache is full. A cache with a TTL of 0 is never created, and all the
+ * functions below accept a NULL cache.
+ */
+
+struct gluster_cache_entry {
+	struct gluster_cache_entry *prev, *next;	/* LRU list */
+	struct gluster_cache_entry *hnext;		/* hash chain */
+	uint32_t hash;
+	char *key;
+	struct timespec expires;
+	void *value;
+};
+
+struct gluster_cache {
+	const char *name;
+	struct gluster_cache_entry **buckets;
+	uint32_t num_buckets;
+	struct gluster_cache_entry *lru;		/* most recent first */
+	struct gluster_cache_entry *lru_tail;
+	uint32_t count;
+	uint32_t max_entries;
+	int ttl_ms;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static struct gluster_cache *gluster_cache_init(TALLOC_CTX *mem_ctx,
+						const char *name,
+						uint32_t max_entries,
+						int ttl_ms)
 {
-	static char direntbuf[512];
-	int ret;
-	struct stat stat;
-	struct dirent *dirent = 0;
-	static SMB_STRUCT_DIRENT result;
+	struct gluster_cache *cache = NULL;
 
-	if (sbuf != NULL) {
-		ret = glfs_readdirplus_r((void *)dirp, &stat, (void *)direntbuf,
-					 &dirent);
-	} else {
-		ret = glfs_readdir_r((void *)dirp, (void *)direntbuf, &dirent);
+	if (ttl_ms <= 0 || max_entries == 0) {
+		return NULL;
 	}
 
-	if ((ret < 0) || (dirent == NULL)) {
+	cache = talloc_zero(mem_ctx, struct gluster_cache);
+	if (cache == NULL) {
 		return NULL;
 	}
 
-	if (sbuf != NULL) {
-		smb_stat_ex_from_stat(sbuf, &stat);
+	cache->name = name;
+	cache->max_entries = max_entries;
+	cache->ttl_ms = ttl_ms;
+	/* keep the chains short, a power of two is not needed */
+	cache->num_buckets = max_entries / 2 + 1;
+	cache->buckets = talloc_zero_array(cache, struct gluster_cache_entry *,
+					   cache->num_buckets);
+	if (cache->buckets == NULL) {
+		talloc_free(cache);
+		return NULL;
 	}
 
-	result.d_ino = dirent->d_ino;
-	result.d_off = dirent->d_off;
-	result.d_reclen = dirent->d_reclen;
-	result.d_type = dirent->d_type;
-	strncpy(result.d_name, dirent->d_name, 256);
-
-	return &result;
+	return cache;
 }
 
-static long vfs_gluster_telldir(struct vfs_handle_struct *handle, DIR *dirp)
+static void gluster_cache_unlink(struct gluster_cache *cache,
+				 struct gluster_cache_entry *entry)
 {
-	return glfs_telldir((void *)dirp);
-}
+	struct gluster_cache_entry **pp;
 
-static void vfs_gluster_seekdir(struct vfs_handle_struct *handle, DIR *dirp,
-				long offset)
-{
-	glfs_seekdir((void *)dirp, offset);
-}
+	pp = &cache->buckets[entry->hash % cache->num_buckets];
+	while (*pp != entry) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = entry->hnext;
 
-static void vfs_gluster_rewinddir(struct vfs_handle_struct *handle, DIR *dirp)
-{
-	glfs_seekdir((void *)dirp, 0);
-}
+	if (cache->lru_tail == entry) {
+		cache->lru_tail = (entry == cache->lru) ? NULL : entry->prev;
+	}
+	DLIST_REMOVE(cache->lru, entry);
 
-static void vfs_gluster_init_search_op(struct vfs_handle_struct *handle,
-				       DIR *dirp)
-{
-	return;
+	cache->count--;
+	talloc_free(entry);
 }
 
-static int vfs_gluster_mkdir(struct vfs_handle_struct *handle, const char *path,
-			     mode_t mode)
+static struct gluster_cache_entry *gluster_cache_find(struct gluster_cache *cache,
+						      const char *key,
+						      uint32_t hash)
 {
-	return glfs_mkdir(handle->data, path, mode);
-}
+	struct gluster_cache_entry *entry;
 
-static int vfs_gluster_rmdir(struct vfs_handle_struct *handle, const char *path)
-{
-	return glfs_rmdir(handle->data, path);
+	for (entry = cache->buckets[hash % cache->num_buckets];
+	     entry; entry = entry->hnext) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
 }
 
-static int vfs_gluster_open(struct vfs_handle_struct *handle,
-			    struct smb_filename *smb_fname, files_struct *fsp,
-			    int flags, mode_t mode)
+/*
+ * Returns the cached value for key, or NULL. The value stays owned by the
+ * cache and is only valid until the next call modifying it.
+ */
+static void *gluster_cache_lookup(struct gluster_cache *cache, const char *key)
 {
-	glfs_fd_t *glfd;
-	glfs_fd_t **p_tmp;
+	struct gluster_cache_entry *entry;
+	struct timespec now;
+	uint32_t hash;
 
-	if (flags & O_DIRECTORY) {
-		glfd = glfs_opendir(handle->data, smb_fname->base_name);
-	} else if (flags & O_CREAT) {
-		glfd = glfs_creat(handle->data, smb_fname->base_name, flags,
-				  mode);
-	} else {
-		glfd = glfs_open(handle->data, smb_fname->base_name, flags);
+	if (cache == NULL) {
+		return NULL;
 	}
 
-	if (glfd == NULL) {
-		return -1;
+	hash = gluster_hash_str(GLUSTER_HASH_INIT, key);
+
+	entry = gluster_cache_find(cache, key, hash);
+	if (entry == NULL) {
+		cache->misses++;
+		return NULL;
 	}
-	p_tmp = (glfs_fd_t **)VFS_ADD_FSP_EXTENSION(handle, fsp,
-							  glfs_fd_t *, NULL);
-	*p_tmp = glfd;
-	/* An arbitrary value for error reporting, so you know its us. */
-	return 13371337;
+
+	clock_gettime_mono(&now);
+	if (timespec_compare(&now, &entry->expires) >= 0) {
+		gluster_cache_unlink(cache, entry);
+		cache->misses++;
+		return NULL;
+	}
+
+	if (entry != cache->lru) {
+		if (cache->lru_tail == entry) {
+			cache->lru_tail = entry->prev;
+		}
+		DLIST_PROMOTE(cache->lru, entry);
+	}
+
+	cache->hits++;
+	return entry->value;
 }
 
-static int vfs_gluster_close(struct vfs_handle_struct *handle,
-			     files_struct *fsp)
+/*
+ * Add value under key, replacing any previous entry. The cache takes over
+ * the talloc'ed value, which is freed if it cannot be added.
+ */
+static bool gluster_cache_add(struct gluster_cache *cache, const char *key,
+			      void *value)
 {
-	glfs_fd_t *glfd;
-	glfd = *(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp);
-	VFS_REMOVE_FSP_EXTENSION(handle, fsp);
-	return glfs_close(glfd);
+	struct gluster_cache_entry *entry;
+	uint32_t hash;
+
+	if (cache == NULL) {
+		talloc_free(value);
+		return false;
+	}
+
+	hash = gluster_hash_str(GLUSTER_HASH_INIT, key);
+
+	entry = gluster_cache_find(cache, key, hash);
+	if (entry != NULL) {
+		gluster_cache_unlink(cache, entry);
+	}
+
+	if (cache->count >= cache->max_entries) {
+		gluster_cache_unlink(cache, cache->lru_tail);
+	}
+
+	entry = talloc_zero(cache, struct gluster_cache_entry);
+	if (entry == NULL) {
+		talloc_free(value);
+		return false;
+	}
+
+	entry->key = talloc_strdup(entry, key);
+	if (entry->key == NULL) {
+		talloc_free(entry);
+		talloc_free(value);
+		return false;
+	}
+
+	entry->hash = hash;
+	entry->value = talloc_steal(entry, value);
+
+	clock_gettime_mono(&entry->expires);
+	entry->expires.tv_sec += cache->ttl_ms / 1000;
+	entry->expires.tv_nsec += (cache->ttl_ms % 1000) * 1000000;
+	if (entry->expires.tv_nsec >= 1000000000) {
+		entry->expires.tv_sec++;
+		entry->expires.tv_nsec -= 1000000000;
+	}
+
+	entry->hnext = cache->buckets[hash % cache->num_buckets];
+	cache->buckets[hash % cache->num_buckets] = entry;
+
+	DLIST_ADD(cache->lru, entry);
+	if (cache->lru_tail == NULL) {
+		cache->lru_tail = entry;
+	}
+	cache->count++;
+
+	return true;
 }
 
-static ssize_t vfs_gluster_read(struct vfs_handle_struct *handle,
-				files_struct *fsp, void *data, size_t n)
+static void gluster_cache_delete(struct gluster_cache *cache, const char *key)
 {
-	return glfs_read(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), data, n, 0);
+	struct gluster_cache_entry *entry;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	entry = gluster_cache_find(cache, key,
+				   gluster_hash_str(GLUSTER_HASH_INIT, key));
+	if (entry != NULL) {
+		gluster_cache_unlink(cache, entry);
+	}
 }
 
-static ssize_t vfs_gluster_pread(struct vfs_handle_struct *handle,
-				 files_struct *fsp, void *data,
-				 size_t n, off_t offset)
+/* Remove path and everything below it, e.g. after a directory rename. */
+static void gluster_cache_delete_tree(struct gluster_cache *cache,
+				      const char *path)
 {
-	return glfs_pread(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), data, n, offset, 0);
+	struct gluster_cache_entry *entry, *next;
+	size_t len = strlen(path);
+
+	if (cache == NULL) {
+		return;
+	}
+
+	for (entry = cache->lru; entry; entry = next) {
+		next = entry->next;
+		if (strncmp(entry->key, path, len) == 0 &&
+		    (entry->key[len] == '\0' || entry->key[len] == '/')) {
+			gluster_cache_unlink(cache, entry);
+		}
+	}
 }
 
-static ssize_t vfs_gluster_write(struct vfs_handle_struct *handle,
-				 files_struct *fsp, const void *data, size_t n)
+static void gluster_cache_flush(struct gluster_cache *cache)
 {
-	return glfs_write(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), data, n, 0);
+	if (cache == NULL) {
+		return;
+	}
+
+	while (cache->lru != NULL) {
+		gluster_cache_unlink(cache, cache->lru);
+	}
 }
 
-static ssize_t vfs_gluster_pwrite(struct vfs_handle_struct *handle,
-				  files_struct *fsp, const void *data,
-				  size_t n, off_t offset)
+static void gluster_cache_report(struct gluster_cache *cache)
 {
-	return glfs_pwrite(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), data, n, offset, 0);
+	if (cache == NULL) {
+		return;
+	}
+
+	DEBUG(2, ("%s cache: %llu hits, %llu misses, %u entries\n",
+		  cache->name, (unsigned long long)cache->hits,
+		  (unsigned long long)cache->misses, cache->count));
 }
 
-static off_t vfs_gluster_lseek(struct vfs_handle_struct *handle,
-			       files_struct *fsp, off_t offset, int whence)
+/*
+ * Per process profiling of the VFS operations (glusterfs:profile).
+ *
+ * Every operation records its call count, failures, bytes moved and a
+ * latency histogram with power of two buckets (bucket n counts calls
+ * that took less than 2^n usec, the last one everything slower). All
+ * VFS calls of an smbd come from its main thread, so the counters are
+ * plain stores without locks; each operation has its own 256 byte slot
+ * so that nothing shares a cache line.
+ *
+ * Asynchronous requests are timed from submission to completion.
+ *
+ * With glusterfs:profile_export the counters live in a shared mapping
+ * of <lock dir>/glusterfs/profile.<pid> that tools can read while smbd
+ * runs. The totals are also logged at debug level 1 when the last
+ * profiled tree connect of the process goes away.
+ */
+
+#define GLUSTER_PROF_OPS(OP) \
+	OP(connect) OP(disconnect) OP(disk_free) OP(statvfs) \
+	OP(get_shadow_copy_data) \
+	OP(opendir) OP(fdopendir) OP(readdir) OP(seekdir) OP(rewinddir) \
+	OP(mkdir) OP(rmdir) OP(closedir) \
+	OP(open) OP(close) OP(read) OP(pread) OP(write) OP(pwrite) \
+	OP(lseek) OP(sendfile) OP(recvfile) OP(rename) OP(fsync) \
+	OP(stat) OP(fstat) OP(lstat) OP(unlink) \
+	OP(chmod) OP(fchmod) OP(chown) OP(fchown) OP(lchown) \
+	OP(chdir) OP(getwd) OP(ntimes) OP(ftruncate) OP(fallocate) \
+	OP(lock) OP(linux_setlease) OP(getlock) \
+	OP(symlink) OP(readlink) OP(link) OP(mknod) OP(realpath) \
+	OP(notify_watch) \
+	OP(get_real_filename) OP(copychunk) OP(set_zero_data) \
+	OP(getxattr) OP(lgetxattr) OP(fgetxattr) \
+	OP(listxattr) OP(llistxattr) OP(flistxattr) \
+	OP(removexattr) OP(lremovexattr) OP(fremovexattr) \
+	OP(setxattr) OP(lsetxattr) OP(fsetxattr) \
+	OP(aio_read) OP(aio_write) OP(aio_fsync) \
+	OP(sys_acl_get_file) OP(sys_acl_get_fd) OP(sys_acl_set_file) \
+	OP(sys_acl_set_fd) OP(sys_acl_delete_def_file)
+
+#define GLUSTER_PROF_ENUM(op) GLUSTER_PROF_##op,
+#define GLUSTER_PROF_NAME(op) #op,
+
+enum gluster_prof_op {
+	GLUSTER_PROF_OPS(GLUSTER_PROF_ENUM)
+	GLUSTER_PROF_NUM_OPS
+};
+
+static const char *gluster_prof_names[] = {
+	GLUSTER_PROF_OPS(GLUSTER_PROF_NAME)
+};
+
+#define GLUSTER_PROF_MAGIC 0x474c5052 /* "GLPR" */
+#define GLUSTER_PROF_VERSION 1
+#define GLUSTER_PROF_BUCKETS 23
+#define GLUSTER_PROF_NAMELEN 32
+
+/* layout of the exported segment, keep in sync with external readers */
+
+struct gluster_prof_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_ops;
+	uint32_t num_buckets;
+	uint64_t pid;
+	uint64_t started;		/* time_t */
+	char pad[224];
+};
+
+struct gluster_prof_stats {
+	char name[GLUSTER_PROF_NAMELEN];
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[GLUSTER_PROF_BUCKETS];
+};
+
+struct gluster_prof_segment {
+	struct gluster_prof_header header;
+	struct gluster_prof_stats ops[GLUSTER_PROF_NUM_OPS];
+};
+
+/* NULL unless profiling is on */
+static struct gluster_prof_segment *gluster_prof;
+static char *gluster_prof_path;
+static int gluster_prof_users;
+
+static char *gluster_prof_export_path(void)
 {
-	return glfs_lseek(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), offset, whence);
+	char *dir;
+	char *path;
+
+	dir = lock_path("glusterfs");
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		DEBUG(1, ("profile: mkdir(%s) failed: %s\n",
+			  dir, strerror(errno)));
+		TALLOC_FREE(dir);
+		return NULL;
+	}
+
+	path = talloc_asprintf(NULL, "%s/profile.%d", dir, (int)getpid());
+	TALLOC_FREE(dir);
+
+	return path;
 }
 
-static ssize_t vfs_gluster_sendfile(struct vfs_handle_struct *handle, int tofd,
-				    files_struct *fromfsp,
-				    const DATA_BLOB *hdr,
-				    off_t offset, size_t n)
+static bool gluster_prof_init(bool export)
 {
-	errno = ENOTSUP;
-	return -1;
+	struct gluster_prof_segment *seg;
+	size_t size = sizeof(struct gluster_prof_segment);
+	int fd = -1;
+	int i;
+
+	if (gluster_prof != NULL) {
+		gluster_prof_users++;
+		return true;
+	}
+
+	if (export) {
+		gluster_prof_path = gluster_prof_export_path();
+	}
+
+	if (gluster_prof_path != NULL) {
+		fd = open(gluster_prof_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || ftruncate(fd, size) == -1) {
+			DEBUG(1, ("profile: cannot create %s: %s\n",
+				  gluster_prof_path, strerror(errno)));
+			if (fd != -1) {
+				close(fd);
+				unlink(gluster_prof_path);
+				fd = -1;
+			}
+			TALLOC_FREE(gluster_prof_path);
+		}
+	}
+
+	if (fd != -1) {
+		seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		close(fd);
+	} else {
+		seg = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (seg == MAP_FAILED) {
+		DEBUG(1, ("profile: mmap failed: %s\n", strerror(errno)));
+		if (gluster_prof_path != NULL) {
+			unlink(gluster_prof_path);
+			TALLOC_FREE(gluster_prof_path);
+		}
+		return false;
+	}
+
+	memset(seg, 0, size);
+	for (i = 0; i < GLUSTER_PROF_NUM_OPS; i++) {
+		strlcpy(seg->ops[i].name, gluster_prof_names[i],
+			GLUSTER_PROF_NAMELEN);
+	}
+	seg->header.version = GLUSTER_PROF_VERSION;
+	seg->header.num_ops = GLUSTER_PROF_NUM_OPS;
+	seg->header.num_buckets = GLUSTER_PROF_BUCKETS;
+	seg->header.pid = getpid();
+	seg->header.started = time(NULL);
+	/* readers check the magic last */
+	seg->header.magic = GLUSTER_PROF_MAGIC;
+
+	gluster_prof = seg;
+	gluster_prof_users = 1;
+
+	return true;
 }
 
-static ssize_t vfs_gluster_recvfile(struct vfs_handle_struct *handle,
-				    int fromfd, files_struct *tofsp,
-				    off_t offset, size_t n)
+static void gluster_prof_dump(void)
 {
-	errno = ENOTSUP;
-	return -1;
+	struct gluster_prof_stats *stats;
+	char buf[GLUSTER_PROF_BUCKETS * 24];
+	size_t len;
+	int i, b;
+
+	for (i = 0; i < GLUSTER_PROF_NUM_OPS; i++) {
+		stats = &gluster_prof->ops[i];
+		if (stats->count == 0) {
+			continue;
+		}
+
+		len = 0;
+		buf[0] = '\0';
+		for (b = 0; b < GLUSTER_PROF_BUCKETS; b++) {
+			if (stats->buckets[b] == 0) {
+				continue;
+			}
+			len += snprintf(buf + len, sizeof(buf) - len,
+					" %s%lluus:%llu",
+					b == GLUSTER_PROF_BUCKETS - 1 ?
+					">=" : "<",
+					1ULL << (b == GLUSTER_PROF_BUCKETS - 1 ?
+						 b - 1 : b),
+					(unsigned long long)stats->buckets[b]);
+			if (len >= sizeof(buf)) {
+				break;
+			}
+		}
+
+		DEBUG(1, ("profile %s: %llu calls, %llu errors, %llu bytes, "
+			  "avg %lluus, max %lluus,%s\n", stats->name,
+			  (unsigned long long)stats->count,
+			  (unsigned long long)stats->errors,
+			  (unsigned long long)stats->bytes,
+			  (unsigned long long)(stats->total_ns /
+					       stats->count / 1000),
+			  (unsigned long long)(stats->max_ns / 1000), buf));
+	}
 }
 
-static int vfs_gluster_rename(struct vfs_handle_struct *handle,
-			      const struct smb_filename *smb_fname_src,
-			      const struct smb_filename *smb_fname_dst)
+static void gluster_prof_release(void)
 {
-	return glfs_rename(handle->data, smb_fname_src->base_name,
-			   smb_fname_dst->base_name);
+	if (gluster_prof == NULL || --gluster_prof_users > 0) {
+		return;
+	}
+
+	gluster_prof_dump();
+
+	munmap(gluster_prof, sizeof(struct gluster_prof_segment));
+	gluster_prof = NULL;
+
+	if (gluster_prof_path != NULL) {
+		unlink(gluster_prof_path);
+		TALLOC_FREE(gluster_prof_path);
+	}
 }
 
-static int vfs_gluster_fsync(struct vfs_handle_struct *handle,
-			     files_struct *fsp)
+static void gluster_prof_start(struct timespec *start)
 {
-	return glfs_fsync(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp));
+	if (gluster_prof != NULL) {
+		clock_gettime_mono(start);
+	} else {
+		ZERO_STRUCTP(start);
+	}
 }
 
-static int vfs_gluster_stat(struct vfs_handle_struct *handle,
-			    struct smb_filename *smb_fname)
+static void gluster_prof_record(enum gluster_prof_op op,
+				const struct timespec *start, bool failed,
+				uint64_t bytes)
 {
-	struct stat st;
-	int ret;
+	struct gluster_prof_stats *stats;
+	struct timespec now;
+	int64_t ns;
+	uint64_t us;
+	int b;
+
+	if (gluster_prof == NULL) {
+		return;
+	}
 
-	ret = glfs_stat(handle->data, smb_fname->base_name, &st);
-	if (ret == 0) {
-		smb_stat_ex_from_stat(&smb_fname->st, &st);
+	clock_gettime_mono(&now);
+	ns = nsec_time_diff(&now, start);
+	if (ns < 0) {
+		ns = 0;
 	}
-	if (ret < 0 && errno != ENOENT) {
-		DEBUG(0, ("glfs_stat(%s) failed: %s\n",
-			  smb_fname->base_name, strerror(errno)));
+
+	stats = &gluster_prof->ops[op];
+	stats->count++;
+	if (failed) {
+		stats->errors++;
 	}
-	return ret;
+	stats->bytes += bytes;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns) {
+		stats->max_ns = ns;
+	}
+
+	for (b = 0, us = ns / 1000; us != 0 && b < GLUSTER_PROF_BUCKETS - 1;
+	     us >>= 1) {
+		b++;
+	}
+	stats->buckets[b]++;
 }
 
-static int vfs_gluster_fstat(struct vfs_handle_struct *handle,
-			     files_struct *fsp, SMB_STRUCT_STAT *sbuf)
+/* for calls returning -1 (or any negative value) on failure */
+static int64_t gluster_prof_ret(enum gluster_prof_op op,
+				const struct timespec *start, int64_t ret)
 {
-	struct stat st;
-	int ret;
+	gluster_prof_record(op, start, ret < 0, 0);
+	return ret;
+}
 
-	ret = glfs_fstat(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), &st);
-	if (ret == 0) {
-		smb_stat_ex_from_stat(sbuf, &st);
-	}
-	if (ret < 0) {
-		DEBUG(0, ("glfs_fstat(%d) failed: %s\n",
-			  fsp->fh->fd, strerror(errno)));
-	}
+/* same, the result is a byte count */
+static int64_t gluster_prof_ret_bytes(enum gluster_prof_op op,
+				      const struct timespec *start,
+				      int64_t ret)
+{
+	gluster_prof_record(op, start, ret < 0, ret > 0 ? ret : 0);
 	return ret;
 }
 
-static int vfs_gluster_lstat(struct vfs_handle_struct *handle,
-			     struct smb_filename *smb_fname)
+/*
+ * The start time is a local of the calling function, so nested and
+ * concurrent calls each time themselves. GLUSTER_PROF_START declares
+ * it and goes with the declarations of a block.
+ */
+#define GLUSTER_PROF_START(op) \
+	struct timespec gluster_prof_ts_##op; \
+	gluster_prof_start(&gluster_prof_ts_##op)
+#define GLUSTER_PROF_END(op, failed, bytes) \
+	gluster_prof_record(GLUSTER_PROF_##op, &gluster_prof_ts_##op, \
+			    (failed), (bytes))
+#define GLUSTER_PROF_RET(op, ret) \
+	gluster_prof_ret(GLUSTER_PROF_##op, &gluster_prof_ts_##op, (ret))
+#define GLUSTER_PROF_RET_BYTES(op, ret) \
+	gluster_prof_ret_bytes(GLUSTER_PROF_##op, &gluster_prof_ts_##op, \
+			       (ret))
+
+/* per tree connect state, hangs off handle->data */
+
+#define DEFAULT_SENDFILE_BUFSIZE (256 * 1024)
+#define DEFAULT_RECVFILE_BUFSIZE (128 * 1024)
+#define DEFAULT_COPY_BUFSIZE (1024 * 1024)
+#define DEFAULT_READDIR_BATCH 128
+#define DEFAULT_READAHEAD_TRIGGER 2
+#define DEFAULT_WRITE_BEHIND_TIMEOUT 1000
+#define DEFAULT_ACL_CACHE_SIZE 4096
+/* the header and 500 entries */
+#define DEFAULT_ACL_BUFSIZE 4096
+#define DEFAULT_SNAPSHOT_LIST_TTL 60000
+#define DEFAULT_SNAPSHOT_CACHE_TTL 300000
+#define DEFAULT_SNAPSHOT_CACHE_SIZE 16
+
+struct glusterfs_conn {
+	glfs_t *fs;
+	struct glfs_preopened *preopened;
+
+	bool use_sendfile;
+	size_t sendfile_bufsize;
+	char *sendfile_buf;
+	uint64_t sendfile_calls;
+	uint64_t sendfile_bytes;
+
+	/* two buffers of recvfile_bufsize, one filling, one writing */
+	size_t recvfile_bufsize;
+	char *recvfile_buf;
+
+	/* same for server side copies */
+	size_t copy_bufsize;
+	char *copy_buf;
+
+	struct gluster_cache *stat_cache;
+	struct gluster_cache *name_cache;
+	struct gluster_cache *acl_cache;
+	struct gluster_cache *xattr_cache;
+
+	/* xattrs to cache, and to read along with a stat if prefetch */
+	const char **prefetch_xattrs;
+	bool prefetch;
+	/* open directory listings, see glusterfs_dir_listing() */
+	struct glusterfs_dir *dirs;
+
+	/* ACL xattrs are read into this, grown as needed */
+	size_t acl_bufsize;
+	char *acl_buf;
+
+	int readdir_batch;
+	bool readdir_lookahead;
+
+	/* per fd pipeline stage, 0 disables either side */
+	size_t readahead_window;
+	int readahead_trigger;
+	size_t write_behind_window;
+	/* msec pending writes are held at most */
+	int write_behind_timeout;
+	/* open fds, and how many of them hold pending writes */
+	struct glusterfs_fd *fds;
+	int wb_fds;
+
+	/* closed read-only fds, for reopens */
+	struct gluster_cache *fd_cache;
+
+	/* answer lock tests from the ranges each fd holds */
+	bool lock_cache;
+
+	/* msec, 0 disables the statvfs cache */
+	int statvfs_cache_ttl;
+	int statvfs_cache_max_age;
+
+	/* unlinks in flight at most, 0 for synchronous unlinks */
+	int async_unlink;
+	int metadata_threads;
+	struct glusterfs_meta_queue *meta_queue;
+
+	/* previous versions from snapshots */
+	bool shadow_copy;
+	int snapshot_list_ttl;
+	struct gluster_cache *snapshot_cache;
+
+	/* holds a reference on the profiling segment */
+	bool profile;
+
+#ifdef HAVE_GLFS_HANDLES
+	struct gluster_cache *handle_cache;
+	/* absolute, the handle cache is keyed by absolute paths */
+	char *cwd;
+#endif
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+	struct glusterfs_conn *prev, *next;
+#endif
+};
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+/* the connections of this process, for upcalls to reach their caches */
+static struct glusterfs_conn *glusterfs_conns;
+
+/* in the change notify code below */
+static bool glusterfs_upcall_init(struct glusterfs_conn *conn);
+#endif
+
+/*
+ * Allocate a page aligned I/O buffer, rounding *size up to a multiple
+ * of the page size.
+ */
+static char *glusterfs_alloc_iobuf(size_t *size, int count)
 {
-	struct stat st;
-	int ret;
+	size_t pagesize = getpagesize();
+	void *buf = NULL;
 
-	ret = glfs_lstat(handle->data, smb_fname->base_name, &st);
-	if (ret == 0) {
-		smb_stat_ex_from_stat(&smb_fname->st, &st);
-	}
-	if (ret < 0 && errno != ENOENT) {
-		DEBUG(0, ("glfs_lstat(%s) failed: %s\n",
-			  smb_fname->base_name, strerror(errno)));
+	*size = (*size + pagesize - 1) & ~(pagesize - 1);
+	if (posix_memalign(&buf, pagesize, *size * count)) {
+		return NULL;
 	}
-	return ret;
+
+	return buf;
 }
 
-static uint64_t vfs_gluster_get_alloc_size(struct vfs_handle_struct *handle,
-					   files_struct *fsp,
-					   const SMB_STRUCT_STAT *sbuf)
+static glfs_t *vfs_gluster_fs(struct vfs_handle_struct *handle)
 {
-	return sbuf->st_ex_blocks * 512;
+	return ((struct glusterfs_conn *)handle->data)->fs;
 }
 
-static int vfs_gluster_unlink(struct vfs_handle_struct *handle,
-			      const struct smb_filename *smb_fname)
+/* per fsp state, kept in the fsp extension */
+
+struct glusterfs_fd {
+	glfs_fd_t *glfd;
+
+	/*
+	 * The fsp: the extension data area is not a talloc chunk, so what
+	 * hangs off the fd is allocated on this and freed on close.
+	 */
+	TALLOC_CTX *mem_ctx;
+	files_struct *fsp;
+
+	/* in the connection's list of open fds */
+	struct glusterfs_conn *conn;
+	struct glusterfs_fd *prev, *next;
+
+	/* read ahead: one window of file data and the sequential detector */
+	char *ra_buf;
+	off_t ra_offset;
+	size_t ra_len;
+	off_t next_read;
+	int seq_reads;
+
+	/* write behind: adjacent small writes not yet sent */
+	char *wb_buf;
+	off_t wb_offset;
+	size_t wb_len;
+	/* error of a flush nobody could be told about yet */
+	int wb_errno;
+	/* sends them after write_behind_timeout */
+	struct tevent_timer *wb_timer;
+
+	/* ranges locked through this fd, with glusterfs:lock_cache */
+	struct glusterfs_lock_range *locks;
+
+	/* as opened, and whether it ever locked, for the fd cache */
+	int flags;
+	bool locked;
+};
+
+static struct glusterfs_fd *vfs_gluster_fetch_fd(struct vfs_handle_struct *handle,
+						 files_struct *fsp)
+{
+	return (struct glusterfs_fd *)VFS_FETCH_FSP_EXTENSION(handle, fsp);
+}
+
+static glfs_fd_t *vfs_gluster_fetch_glfd(struct vfs_handle_struct *handle,
+					 files_struct *fsp)
+{
+	return vfs_gluster_fetch_fd(handle, fsp)->glfd;
+}
+
+/* stat cache */
+
+#define DEFAULT_STAT_CACHE_SIZE 4096
+
+struct gluster_stat_entry {
+	SMB_STRUCT_STAT st;
+	/* lstat() semantics, the entry describes a symlink itself */
+	bool nofollow;
+};
+
+static struct gluster_cache *gluster_stat_cache(struct vfs_handle_struct *handle)
+{
+	return ((struct glusterfs_conn *)handle->data)->stat_cache;
+}
+
+static bool gluster_stat_cache_fetch(struct vfs_handle_struct *handle,
+				     const char *path, bool nofollow,
+				     SMB_STRUCT_STAT *st)
+{
+	struct gluster_stat_entry *entry;
+
+	entry = gluster_cache_lookup(gluster_stat_cache(handle), path);
+	if (entry == NULL) {
+		return false;
+	}
+
+	/* a stat() through a symlink tells nothing about the link */
+	if (nofollow && !entry->nofollow) {
+		return false;
+	}
+	/* an lstat() of a symlink tells nothing about its target */
+	if (!nofollow && entry->nofollow && S_ISLNK(entry->st.st_ex_mode)) {
+		return false;
+	}
+
+	*st = entry->st;
+	return true;
+}
+
+/*
+ * readdirplus hands out a zeroed stat for entries it could not look up,
+ * which must neither be cached nor passed on.
+ */
+static bool gluster_stat_valid(const SMB_STRUCT_STAT *st)
+{
+	return (st->st_ex_ino != 0) && ((st->st_ex_mode & S_IFMT) != 0);
+}
+
+static void gluster_stat_cache_store(struct vfs_handle_struct *handle,
+				     const char *path, bool nofollow,
+				     const SMB_STRUCT_STAT *st)
+{
+	struct gluster_cache *cache = gluster_stat_cache(handle);
+	struct gluster_stat_entry *entry;
+
+	if (cache == NULL || !gluster_stat_valid(st)) {
+		return;
+	}
+
+	entry = talloc(NULL, struct gluster_stat_entry);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->st = *st;
+	entry->nofollow = nofollow;
+
+	gluster_cache_add(cache, path, entry);
+}
+
+/* Drop the cached attributes of path and of the directory containing it. */
+static void gluster_stat_cache_invalidate(struct vfs_handle_struct *handle,
+					  const char *path)
+{
+	struct gluster_cache *cache = gluster_stat_cache(handle);
+	const char *p;
+	char *parent;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	gluster_cache_delete(cache, path);
+
+	p = strrchr(path, '/');
+	if (p == NULL) {
+		gluster_cache_delete(cache, ".");
+		return;
+	}
+
+	parent = talloc_strndup(NULL, path, p - path);
+	if (parent == NULL) {
+		/* better safe than stale */
+		gluster_cache_flush(cache);
+		return;
+	}
+	gluster_cache_delete(cache, parent[0] ? parent : "/");
+	TALLOC_FREE(parent);
+}
+
+static void gluster_stat_cache_invalidate_fsp(struct vfs_handle_struct *handle,
+					      files_struct *fsp)
+{
+	if (gluster_stat_cache(handle) == NULL) {
+		return;
+	}
+	gluster_cache_delete(gluster_stat_cache(handle),
+			     fsp->fsp_name->base_name);
+}
+
+/* real filename cache */
+
+/*
+ * Resolved case-insensitive lookups (and confirmed misses) of
+ * get_real_filename, keyed by the directory and the lower cased name.
+ * Windows clients probe for the same nonexistent names (desktop.ini,
+ * thumbs.db, ...) over and over.
+ */
+
+#define DEFAULT_NAME_CACHE_SIZE 4096
+
+struct gluster_name_entry {
+	/* NULL if the name is known not to exist */
+	char *found_name;
+};
+
+static struct gluster_cache *gluster_name_cache(struct vfs_handle_struct *handle)
+{
+	return ((struct glusterfs_conn *)handle->data)->name_cache;
+}
+
+static char *gluster_name_cache_key(TALLOC_CTX *mem_ctx, const char *dir,
+				    const char *name)
+{
+	char *lname;
+	char *key;
+
+	lname = strlower_talloc(mem_ctx, name);
+	if (lname == NULL) {
+		return NULL;
+	}
+
+	if (ISDOT(dir) || dir[0] == '\0') {
+		return lname;
+	}
+
+	key = talloc_asprintf(mem_ctx, "%s/%s", dir, lname);
+	TALLOC_FREE(lname);
+
+	return key;
+}
+
+/* A name was created or removed at path, forget what we knew about it. */
+static void gluster_name_cache_invalidate(struct vfs_handle_struct *handle,
+					  const char *path)
+{
+	struct gluster_cache *cache = gluster_name_cache(handle);
+	const char *p;
+	char *dir;
+	char *key;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	p = strrchr(path, '/');
+	if (p == NULL) {
+		key = gluster_name_cache_key(NULL, ".", path);
+	} else {
+		dir = talloc_strndup(NULL, path, p - path);
+		if (dir == NULL) {
+			gluster_cache_flush(cache);
+			return;
+		}
+		key = gluster_name_cache_key(dir, dir[0] ? dir : "/", p + 1);
+		key = talloc_steal(NULL, key);
+		TALLOC_FREE(dir);
+	}
+
+	if (key == NULL) {
+		gluster_cache_flush(cache);
+		return;
+	}
+
+	gluster_cache_delete(cache, key);
+	TALLOC_FREE(key);
+}
+
+/* xattr cache */
+
+/*
+ * Values, and confirmed absence, of the xattrs smbd reads for about
+ * every file it opens: the DOS attributes and the access ACL by
+ * default, see glusterfs:prefetch_xattrs. Only the listed names are
+ * cached, so a change to a path drops its entries with a few exact
+ * deletes. Keys are "<path>/<name>", and xattr names contain no '/', so
+ * a tree delete of a directory also drops what is cached below it.
+ */
+
+#define DEFAULT_XATTR_CACHE_SIZE 4096
+
+struct gluster_xattr_entry {
+	/* -1 if the file has no such xattr */
+	ssize_t len;
+	char *value;
+};
+
+static const char *default_prefetch_xattrs[] = {
+	SAMBA_XATTR_DOS_ATTRIB,
+	"system.posix_acl_access",
+	NULL
+};
+
+static struct gluster_cache *gluster_xattr_cache(struct vfs_handle_struct *handle)
+{
+	return ((struct glusterfs_conn *)handle->data)->xattr_cache;
+}
+
+static bool gluster_xattr_cached_name(struct vfs_handle_struct *handle,
+				      const char *name)
+{
+	struct glusterfs_conn *conn = handle->data;
+	const char **p;
+
+	for (p = conn->prefetch_xattrs; (p != NULL) && (*p != NULL); p++) {
+		if (strcmp(*p, name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static char *gluster_xattr_cache_key(TALLOC_CTX *mem_ctx, const char *path,
+				     const char *name)
+{
+	return talloc_asprintf(mem_ctx, "%s/%s", path, name);
+}
+
+/*
+ * Answer a getxattr from the cache, with its semantics for size 0 and
+ * short buffers. Returns false if the value is not cached.
+ */
+static bool gluster_xattr_cache_fetch(struct vfs_handle_struct *handle,
+				      const char *path, const char *name,
+				      void *value, size_t size,
+				      ssize_t *pret)
+{
+	struct gluster_cache *cache = gluster_xattr_cache(handle);
+	struct gluster_xattr_entry *entry;
+	char *key;
+
+	if ((cache == NULL) || !gluster_xattr_cached_name(handle, name)) {
+		return false;
+	}
+
+	key = gluster_xattr_cache_key(talloc_tos(), path, name);
+	if (key == NULL) {
+		return false;
+	}
+	entry = gluster_cache_lookup(cache, key);
+	TALLOC_FREE(key);
+
+	if (entry == NULL) {
+		return false;
+	}
+
+	if (entry->len == -1) {
+		errno = ENODATA;
+		*pret = -1;
+	} else if (size == 0) {
+		*pret = entry->len;
+	} else if (size < (size_t)entry->len) {
+		errno = ERANGE;
+		*pret = -1;
+	} else {
+		memcpy(value, entry->value, entry->len);
+		*pret = entry->len;
+	}
+
+	return true;
+}
+
+static void gluster_xattr_cache_store(struct vfs_handle_struct *handle,
+				      const char *path, const char *name,
+				      const void *value, ssize_t len)
+{
+	struct gluster_cache *cache = gluster_xattr_cache(handle);
+	struct gluster_xattr_entry *entry;
+	char *key;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	entry = talloc_zero(NULL, struct gluster_xattr_entry);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->len = len;
+	if (len > 0) {
+		entry->value = talloc_memdup(entry, value, len);
+		if (entry->value == NULL) {
+			talloc_free(entry);
+			return;
+		}
+	}
+
+	key = gluster_xattr_cache_key(talloc_tos(), path, name);
+	if (key == NULL) {
+		talloc_free(entry);
+		return;
+	}
+	gluster_cache_add(cache, key, entry);
+	TALLOC_FREE(key);
+}
+
+/* The xattrs of path may have changed, or it was created or removed. */
+static void gluster_xattr_cache_invalidate(struct vfs_handle_struct *handle,
+					   const char *path)
+{
+	struct glusterfs_conn *conn = handle->data;
+	const char **p;
+	char *key;
+
+	if (conn->xattr_cache == NULL) {
+		return;
+	}
+
+	for (p = conn->prefetch_xattrs; (p != NULL) && (*p != NULL); p++) {
+		key = gluster_xattr_cache_key(talloc_tos(), path, *p);
+		if (key == NULL) {
+			gluster_cache_flush(conn->xattr_cache);
+			return;
+		}
+		gluster_cache_delete(conn->xattr_cache, key);
+		TALLOC_FREE(key);
+	}
+}
+
+/* metadata prefetch */
+
+/*
+ * Opening a file, smbd stats it and then reads the cached xattrs one
+ * after the other, each a round trip. With glusterfs:prefetch a stat
+ * that misses the stat cache reads those xattrs at the same time, on
+ * the worker pool, so that the whole lookup costs one round trip
+ * and the following getxattr calls are answered from the xattr cache.
+ * The threads only call gfapi, which is thread safe, into buffers the
+ * main thread owns. Stats of entries of a directory that is being
+ * listed are not followed by those reads, and don't prefetch.
+ *
+ * Values are cached under the name smbd asks for, which for snapshots
+ * is not the one they are read by.
+ */
+
+#define XATTR_PREFETCH_BUFSIZE 4096
+
+struct glusterfs_prefetch_job {
+	glfs_t *fs;
+	/* read by path, cached by key */
+	const char *path;
+	const char *key;
+	const char *name;
+	char *buf;
+	ssize_t ret;
+	int err;
+	struct glusterfs_work work;
+};
+
+struct glusterfs_prefetch {
+	struct glusterfs_prefetch_job *jobs;
+	int count;
+	/* false if the caller has to read them itself */
+	bool queued;
+	struct glusterfs_batch batch;
+};
+
+static void glusterfs_prefetch_run(void *private_data)
+{
+	struct glusterfs_prefetch_job *job = private_data;
+
+	job->ret = glfs_getxattr(job->fs, job->path, job->name, job->buf,
+				 XATTR_PREFETCH_BUFSIZE);
+	job->err = (job->ret == -1) ? errno : 0;
+}
+
+/* in the directory code below */
+static bool glusterfs_dir_listing(struct glusterfs_conn *conn,
+				  const char *path);
+
+static struct glusterfs_prefetch *glusterfs_prefetch_start(
+						struct vfs_handle_struct *handle,
+						const char *key,
+						const char *path)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_prefetch *p;
+	struct glusterfs_prefetch_job *jobs;
+	int count;
+	int i;
+
+	if (!conn->prefetch || (conn->xattr_cache == NULL) ||
+	    glusterfs_dir_listing(conn, key)) {
+		return NULL;
+	}
+
+	count = str_list_length(conn->prefetch_xattrs);
+	if (count == 0) {
+		return NULL;
+	}
+
+	p = talloc_zero(talloc_tos(), struct glusterfs_prefetch);
+	if (p == NULL) {
+		return NULL;
+	}
+	jobs = talloc_zero_array(p, struct glusterfs_prefetch_job, count);
+	if (jobs == NULL) {
+		TALLOC_FREE(p);
+		return NULL;
+	}
+	p->jobs = jobs;
+	p->count = count;
+
+	for (i = 0; i < count; i++) {
+		jobs[i].fs = conn->fs;
+		jobs[i].path = path;
+		jobs[i].key = key;
+		jobs[i].name = conn->prefetch_xattrs[i];
+		jobs[i].buf = talloc_array(jobs, char, XATTR_PREFETCH_BUFSIZE);
+		if (jobs[i].buf == NULL) {
+			TALLOC_FREE(p);
+			return NULL;
+		}
+	}
+
+	/* without workers the caller reads them later */
+	p->queued = glusterfs_pool_start(count);
+	if (p->queued) {
+		for (i = 0; i < count; i++) {
+			glusterfs_pool_queue(&p->batch, &jobs[i].work,
+					     glusterfs_prefetch_run, &jobs[i]);
+		}
+	}
+
+	return p;
+}
+
+static void glusterfs_prefetch_finish(struct vfs_handle_struct *handle,
+				      struct glusterfs_prefetch *p,
+				      bool found)
+{
+	struct glusterfs_prefetch_job *jobs = p->jobs;
+	int saved_errno = errno;
+	int i;
+
+	if (p->queued) {
+		glusterfs_pool_wait(&p->batch);
+	}
+
+	for (i = 0; i < p->count && found; i++) {
+		if (!p->queued) {
+			glusterfs_prefetch_run(&jobs[i]);
+		}
+		if (jobs[i].ret >= 0) {
+			gluster_xattr_cache_store(handle, jobs[i].key,
+						  jobs[i].name, jobs[i].buf,
+						  jobs[i].ret);
+		} else if (jobs[i].err == ENODATA) {
+			gluster_xattr_cache_store(handle, jobs[i].key,
+						  jobs[i].name, NULL, -1);
+		}
+		/* anything else, e.g. ERANGE, is left to the real call */
+	}
+
+	TALLOC_FREE(p);
+	errno = saved_errno;
+}
+
+/* object handle cache */
+
+/*
+ * gfapi resolves every path it is given component by component, so a
+ * metadata call deep in a share costs a lookup per directory level.
+ * With glusterfs:handle_cache_ttl the glfs_object of each path used is
+ * kept, keyed by its absolute path, and stat, lstat, getxattr, chmod
+ * and unlink go through the glfs_h_* calls on it. A new path is resolved
+ * from the cached handle of its parent, which resolving a child moves
+ * to the front of the LRU like any other use, so that the directories
+ * in use stay cached as long as anything below them is.
+ *
+ * A handle that went stale (ESTALE or ENOENT) is dropped and the call
+ * is repeated by path. Our own rename, unlink and rmdir drop what they
+ * make invalid, and so do rename and unlink upcalls when gfapi supports
+ * them; for renames by other clients without upcalls the TTL applies.
+ */
+
+#ifdef HAVE_GLFS_HANDLES
+
+#define DEFAULT_HANDLE_CACHE_SIZE 4096
+
+struct gluster_handle_entry {
+	struct glfs_object *obj;
+	/* S_IFMT bits of the object, handles never follow symlinks */
+	mode_t type;
+	unsigned char gfid[GFAPI_HANDLE_LENGTH];
+};
+
+static int gluster_handle_entry_destructor(struct gluster_handle_entry *h)
+{
+	glfs_h_close(h->obj);
+	return 0;
+}
+
+/*
+ * The cache key of path: absolute, without "." components. NULL for
+ * paths that are not handled, e.g. with "..".
+ */
+static char *glusterfs_handle_key(TALLOC_CTX *mem_ctx,
+				  struct glusterfs_conn *conn,
+				  const char *path)
+{
+	const char *p = path;
+	char *key;
+	size_t len;
+
+	if (conn->cwd == NULL) {
+		return NULL;
+	}
+
+	while (p[0] == '.' && p[1] == '/') {
+		p += 2;
+	}
+
+	if (p[0] == '/') {
+		key = talloc_strdup(mem_ctx, p);
+	} else if (ISDOT(p) || p[0] == '\0') {
+		key = talloc_strdup(mem_ctx, conn->cwd);
+	} else if (strcmp(conn->cwd, "/") == 0) {
+		key = talloc_asprintf(mem_ctx, "/%s", p);
+	} else {
+		key = talloc_asprintf(mem_ctx, "%s/%s", conn->cwd, p);
+	}
+	if (key == NULL) {
+		return NULL;
+	}
+
+	len = strlen(key);
+	while (len > 1 && key[len - 1] == '/') {
+		key[--len] = '\0';
+	}
+
+	if (strstr(key, "//") || strstr(key, "/./") || strstr(key, "/../") ||
+	    (len >= 2 && strcmp(key + len - 2, "/.") == 0) ||
+	    (len >= 3 && strcmp(key + len - 3, "/..") == 0)) {
+		TALLOC_FREE(key);
+	}
+
+	return key;
+}
+
+static struct gluster_handle_entry *glusterfs_handle_resolve(
+						struct glusterfs_conn *conn,
+						const char *key)
+{
+	struct gluster_handle_entry *h;
+	struct gluster_handle_entry *parent;
+	struct glfs_object *obj;
+	struct stat st;
+	char *dir;
+	const char *p;
+
+	h = gluster_cache_lookup(conn->handle_cache, key);
+	if (h != NULL) {
+		return h;
+	}
+
+	if (strcmp(key, "/") == 0) {
+		obj = glfs_h_lookupat(conn->fs, NULL, "/", &st, 0);
+	} else {
+		p = strrchr(key, '/');
+		dir = (p == key) ? talloc_strdup(talloc_tos(), "/") :
+			talloc_strndup(talloc_tos(), key, p - key);
+		if (dir == NULL) {
+			return NULL;
+		}
+		parent = glusterfs_handle_resolve(conn, dir);
+		TALLOC_FREE(dir);
+		if (parent == NULL || !S_ISDIR(parent->type)) {
+			return NULL;
+		}
+		obj = glfs_h_lookupat(conn->fs, parent->obj, p + 1, &st, 0);
+	}
+	if (obj == NULL) {
+		return NULL;
+	}
+
+	h = talloc_zero(NULL, struct gluster_handle_entry);
+	if (h == NULL) {
+		glfs_h_close(obj);
+		return NULL;
+	}
+	h->obj = obj;
+	h->type = st.st_mode & S_IFMT;
+	talloc_set_destructor(h, gluster_handle_entry_destructor);
+
+	if (glfs_h_extract_handle(obj, h->gfid, GFAPI_HANDLE_LENGTH) < 0) {
+		TALLOC_FREE(h);
+		return NULL;
+	}
+
+	/* returned only while the cache holds it */
+	if (!gluster_cache_add(conn->handle_cache, key, h)) {
+		return NULL;
+	}
+
+	return h;
+}
+
+/*
+ * The cached handle of path, NULL if the caller has to go by path. With
+ * follow a symlink is not returned, its handle describes the link.
+ */
+static struct glfs_object *glusterfs_handle_get(struct vfs_handle_struct *handle,
+						const char *path, bool follow)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct gluster_handle_entry *h;
+	int saved_errno = errno;
+	char *key;
+
+	if (conn->handle_cache == NULL) {
+		return NULL;
+	}
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+	/* without invalidations handles of renamed paths live too long */
+	if (!conn->preopened->upcall_registered &&
+	    !glusterfs_upcall_init(conn)) {
+		gluster_cache_flush(conn->handle_cache);
+		TALLOC_FREE(conn->handle_cache);
+		return NULL;
+	}
+#endif
+
+	key = glusterfs_handle_key(talloc_tos(), conn, path);
+	if (key == NULL) {
+		errno = saved_errno;
+		return NULL;
+	}
+
+	h = glusterfs_handle_resolve(conn, key);
+	TALLOC_FREE(key);
+
+	/* a failed resolve is repeated by path, which sets errno */
+	errno = saved_errno;
+
+	if (h == NULL || (follow && S_ISLNK(h->type))) {
+		return NULL;
+	}
+
+	return h->obj;
+}
+
+/* path and everything below it were renamed or removed */
+static void glusterfs_handle_forget(struct vfs_handle_struct *handle,
+				    const char *path)
+{
+	struct glusterfs_conn *conn = handle->data;
+	char *key;
+
+	if (conn->handle_cache == NULL) {
+		return;
+	}
+
+	key = glusterfs_handle_key(talloc_tos(), conn, path);
+	if (key == NULL) {
+		/* relative to an unknown cwd, or with "..", be safe */
+		gluster_cache_flush(conn->handle_cache);
+		return;
+	}
+
+	gluster_cache_delete_tree(conn->handle_cache, key);
+	TALLOC_FREE(key);
+}
+
+static bool glusterfs_handle_stale(int err)
+{
+	return (err == ESTALE) || (err == ENOENT);
+}
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+
+/* Another client renamed or removed the object gfid on fs. */
+static void glusterfs_handle_upcall(glfs_t *fs, const unsigned char *gfid)
+{
+	struct glusterfs_conn *conn;
+	struct gluster_cache_entry *entry;
+	struct gluster_handle_entry *h;
+	char *key;
+	bool found;
+
+	for (conn = glusterfs_conns; conn != NULL; conn = conn->next) {
+		if (conn->fs != fs || conn->handle_cache == NULL) {
+			continue;
+		}
+
+		/* hard links may have several paths, restart after each */
+		do {
+			found = false;
+			for (entry = conn->handle_cache->lru; entry != NULL;
+			     entry = entry->next) {
+				h = entry->value;
+				if (memcmp(h->gfid, gfid,
+					   GFAPI_HANDLE_LENGTH) == 0) {
+					found = true;
+					break;
+				}
+			}
+			if (!found) {
+				break;
+			}
+			key = talloc_strdup(talloc_tos(), entry->key);
+			if (key == NULL) {
+				gluster_cache_flush(conn->handle_cache);
+				break;
+			}
+			gluster_cache_delete_tree(conn->handle_cache, key);
+			TALLOC_FREE(key);
+		} while (found);
+	}
+}
+
+/* Upcalls were lost. */
+static void glusterfs_handle_upcall_overflow(void)
+{
+	struct glusterfs_conn *conn;
+
+	for (conn = glusterfs_conns; conn != NULL; conn = conn->next) {
+		gluster_cache_flush(conn->handle_cache);
+	}
+}
+
+#endif /* HAVE_GLFS_UPCALL_REGISTER */
+
+#endif /* HAVE_GLFS_HANDLES */
+
+/*
+ * Path based calls that use the handle cache if they can.
+ */
+
+static int glusterfs_path_stat(struct vfs_handle_struct *handle,
+			       const char *path, bool follow, struct stat *st)
+{
+#ifdef HAVE_GLFS_HANDLES
+	struct glfs_object *obj = glusterfs_handle_get(handle, path, follow);
+
+	if (obj != NULL) {
+		if (glfs_h_stat(vfs_gluster_fs(handle), obj, st) == 0) {
+			return 0;
+		}
+		if (!glusterfs_handle_stale(errno)) {
+			return -1;
+		}
+		glusterfs_handle_forget(handle, path);
+	}
+#endif
+	if (follow) {
+		return glfs_stat(vfs_gluster_fs(handle), path, st);
+	}
+	return glfs_lstat(vfs_gluster_fs(handle), path, st);
+}
+
+static ssize_t glusterfs_path_getxattr(struct vfs_handle_struct *handle,
+				       const char *path, const char *name,
+				       void *value, size_t size)
+{
+#ifdef HAVE_GLFS_HANDLES
+	struct glfs_object *obj = glusterfs_handle_get(handle, path, true);
+	ssize_t ret;
+
+	if (obj != NULL) {
+		ret = glfs_h_getxattrs(vfs_gluster_fs(handle), obj, name,
+				       value, size);
+		if (ret >= 0 || !glusterfs_handle_stale(errno)) {
+			return ret;
+		}
+		glusterfs_handle_forget(handle, path);
+	}
+#endif
+	return glfs_getxattr(vfs_gluster_fs(handle), path, name, value, size);
+}
+
+static int glusterfs_path_chmod(struct vfs_handle_struct *handle,
+				const char *path, mode_t mode)
+{
+#ifdef HAVE_GLFS_HANDLES
+	struct glfs_object *obj = glusterfs_handle_get(handle, path, true);
+	struct stat st;
+
+	if (obj != NULL) {
+		ZERO_STRUCT(st);
+		st.st_mode = mode;
+		if (glfs_h_setattrs(vfs_gluster_fs(handle), obj, &st,
+				    GFAPI_SET_ATTR_MODE) == 0) {
+			return 0;
+		}
+		if (!glusterfs_handle_stale(errno)) {
+			return -1;
+		}
+		glusterfs_handle_forget(handle, path);
+	}
+#endif
+	return glfs_chmod(vfs_gluster_fs(handle), path, mode);
+}
+
+static int glusterfs_path_unlink(struct vfs_handle_struct *handle,
+				 const char *path)
+{
+#ifdef HAVE_GLFS_HANDLES
+	struct glfs_object *parent = NULL;
+	const char *p = strrchr(path, '/');
+	const char *name = (p == NULL) ? path : p + 1;
+	char *dir;
+	int ret;
+
+	glusterfs_handle_forget(handle, path);
+
+	if (p == NULL) {
+		dir = talloc_strdup(talloc_tos(), ".");
+	} else if (p == path) {
+		dir = talloc_strdup(talloc_tos(), "/");
+	} else {
+		dir = talloc_strndup(talloc_tos(), path, p - path);
+	}
+	if (dir != NULL) {
+		parent = glusterfs_handle_get(handle, dir, true);
+	}
+
+	if (parent != NULL) {
+		ret = glfs_h_unlink(vfs_gluster_fs(handle), parent, name);
+		if (ret == 0 || !glusterfs_handle_stale(errno)) {
+			TALLOC_FREE(dir);
+			return ret;
+		}
+		glusterfs_handle_forget(handle, dir);
+	}
+	TALLOC_FREE(dir);
+#endif
+	return glfs_unlink(vfs_gluster_fs(handle), path);
+}
+
+/*
+ * Asynchronous unlink.
+ *
+ * Deleting a tree from Windows is a long chain of single unlinks that
+ * smbd waits for one by one. With glusterfs:async_unlink = N up to N
+ * unlinks are handed to a small pool of threads and reported done at
+ * once, completions are collected in the main event loop. Jobs carry
+ * absolute paths, as shares on a shared volume graph move its working
+ * directory. Whatever could still see a queued name waits for it first:
+ * path based calls on the same name wait for that unlink, and rmdir,
+ * rename, opendir and name lookups wait for the whole queue.
+ *
+ * As the client is told about success at once, only unlinks that are
+ * expected to succeed are queued: of a file smbd has a stat of, in a
+ * directory that is not sticky and in which the same user unlinked a
+ * file synchronously within METADATA_DIR_TTL. Everything else is done
+ * synchronously and returns its error. A queued unlink that fails
+ * anyway is logged, and the directory is checked again.
+ *
+ * smbd switches users for all of its threads at once, so a job carries
+ * the credentials it was queued with and the worker sets them for its
+ * own gfapi calls with glfs_setfs*(). Without those, or when the
+ * credentials can't be read, unlinks are done synchronously.
+ */
+
+#define DEFAULT_METADATA_THREADS 4
+#define MAX_METADATA_THREADS 32
+#define METADATA_DIR_CACHE_SIZE 256
+#define METADATA_DIR_TTL 10000
+
+/* Effective credentials of a request. */
+struct glusterfs_creds {
+	uid_t uid;
+	gid_t gid;
+	int ngroups;
+	gid_t *groups;
+};
+
+/* The current effective credentials, groups allocated on mem_ctx. */
+static bool glusterfs_creds_get(TALLOC_CTX *mem_ctx,
+				struct glusterfs_creds *creds)
+{
+	int n;
+
+	creds->uid = geteuid();
+	creds->gid = getegid();
+	creds->ngroups = 0;
+	creds->groups = NULL;
+
+	n = getgroups(0, NULL);
+	if (n <= 0) {
+		return (n == 0);
+	}
+	creds->groups = talloc_array(mem_ctx, gid_t, n);
+	if (creds->groups == NULL) {
+		return false;
+	}
+	n = getgroups(n, creds->groups);
+	if (n < 0) {
+		TALLOC_FREE(creds->groups);
+		return false;
+	}
+	creds->ngroups = n;
+
+	return true;
+}
+
+static bool glusterfs_creds_equal(const struct glusterfs_creds *c1,
+				  const struct glusterfs_creds *c2)
+{
+	return c1->uid == c2->uid && c1->gid == c2->gid &&
+	       c1->ngroups == c2->ngroups &&
+	       (c1->ngroups == 0 ||
+		memcmp(c1->groups, c2->groups,
+		       c1->ngroups * sizeof(gid_t)) == 0);
+}
+
+/* FNV-1a over the supplementary groups. */
+static uint32_t glusterfs_creds_hash(const struct glusterfs_creds *creds)
+{
+	const unsigned char *p = (const unsigned char *)creds->groups;
+	size_t len = creds->ngroups * sizeof(gid_t);
+	uint32_t hash = GLUSTER_HASH_INIT;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+struct glusterfs_meta_job {
+	/* in the queue's pending list, main thread only */
+	struct glusterfs_meta_job *prev, *next;
+	/* in the work queue, under the mutex */
+	struct glusterfs_meta_job *work_next;
+	/* absolute */
+	char *path;
+	/* of the directory in the queue's dirs cache */
+	char *dir_key;
+	/* of the caller, groups on the job */
+	struct glusterfs_creds creds;
+	/* set by the worker, under the mutex */
+	int err;
+	bool done;
+};
+
+struct glusterfs_meta_queue {
+	glfs_t *fs;
+
+	pthread_mutex_t mutex;
+	/* jobs to pick up, or stopping */
+	pthread_cond_t work;
+	/* a job is done */
+	pthread_cond_t done;
+	struct glusterfs_meta_job *work_head, *work_tail;
+	bool stopping;
+
+	pthread_t threads[MAX_METADATA_THREADS];
+	int num_threads;
+
+	/* queued and not yet reaped, oldest first */
+	struct glusterfs_meta_job *pending;
+	int in_flight;
+	int max_in_flight;
+
+	/* directories unlinks are queued in, main thread only */
+	struct gluster_cache *dirs;
+
+	/* wakes the main thread for completions */
+	int pipe_read_fd;
+	int pipe_write_fd;
+	struct tevent_fd *fde;
+};
+
+static void *glusterfs_meta_thread(void *private_data)
+{
+	struct glusterfs_meta_queue *q = private_data;
+	struct glusterfs_meta_job *job;
+	int ret;
+	int err;
+
+	pthread_mutex_lock(&q->mutex);
+	for (;;) {
+		while (q->work_head == NULL && !q->stopping) {
+			pthread_cond_wait(&q->work, &q->mutex);
+		}
+		/* queued jobs are still done when stopping */
+		job = q->work_head;
+		if (job == NULL) {
+			break;
+		}
+		q->work_head = job->work_next;
+		if (q->work_head == NULL) {
+			q->work_tail = NULL;
+		}
+		pthread_mutex_unlock(&q->mutex);
+
+		/* per thread in gfapi, never unlink as someone else */
+#ifdef HAVE_GLFS_SETFSGROUPS
+		if (glfs_setfsuid(job->creds.uid) == -1 ||
+		    glfs_setfsgid(job->creds.gid) == -1 ||
+		    glfs_setfsgroups(job->creds.ngroups,
+				     job->creds.groups) == -1) {
+			ret = -1;
+		} else {
+			ret = glfs_unlink(q->fs, job->path);
+		}
+#else
+		errno = ENOSYS;
+		ret = -1;
+#endif
+		err = (ret == -1) ? errno : 0;
+
+		pthread_mutex_lock(&q->mutex);
+		job->err = err;
+		job->done = true;
+		pthread_cond_broadcast(&q->done);
+
+		/* non-blocking, a full pipe already wakes the main thread */
+		if (write(q->pipe_write_fd, "", 1) == -1) {
+			/* nothing to do */
+		}
+	}
+	pthread_mutex_unlock(&q->mutex);
+
+	return NULL;
+}
+
+/* Free the jobs that are done. */
+static void glusterfs_meta_reap(struct glusterfs_meta_queue *q)
+{
+	struct glusterfs_meta_job *job, *next;
+
+	pthread_mutex_lock(&q->mutex);
+	for (job = q->pending; job != NULL; job = next) {
+		next = job->next;
+		if (!job->done) {
+			continue;
+		}
+		if (job->err != 0) {
+			DEBUG(0, ("async glfs_unlink(%s) failed: %s\n",
+				  job->path, strerror(job->err)));
+			gluster_cache_delete(q->dirs, job->dir_key);
+		}
+		DLIST_REMOVE(q->pending, job);
+		q->in_flight--;
+		TALLOC_FREE(job);
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void glusterfs_meta_wait_job(struct glusterfs_meta_queue *q,
+				    struct glusterfs_meta_job *job)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (!job->done) {
+		pthread_cond_wait(&q->done, &q->mutex);
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void glusterfs_meta_handler(struct tevent_context *ev_ctx,
+				   struct tevent_fd *fde,
+				   uint16_t flags, void *private_data)
+{
+	struct glusterfs_meta_queue *q = private_data;
+	char buf[64];
+
+	while (sys_read(q->pipe_read_fd, buf, sizeof(buf)) > 0) {
+		/* drain */
+	}
+
+	glusterfs_meta_reap(q);
+}
+
+static int glusterfs_meta_queue_destructor(struct glusterfs_meta_queue *q)
+{
+	int i;
+
+	pthread_mutex_lock(&q->mutex);
+	q->stopping = true;
+	pthread_cond_broadcast(&q->work);
+	pthread_mutex_unlock(&q->mutex);
+
+	for (i = 0; i < q->num_threads; i++) {
+		pthread_join(q->threads[i], NULL);
+	}
+
+	/* log what failed */
+	glusterfs_meta_reap(q);
+
+	TALLOC_FREE(q->fde);
+	close(q->pipe_read_fd);
+	close(q->pipe_write_fd);
+	pthread_cond_destroy(&q->done);
+	pthread_cond_destroy(&q->work);
+	pthread_mutex_destroy(&q->mutex);
+
+	return 0;
+}
+
+static struct glusterfs_meta_queue *glusterfs_meta_queue_create(
+						struct glusterfs_conn *conn)
+{
+	struct glusterfs_meta_queue *q;
+	int fds[2];
+	int i;
+
+	if (pipe(fds) == -1) {
+		DEBUG(0, ("Failed to create unlink queue pipe (%s)\n",
+			  strerror(errno)));
+		return NULL;
+	}
+	set_blocking(fds[0], false);
+	set_blocking(fds[1], false);
+
+	q = talloc_zero(conn, struct glusterfs_meta_queue);
+	if (q == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	q->fs = conn->fs;
+	q->max_in_flight = conn->async_unlink;
+	q->dirs = gluster_cache_init(q, "unlink dir", METADATA_DIR_CACHE_SIZE,
+				     METADATA_DIR_TTL);
+	if (q->dirs == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		TALLOC_FREE(q);
+		return NULL;
+	}
+	q->pipe_read_fd = fds[0];
+	q->pipe_write_fd = fds[1];
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_cond_init(&q->done, NULL);
+	talloc_set_destructor(q, glusterfs_meta_queue_destructor);
+
+	q->fde = tevent_add_fd(server_event_context(), q, q->pipe_read_fd,
+			       TEVENT_FD_READ, glusterfs_meta_handler, q);
+	if (q->fde == NULL) {
+		TALLOC_FREE(q);
+		return NULL;
+	}
+
+	for (i = 0; i < conn->metadata_threads; i++) {
+		if (glusterfs_thread_create(&q->threads[q->num_threads],
+					    glusterfs_meta_thread, q) == 0) {
+			q->num_threads++;
+		}
+	}
+	if (q->num_threads == 0) {
+		DEBUG(0, ("Failed to start unlink threads, unlinking "
+			  "synchronously\n"));
+		TALLOC_FREE(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/* path made absolute against the current directory of fs. */
+static char *glusterfs_abspath(TALLOC_CTX *mem_ctx, glfs_t *fs,
+				 const char *path)
+{
+	char cwd[PATH_MAX];
+
+	if (path[0] == '/') {
+		return talloc_strdup(mem_ctx, path);
+	}
+	if (glfs_getcwd(fs, cwd, sizeof(cwd)) == NULL) {
+		return NULL;
+	}
+	while (path[0] == '.' && path[1] == '/') {
+		path += 2;
+	}
+	if (ISDOT(path) || path[0] == '\0') {
+		return talloc_strdup(mem_ctx, cwd);
+	}
+
+	return talloc_asprintf(mem_ctx, "%s%s%s", cwd,
+			       strcmp(cwd, "/") == 0 ? "" : "/", path);
+}
+
+/* The directory of the absolute path. */
+static char *glusterfs_meta_dir(TALLOC_CTX *mem_ctx, const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	if (p == NULL || p == path) {
+		return talloc_strdup(mem_ctx, "/");
+	}
+	return talloc_strndup(mem_ctx, path, p - path);
+}
+
+/* A synchronous unlink in dir succeeded, allow queueing there. */
+static void glusterfs_meta_dir_checked(struct glusterfs_meta_queue *q,
+				       const char *dir, const char *dir_key)
+{
+	struct stat st;
+	void *value;
+
+	/* in a sticky directory it depends on the owner of each file */
+	if (glfs_lstat(q->fs, dir, &st) == 0 && !(st.st_mode & S_ISVTX)) {
+		value = talloc_new(NULL);
+		if (value != NULL) {
+			gluster_cache_add(q->dirs, dir_key, value);
+		}
+	}
+}
+
+/* Unlink smb_fname, queued when it is expected to succeed. */
+static int glusterfs_meta_unlink(struct vfs_handle_struct *handle,
+				 const struct smb_filename *smb_fname)
+{
+	struct glusterfs_conn *conn = handle->data;
+	const char *path = smb_fname->base_name;
+	struct glusterfs_meta_queue *q;
+	struct glusterfs_meta_job *job;
+	char *abspath, *dir = NULL, *dir_key = NULL;
+	struct glusterfs_creds creds;
+	bool have_creds;
+	int ret;
+
+	if (conn->async_unlink <= 0) {
+		return glusterfs_path_unlink(handle, path);
+	}
+
+	if (conn->meta_queue == NULL) {
+		conn->meta_queue = glusterfs_meta_queue_create(conn);
+		if (conn->meta_queue == NULL) {
+			/* don't try again for every file */
+			conn->async_unlink = 0;
+			return glusterfs_path_unlink(handle, path);
+		}
+	}
+	q = conn->meta_queue;
+
+	abspath = glusterfs_abspath(q, q->fs, path);
+	if (abspath != NULL) {
+		dir = glusterfs_meta_dir(abspath, abspath);
+	}
+	have_creds = (abspath != NULL && glusterfs_creds_get(abspath, &creds));
+	if (dir != NULL && have_creds) {
+		/* per user, permissions differ */
+		dir_key = talloc_asprintf(abspath, "%u:%u:%08x:%s",
+					  (unsigned)creds.uid,
+					  (unsigned)creds.gid,
+					  (unsigned)glusterfs_creds_hash(&creds),
+					  dir);
+	}
+	if (dir_key == NULL || !VALID_STAT(smb_fname->st) ||
+	    S_ISDIR(smb_fname->st.st_ex_mode) ||
+	    gluster_cache_lookup(q->dirs, dir_key) == NULL) {
+		ret = glusterfs_path_unlink(handle, path);
+		if (ret == 0 && dir_key != NULL) {
+			glusterfs_meta_dir_checked(q, dir, dir_key);
+		}
+		TALLOC_FREE(abspath);
+		return ret;
+	}
+
+	glusterfs_meta_reap(q);
+	while (q->in_flight >= q->max_in_flight) {
+		glusterfs_meta_wait_job(q, q->pending);
+		glusterfs_meta_reap(q);
+	}
+
+	job = talloc_zero(q, struct glusterfs_meta_job);
+	if (job == NULL) {
+		TALLOC_FREE(abspath);
+		return glusterfs_path_unlink(handle, path);
+	}
+	job->path = talloc_steal(job, abspath);
+	job->dir_key = talloc_steal(job, dir_key);
+	job->creds = creds;
+	job->creds.groups = talloc_steal(job, creds.groups);
+
+#ifdef HAVE_GLFS_HANDLES
+	glusterfs_handle_forget(handle, path);
+#endif
+
+	DLIST_ADD_END(q->pending, job, struct glusterfs_meta_job *);
+	q->in_flight++;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->work_tail != NULL) {
+		q->work_tail->work_next = job;
+	} else {
+		q->work_head = job;
+	}
+	q->work_tail = job;
+	pthread_cond_signal(&q->work);
+	pthread_mutex_unlock(&q->mutex);
+
+	return 0;
+}
+
+/* Wait for a queued unlink of path. */
+static void glusterfs_meta_wait(struct vfs_handle_struct *handle,
+				const char *path)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_meta_queue *q = conn->meta_queue;
+	struct glusterfs_meta_job *job;
+	bool found = false;
+	char *abspath;
+
+	if (q == NULL || q->pending == NULL) {
+		return;
+	}
+
+	abspath = glusterfs_abspath(talloc_tos(), q->fs, path);
+	for (job = q->pending; job != NULL; job = job->next) {
+		/* without a path, wait for all of them */
+		if (abspath == NULL || strcmp(job->path, abspath) == 0) {
+			glusterfs_meta_wait_job(q, job);
+			found = true;
+		}
+	}
+	TALLOC_FREE(abspath);
+
+	if (found) {
+		glusterfs_meta_reap(q);
+	}
+}
+
+/* Wait for all queued unlinks. */
+static void glusterfs_meta_drain(struct vfs_handle_struct *handle)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_meta_queue *q = conn->meta_queue;
+	struct glusterfs_meta_job *job;
+
+	if (q == NULL || q->pending == NULL) {
+		return;
+	}
+
+	for (job = q->pending; job != NULL; job = job->next) {
+		glusterfs_meta_wait_job(q, job);
+	}
+	glusterfs_meta_reap(q);
+}
+
+/*
+ * Closed fd cache.
+ *
+ * Many clients open a file, read a little, close it and open it again
+ * right away. With glusterfs:fd_cache_ttl read-only fds are parked on
+ * close instead, keyed by path, and an open of the same path with the
+ * same flags by the same uid, gid and groups takes the parked fd back.
+ * An open for writing, unlink, rename and rmdir drop what they make
+ * invalid, and so do rename, unlink, mode, owner and xattr (ACL) upcalls
+ * where gfapi delivers them, matched to the parked fds by inode number;
+ * a reused fd skips the permission check of glfs_open. fds that took
+ * locks or a lease are always closed.
+ */
+
+#define DEFAULT_FD_CACHE_SIZE 64
+
+struct gluster_fd_entry {
+	glfs_fd_t *glfd;
+	int flags;
+	/* of the opener, groups on the entry */
+	struct glusterfs_creds creds;
+	/* of the file, for upcalls */
+	SMB_INO_T ino;
+};
+
+#ifdef HAVE_GLFS_LEASE
+/* in the lease code below */
+static struct glusterfs_lease *glusterfs_lease_find(files_struct *fsp);
+#endif
+
+static struct gluster_cache *gluster_fd_cache(struct vfs_handle_struct *handle)
+{
+	return ((struct glusterfs_conn *)handle->data)->fd_cache;
+}
+
+static int gluster_fd_entry_destructor(struct gluster_fd_entry *e)
+{
+	if (e->glfd != NULL) {
+		glfs_close(e->glfd);
+	}
+	return 0;
+}
+
+static bool glusterfs_fd_cache_flags(int flags)
+{
+	return ((flags & O_ACCMODE) == O_RDONLY) &&
+	       !(flags & (O_CREAT | O_TRUNC | O_EXCL | O_DIRECTORY));
+}
+
+/* A parked fd for an open of path with flags, NULL if none. */
+static glfs_fd_t *glusterfs_fd_cache_get(struct vfs_handle_struct *handle,
+					 const char *path, int flags)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct gluster_fd_entry *e;
+	struct glusterfs_creds creds;
+	glfs_fd_t *glfd;
+	bool match;
+
+	if (conn->fd_cache == NULL) {
+		return NULL;
+	}
+
+	if (!glusterfs_fd_cache_flags(flags)) {
+		/* may write, nobody should read through an old fd */
+		gluster_cache_delete(conn->fd_cache, path);
+		return NULL;
+	}
+
+	e = gluster_cache_lookup(conn->fd_cache, path);
+	if (e == NULL || e->flags != flags) {
+		return NULL;
+	}
+	if (!glusterfs_creds_get(talloc_tos(), &creds)) {
+		return NULL;
+	}
+	match = glusterfs_creds_equal(&e->creds, &creds);
+	TALLOC_FREE(creds.groups);
+	if (!match) {
+		return NULL;
+	}
+
+	glfd = e->glfd;
+	e->glfd = NULL;
+	gluster_cache_delete(conn->fd_cache, path);
+
+	/* smbd uses pread, but keep the fd looking new */
+	glfs_lseek(glfd, 0, SEEK_SET);
+
+	return glfd;
+}
+
+/* Park the fd of fsp instead of closing it, false if it needs a close. */
+static bool glusterfs_fd_cache_put(struct vfs_handle_struct *handle,
+				   files_struct *fsp, struct glusterfs_fd *fd)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct gluster_fd_entry *e;
+
+	if (conn->fd_cache == NULL || !glusterfs_fd_cache_flags(fd->flags) ||
+	    fd->locked || fsp->fsp_name->stream_name != NULL) {
+		return false;
+	}
+#ifdef HAVE_GLFS_LEASE
+	if (glusterfs_lease_find(fsp) != NULL) {
+		return false;
+	}
+#endif
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+	/* without invalidations replaced files are read for too long */
+	if (!conn->preopened->upcall_registered &&
+	    !glusterfs_upcall_init(conn)) {
+		gluster_cache_flush(conn->fd_cache);
+		TALLOC_FREE(conn->fd_cache);
+		return false;
+	}
+#endif
+
+	e = talloc_zero(NULL, struct gluster_fd_entry);
+	if (e == NULL) {
+		return false;
+	}
+	e->flags = fd->flags;
+	if (!glusterfs_creds_get(e, &e->creds)) {
+		TALLOC_FREE(e);
+		return false;
+	}
+	e->ino = fsp->fsp_name->st.st_ex_ino;
+
+	/* from here on the entry closes the fd, even if not added */
+	e->glfd = fd->glfd;
+	talloc_set_destructor(e, gluster_fd_entry_destructor);
+	gluster_cache_add(conn->fd_cache, fsp->fsp_name->base_name, e);
+
+	return true;
+}
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+/*
+ * The object gfid on fs was renamed, removed or had its permissions
+ * changed by another client, NULL if upcalls were lost. Gluster numbers
+ * inodes by the last 8 bytes of the gfid, most significant first, as
+ * gfid_to_ino() does.
+ */
+static void glusterfs_fd_cache_upcall(glfs_t *fs, const unsigned char *gfid)
+{
+	struct glusterfs_conn *conn;
+	struct gluster_cache_entry *entry, *next;
+	struct gluster_fd_entry *e;
+	uint64_t ino = 0;
+	int i;
+
+	if (gfid != NULL) {
+		for (i = 8; i < GFAPI_HANDLE_LENGTH; i++) {
+			ino = (ino << 8) | gfid[i];
+		}
+	}
+
+	for (conn = glusterfs_conns; conn != NULL; conn = conn->next) {
+		if (conn->fd_cache == NULL ||
+		    (gfid != NULL && conn->fs != fs)) {
+			continue;
+		}
+		if (gfid == NULL) {
+			gluster_cache_flush(conn->fd_cache);
+			continue;
+		}
+		for (entry = conn->fd_cache->lru; entry != NULL;
+		     entry = next) {
+			next = entry->next;
+			e = entry->value;
+			if ((uint64_t)e->ino == ino) {
+				gluster_cache_unlink(conn->fd_cache, entry);
+			}
+		}
+	}
+}
+#endif
+
+static void glusterfs_conn_free(void **data)
+{
+	struct glusterfs_conn *conn = *data;
+
+	SAFE_FREE(conn->sendfile_buf);
+	SAFE_FREE(conn->recvfile_buf);
+	SAFE_FREE(conn->copy_buf);
+	SAFE_FREE(conn->acl_buf);
+	talloc_free(conn);
+	*data = NULL;
+}
+
+/* volfile cache */
+
+/*
+ * Fetching the volfile from glusterd is a large part of glfs_init, and
+ * every forked smbd repeats it on its first tree connect. With
+ * glusterfs:volfile_cache the volfile of a successfully initialized graph
+ * is saved under the lock directory, and later connects within
+ * glusterfs:volfile_cache_ttl seconds build their graph from that local
+ * copy instead. The copy is kept per volfile server list and volume, and
+ * a graph that cannot be built from it is built from the servers.
+ *
+ * Such a graph has no management connection to glusterd: it does not
+ * learn about volfile changes (bricks added or replaced, options set)
+ * for as long as it lives, i.e. until the smbd that built it exits.
+ * This is the price of the shorter connect, the TTL only bounds how old
+ * the volfile of a new graph can be.
+ */
+
+#define DEFAULT_VOLFILE_CACHE_TTL 300
+
+static char *glfs_volfile_cache_path(TALLOC_CTX *mem_ctx,
+				     const char *volfile_server,
+				     const char *volume)
+{
+	char *dir;
+	char *path;
+
+	dir = lock_path("glusterfs");
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		DEBUG(1, ("volfile cache: mkdir(%s) failed: %s\n",
+			  dir, strerror(errno)));
+		TALLOC_FREE(dir);
+		return NULL;
+	}
+
+	/* the server list may contain anything, file names can't */
+	path = talloc_asprintf(mem_ctx, "%s/%s.%08x.vol", dir, volume,
+			       gluster_hash_str(GLUSTER_HASH_INIT,
+						volfile_server));
+	TALLOC_FREE(dir);
+
+	return path;
+}
+
+static bool glfs_volfile_cache_valid(const char *path, int ttl)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+
+	return (time(NULL) - st.st_mtime) < ttl;
+}
+
+static void glfs_volfile_cache_store(glfs_t *fs, const char *path)
+{
+#ifdef HAVE_GLFS_GET_VOLFILE
+	char *tmp = NULL;
+	char *buf = NULL;
+	ssize_t len;
+	int fd = -1;
+
+	/* A too small buffer returns the negated required size. */
+	len = glfs_get_volfile(fs, NULL, 0);
+	if (len >= 0) {
+		return;
+	}
+	len = -len;
+
+	buf = talloc_size(NULL, len);
+	if (buf == NULL) {
+		return;
+	}
+
+	len = glfs_get_volfile(fs, buf, len);
+	if (len <= 0) {
+		goto out;
+	}
+
+	tmp = talloc_asprintf(buf, "%s.XXXXXX", path);
+	if (tmp == NULL) {
+		goto out;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		goto out;
+	}
+
+	if (write_data(fd, buf, len) != len) {
+		DEBUG(1, ("volfile cache: write to %s failed: %s\n",
+			  tmp, strerror(errno)));
+		unlink(tmp);
+		goto out;
+	}
+
+	/* Readers only ever see a complete volfile. */
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto out;
+	}
+
+	DEBUG(5, ("volfile cache: stored %s\n", path));
+out:
+	if (fd != -1) {
+		close(fd);
+	}
+	talloc_free(buf);
+#endif
+}
+
+/* volfile servers */
+
+/*
+ * glusterfs:volfile_server takes a list of servers separated by spaces or
+ * commas, each of the form [transport+]server[:port], e.g.
+ *
+ *   glusterfs:volfile_server = unix+/var/run/glusterd.socket tcp+gs1:24007 gs2
+ *
+ * An IPv6 address with a port is written [address]:port, one without a
+ * port may also be given bare.
+ *
+ * TCP servers are probed with a non-blocking connect() in parallel, all
+ * within volfile_probe_timeout, and registered in order of their connect
+ * round-trip time. Servers that did not answer are left out as long as
+ * any other did, so dead servers cost neither a TCP timeout each nor a
+ * failed glfs_init each.
+ */
+
+#define DEFAULT_VOLFILE_PORT 24007
+#define DEFAULT_VOLFILE_PROBE_TIMEOUT 500 /* msec */
+
+struct glfs_volfile_server {
+	char *transport;
+	char *server;
+	int port;
+	int64_t rtt_us;		/* -1 when unreachable */
+};
+
+static bool glfs_parse_volfile_server(TALLOC_CTX *mem_ctx, const char *str,
+				      struct glfs_volfile_server *vs)
+{
+	const char *p;
+	char *port;
+	char *end;
+
+	ZERO_STRUCTP(vs);
+
+	p = strchr(str, '+');
+	if (p != NULL) {
+		vs->transport = talloc_strndup(mem_ctx, str, p - str);
+		str = p + 1;
+	} else {
+		vs->transport = talloc_strdup(mem_ctx, "tcp");
+	}
+	if (vs->transport == NULL) {
+		return false;
+	}
+
+	if (strcmp(vs->transport, "unix") == 0) {
+		/* the "server" is the socket path, there is no port */
+		vs->server = talloc_strdup(mem_ctx, str);
+		return (vs->server != NULL && vs->server[0] == '/');
+	}
+
+	if (strcmp(vs->transport, "tcp") != 0 &&
+	    strcmp(vs->transport, "rdma") != 0) {
+		DEBUG(0, ("Unknown volfile transport %s\n", vs->transport));
+		return false;
+	}
+
+	if (str[0] == '[') {
+		/* [ipv6-address]:port */
+		p = strchr(str, ']');
+		if (p == NULL) {
+			return false;
+		}
+		vs->server = talloc_strndup(mem_ctx, str + 1, p - str - 1);
+		port = (p[1] == ':') ? discard_const_p(char, p + 2) : NULL;
+	} else if ((p = strchr(str, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+		/* more than one colon is an IPv6 address without a port */
+		vs->server = talloc_strndup(mem_ctx, str, p - str);
+		port = discard_const_p(char, p + 1);
+	} else {
+		vs->server = talloc_strdup(mem_ctx, str);
+		port = NULL;
+	}
+	if (vs->server == NULL || vs->server[0] == '\0') {
+		return false;
+	}
+
+	vs->port = DEFAULT_VOLFILE_PORT;
+	if (port != NULL) {
+		vs->port = strtol(port, &end, 10);
+		if (*end != '\0' || vs->port <= 0 || vs->port > 65535) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int glfs_parse_volfile_servers(TALLOC_CTX *mem_ctx, const char *list,
+				      struct glfs_volfile_server **pservers)
+{
+	struct glfs_volfile_server *servers = NULL;
+	const char *ptr = list;
+	char *tok = NULL;
+	int count = 0;
+
+	while (next_token_talloc(mem_ctx, &ptr, &tok, " \t,")) {
+		servers = talloc_realloc(mem_ctx, servers,
+					 struct glfs_volfile_server, count + 1);
+		if (servers == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		if (!glfs_parse_volfile_server(servers, tok,
+					       &servers[count])) {
+			DEBUG(0, ("Invalid volfile server '%s'\n", tok));
+			TALLOC_FREE(tok);
+			TALLOC_FREE(servers);
+			errno = EINVAL;
+			return -1;
+		}
+
+		TALLOC_FREE(tok);
+		count++;
+	}
+
+	*pservers = servers;
+	return count;
+}
+
+static int glfs_volfile_server_cmp(const void *p1, const void *p2)
+{
+	const struct glfs_volfile_server *vs1 = p1;
+	const struct glfs_volfile_server *vs2 = p2;
+
+	if (vs1->rtt_us == vs2->rtt_us) {
+		return 0;
+	}
+	if (vs1->rtt_us == -1) {
+		return 1;
+	}
+	if (vs2->rtt_us == -1) {
+		return -1;
+	}
+
+	return (vs1->rtt_us < vs2->rtt_us) ? -1 : 1;
+}
+
+static int glfs_volfile_probe_start(const struct glfs_volfile_server *vs)
+{
+	struct addrinfo hints, *res = NULL;
+	char port[8];
+	int fd;
+	int ret;
+
+	ZERO_STRUCT(hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	snprintf(port, sizeof(port), "%d", vs->port);
+
+	/* name resolution is not covered by the probe timeout */
+	ret = getaddrinfo(vs->server, port, &hints, &res);
+	if (ret != 0) {
+		DEBUG(1, ("volfile server %s: %s\n", vs->server,
+			  gai_strerror(ret)));
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd == -1) {
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	set_blocking(fd, false);
+
+	ret = connect(fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+
+	if (ret == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Fill in rtt_us for every server and sort the list by it. unix sockets
+ * are local and always come first. Returns the number of servers that
+ * answered, which are the first ones of the list.
+ */
+static int glfs_probe_volfile_servers(struct glfs_volfile_server *servers,
+				      int count, int timeout_ms)
+{
+	struct pollfd *pfds;
+	struct timespec start, now;
+	int64_t elapsed_ms;
+	int pending = 0;
+	int reachable = 0;
+	int err;
+	socklen_t len;
+	int i;
+	int ret;
+
+	pfds = talloc_zero_array(NULL, struct pollfd, count);
+	if (pfds == NULL) {
+		return 0;
+	}
+
+	clock_gettime_mono(&start);
+
+	for (i = 0; i < count; i++) {
+		servers[i].rtt_us = -1;
+		pfds[i].fd = -1;
+
+		if (strcmp(servers[i].transport, "unix") == 0) {
+			servers[i].rtt_us = 0;
+			continue;
+		}
+
+		/* rdma servers still listen on tcp for the handshake */
+		pfds[i].fd = glfs_volfile_probe_start(&servers[i]);
+		pfds[i].events = POLLOUT;
+		if (pfds[i].fd != -1) {
+			pending++;
+		}
+	}
+
+	while (pending > 0) {
+		clock_gettime_mono(&now);
+		elapsed_ms = nsec_time_diff(&now, &start) / 1000000;
+		if (elapsed_ms >= timeout_ms) {
+			break;
+		}
+
+		ret = poll(pfds, count, timeout_ms - elapsed_ms);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+
+		clock_gettime_mono(&now);
+
+		for (i = 0; i < count; i++) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0) {
+				continue;
+			}
+
+			err = 0;
+			len = sizeof(err);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR,
+				       &err, &len) == 0 && err == 0) {
+				servers[i].rtt_us =
+					nsec_time_diff(&now, &start) / 1000;
+			}
+
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+			pending--;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pfds[i].fd != -1) {
+			close(pfds[i].fd);
+		}
+		if (servers[i].rtt_us != -1) {
+			reachable++;
+		}
+		DEBUG(5, ("volfile server %s+%s:%d rtt %lld us\n",
+			  servers[i].transport, servers[i].server,
+			  servers[i].port, (long long)servers[i].rtt_us));
+	}
+
+	TALLOC_FREE(pfds);
+
+	qsort(servers, count, sizeof(*servers), glfs_volfile_server_cmp);
+
+	return reachable;
+}
+
+/* xlator options */
+
+/*
+ * The client side translators of a graph can be tuned per share. A
+ * glusterfs:tuning_profile selects one of the option sets below, and
+ * glusterfs:xlator_option adds a list of xlator:option=value settings,
+ * which are applied after the profile and so take precedence over it.
+ * The xlator is a pattern as for glfs_set_xlator_option, usually
+ * "*-<type>", or "*-<type>-*" for the numbered replicate, disperse and
+ * client subvolumes, and options of translators that are not in the
+ * graph are ignored by gfapi. Options that change the graph itself,
+ * such as parallel-readdir, only take effect when set on the volume.
+ *
+ * glusterfs:event_threads sets the number of epoll threads gfapi
+ * handles the replies of the bricks on, through the client translators,
+ * before the explicit options.
+ */
+
+#define MAX_EVENT_THREADS 32
+
+struct glfs_xlator_option {
+	const char *xlator;
+	const char *key;
+	const char *value;
+};
+
+/*
+ * Many small files and directory listings (home directories): keep
+ * attributes for long, relying on cache-invalidation upcalls, which
+ * need features.cache-invalidation on the volume.
+ */
+static const struct glfs_xlator_option glfs_profile_metadata_heavy[] = {
+	{ "*-md-cache", "cache-invalidation", "true" },
+	{ "*-md-cache", "md-cache-timeout", "600" },
+	{ "*-md-cache", "cache-samba-metadata", "true" },
+	{ NULL, NULL, NULL }
+};
+
+/* Large files read and written sequentially (media, backups). */
+static const struct glfs_xlator_option glfs_profile_streaming[] = {
+	{ "*-read-ahead", "page-count", "16" },
+	{ "*-write-behind", "cache-size", "4MB" },
+	{ "*-write-behind", "flush-behind", "on" },
+	{ "*-io-cache", "cache-size", "256MB" },
+	{ NULL, NULL, NULL }
+};
+
+/*
+ * Few large files with random I/O from hypervisors, who do their own
+ * caching: honour O_DIRECT and keep the locks of replicated volumes
+ * across writes.
+ */
+static const struct glfs_xlator_option glfs_profile_vm_images[] = {
+	{ "*-write-behind", "strict-O_DIRECT", "on" },
+	{ "*-read-ahead", "page-count", "1" },
+	{ "*-replicate-*", "eager-lock", "on" },
+	{ "*-disperse-*", "eager-lock", "on" },
+	{ NULL, NULL, NULL }
+};
+
+static const struct {
+	const char *name;
+	const struct glfs_xlator_option *options;
+} glfs_tuning_profiles[] = {
+	{ "metadata-heavy", glfs_profile_metadata_heavy },
+	{ "streaming", glfs_profile_streaming },
+	{ "vm-images", glfs_profile_vm_images },
+};
+
+/*
+ * Collect the options of a share, NULL terminated, together with a key
+ * that is the same for shares tuned alike. Returns NULL for an unknown
+ * profile or a malformed option.
+ */
+static struct glfs_xlator_option *glfs_xlator_options(TALLOC_CTX *mem_ctx,
+						      int snum,
+						      const char **key)
+{
+	const struct glfs_xlator_option *profile = NULL;
+	struct glfs_xlator_option *options;
+	const char *name;
+	const char **list;
+	char *copy, *key_str, *value;
+	char *signature;
+	int event_threads;
+	int count = 0;
+	int i, n;
+
+	name = lp_parm_const_string(snum, "glusterfs", "tuning_profile", NULL);
+	if (name != NULL && *name != '\0') {
+		for (i = 0; i < ARRAY_SIZE(glfs_tuning_profiles); i++) {
+			if (strequal(name, glfs_tuning_profiles[i].name)) {
+				profile = glfs_tuning_profiles[i].options;
+				break;
+			}
+		}
+		if (profile == NULL) {
+			DEBUG(0, ("Unknown tuning profile '%s'\n", name));
+			errno = EINVAL;
+			return NULL;
+		}
+		while (profile[count].xlator != NULL) {
+			count++;
+		}
+	}
+
+	list = lp_parm_string_list(snum, "glusterfs", "xlator_option", NULL);
+
+	options = talloc_zero_array(mem_ctx, struct glfs_xlator_option,
+				    count + str_list_length(list) + 2);
+	if (options == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (n = 0; n < count; n++) {
+		options[n] = profile[n];
+	}
+
+	event_threads = lp_parm_int(snum, "glusterfs", "event_threads", 0);
+	if (event_threads > 0) {
+		options[n].xlator = "*-client-*";
+		options[n].key = "event-threads";
+		options[n].value = talloc_asprintf(options, "%d",
+				MIN(event_threads, MAX_EVENT_THREADS));
+		if (options[n].value == NULL) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		n++;
+	}
+
+	for (i = 0; list != NULL && list[i] != NULL; i++) {
+		copy = talloc_strdup(options, list[i]);
+		if (copy == NULL) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		key_str = strchr(copy, ':');
+		value = (key_str != NULL) ? strchr(key_str, '=') : NULL;
+		if (key_str == NULL || value == NULL || key_str == copy ||
+		    value == key_str + 1) {
+			DEBUG(0, ("Invalid xlator option '%s', expected "
+				  "xlator:option=value\n", list[i]));
+			errno = EINVAL;
+			goto fail;
+		}
+		*key_str++ = '\0';
+		*value++ = '\0';
+
+		options[n].xlator = copy;
+		options[n].key = key_str;
+		options[n].value = value;
+		n++;
+	}
+
+	signature = talloc_strdup(options, (name != NULL) ? name : "");
+	for (i = count; i < n && signature != NULL; i++) {
+		signature = talloc_asprintf_append(signature, ";%s:%s=%s",
+						   options[i].xlator,
+						   options[i].key,
+						   options[i].value);
+	}
+	if (signature == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	*key = signature;
+	return options;
+fail:
+	TALLOC_FREE(options);
+	return NULL;
+}
+
+/* CPU affinity */
+
+/*
+ * The epoll threads of a graph are started by glfs_init and inherit the
+ * CPU affinity of the thread creating them. With glusterfs:cpu_affinity
+ * each smbd, which serves one client, binds itself to cpus_per_client
+ * CPUs out of the given list before its first graph is initialized. The
+ * main thread, which submits the requests and completes them towards
+ * smbd, and the gfapi threads handling the replies then share those
+ * cores and their caches, instead of the completions bouncing between
+ * arbitrary CPUs. Clients are spread over the list by process id.
+ *
+ * This is done once per process, by the first tree connect.
+ */
+
+#define DEFAULT_CPUS_PER_CLIENT 2
+
+#ifdef HAVE_SCHED_SETAFFINITY
+static void glusterfs_set_affinity(int snum)
+{
+	static bool done;
+	const char **list;
+	cpu_set_t cpus;
+	int allowed[CPU_SETSIZE];
+	int count = 0;
+	int per_client;
+	int first;
+	long lo, hi;
+	char *end;
+	int i;
+
+	if (done) {
+		return;
+	}
+	done = true;
+
+	list = lp_parm_string_list(snum, "glusterfs", "cpu_affinity", NULL);
+	if (list == NULL) {
+		return;
+	}
+
+	/* a list of cpu or cpu-cpu */
+	for (i = 0; list[i] != NULL; i++) {
+		lo = strtol(list[i], &end, 10);
+		hi = lo;
+		if (end != list[i] && *end == '-') {
+			hi = strtol(end + 1, &end, 10);
+		}
+		if (end == list[i] || *end != '\0' || lo < 0 || hi < lo ||
+		    hi >= CPU_SETSIZE) {
+			DEBUG(0, ("Invalid CPU '%s' in glusterfs:cpu_affinity\n",
+				  list[i]));
+			return;
+		}
+		while (lo <= hi && count < CPU_SETSIZE) {
+			allowed[count++] = lo++;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	per_client = lp_parm_int(snum, "glusterfs", "cpus_per_client",
+				 DEFAULT_CPUS_PER_CLIENT);
+	per_client = MAX(1, MIN(per_client, count));
+	first = (getpid() % (count / per_client)) * per_client;
+
+	CPU_ZERO(&cpus);
+	for (i = first; i < first + per_client; i++) {
+		CPU_SET(allowed[i], &cpus);
+	}
+
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+		DEBUG(1, ("Failed to set CPU affinity (%s)\n",
+			  strerror(errno)));
+		return;
+	}
+
+	DEBUG(5, ("Bound to %d CPUs from CPU %d on\n", per_client,
+		  allowed[first]));
+}
+#else
+static void glusterfs_set_affinity(int snum)
+{
+	if (lp_parm_string_list(snum, "glusterfs", "cpu_affinity",
+				NULL) != NULL) {
+		DEBUG(1, ("glusterfs:cpu_affinity is not supported on this "
+			  "platform\n"));
+	}
+}
+#endif
+
+/*
+ * Create and initialize a graph for volume, either from the local volfile
+ * at cached_volfile or from the given volfile servers.
+ */
+static glfs_t *vfs_gluster_init_graph(struct vfs_handle_struct *handle,
+				      const char *volume,
+				      const struct glfs_volfile_server *servers,
+				      int num_servers,
+				      const char *cached_volfile,
+				      bool share_graph,
+				      const struct glfs_xlator_option *options)
+{
+	char *logfile;
+	int loglevel;
+	glfs_t *fs = NULL;
+	int ret = 0;
+	int i;
+
+	logfile = lp_parm_talloc_string(SNUM(handle->conn), "glusterfs",
+				       "logfile", NULL);
+
+	loglevel = lp_parm_int(SNUM(handle->conn), "glusterfs", "loglevel", -1);
+
+	fs = glfs_new(volume);
+	if (fs == NULL) {
+		ret = -1;
+		goto done;
+	}
+
+	if (cached_volfile != NULL) {
+		ret = glfs_set_volfile(fs, cached_volfile);
+		if (ret < 0) {
+			DEBUG(0, ("Failed to set volfile %s\n", cached_volfile));
+			goto done;
+		}
+	} else {
+		for (i = 0; i < num_servers; i++) {
+			ret = glfs_set_volfile_server(fs, servers[i].transport,
+						      servers[i].server,
+						      servers[i].port);
+			if (ret < 0) {
+				DEBUG(0, ("Failed to set volfile_server "
+					  "%s+%s:%d\n", servers[i].transport,
+					  servers[i].server, servers[i].port));
+				goto done;
+			}
+		}
+	}
+
+	ret = glfs_set_xlator_option(fs, "*-md-cache", "cache-posix-acl",
+				     "true");
+	if (ret < 0) {
+		DEBUG(0, ("%s: Failed to set xlator options\n", volume));
+		goto done;
+	}
+
+
+	/*
+	 * A graph shared by several shares has no single entry path, .snaps
+	 * is then only listed at the root of the volume.
+	 */
+	if (!share_graph) {
+		ret = glfs_set_xlator_option(fs, "*-snapview-client",
+					     "snapdir-entry-path",
+					     handle->conn->connectpath);
+		if (ret < 0) {
+			DEBUG(0, ("%s: Failed to set xlator option:"
+				  " snapdir-entry-path\n", volume));
+			goto done;
+		}
+	}
+
+	for (i = 0; options[i].xlator != NULL; i++) {
+		ret = glfs_set_xlator_option(fs, options[i].xlator,
+					     options[i].key,
+					     options[i].value);
+		if (ret < 0) {
+			DEBUG(0, ("%s: Failed to set xlator option %s:%s=%s\n",
+				  volume, options[i].xlator, options[i].key,
+				  options[i].value));
+			goto done;
+		}
+		DEBUG(5, ("%s: xlator option %s:%s=%s\n", volume,
+			  options[i].xlator, options[i].key,
+			  options[i].value));
+	}
+
+	ret = glfs_set_logging(fs, logfile, loglevel);
+	if (ret < 0) {
+		DEBUG(0, ("%s: Failed to set logfile %s loglevel %d\n",
+			  volume, logfile, loglevel));
+		goto done;
+	}
+
+	ret = glfs_init(fs);
+	if (ret < 0) {
+		DEBUG(0, ("%s: Failed to initialize volume (%s)\n",
+			  volume, strerror(errno)));
+		goto done;
+	}
+done:
+	talloc_free(logfile);
+	if (ret < 0) {
+		if (fs)
+			glfs_fini(fs);
+		return NULL;
+	}
+
+	return fs;
+}
+
+/* Disk Operations */
+
+/* A buffer size option, def unless it is positive. */
+static size_t glusterfs_parm_bufsize(int snum, const char *option,
+				     size_t def)
+{
+	int size = lp_parm_int(snum, "glusterfs", option, (int)def);
+
+	if (size <= 0) {
+		return def;
+	}
+	return size;
+}
+
+static int vfs_gluster_connect(struct vfs_handle_struct *handle,
+			       const char *service,
+			       const char *user)
+{
+	const char *volfile_server;
+	const char *volume;
+	const char *connectpath;
+	struct glfs_volfile_server *servers = NULL;
+	int num_servers;
+	int reachable;
+	int per_graph;
+	int probe_timeout;
+	char *cache_path = NULL;
+	int cache_ttl = DEFAULT_VOLFILE_CACHE_TTL;
+	bool share_graph;
+	struct glfs_xlator_option *options = NULL;
+	const char *options_key = NULL;
+	int i;
+	struct glusterfs_conn *conn = NULL;
+	struct glfs_preopened *preopened = NULL;
+	glfs_t *fs = NULL;
+	int ret = 0;
+	/* GLUSTER_PROF_START, once profiling is set up */
+	struct timespec gluster_prof_ts_connect;
+
+	conn = talloc_zero(NULL, struct glusterfs_conn);
+	if (conn == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (lp_parm_bool(SNUM(handle->conn), "glusterfs", "profile", false)) {
+		conn->profile = gluster_prof_init(
+			lp_parm_bool(SNUM(handle->conn), "glusterfs",
+				     "profile_export", false));
+	}
+	gluster_prof_start(&gluster_prof_ts_connect);
+
+	conn->use_sendfile = lp_parm_bool(SNUM(handle->conn), "glusterfs",
+					  "sendfile", false);
+	conn->sendfile_bufsize = glusterfs_parm_bufsize(SNUM(handle->conn),
+							"sendfile_bufsize",
+							DEFAULT_SENDFILE_BUFSIZE);
+
+	conn->recvfile_bufsize = glusterfs_parm_bufsize(SNUM(handle->conn),
+							"recvfile_bufsize",
+							DEFAULT_RECVFILE_BUFSIZE);
+	conn->copy_bufsize = glusterfs_parm_bufsize(SNUM(handle->conn),
+						    "copychunk_bufsize",
+						    DEFAULT_COPY_BUFSIZE);
+
+	conn->readdir_batch = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					  "readdir_batch",
+					  DEFAULT_READDIR_BATCH);
+	if (conn->readdir_batch <= 0) {
+		conn->readdir_batch = 1;
+	}
+	conn->readdir_lookahead = lp_parm_bool(SNUM(handle->conn), "glusterfs",
+					       "readdir_lookahead", false);
+
+	conn->readahead_window = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					     "readahead_window", 0);
+	conn->readahead_trigger = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					      "readahead_trigger",
+					      DEFAULT_READAHEAD_TRIGGER);
+	conn->write_behind_window = lp_parm_int(SNUM(handle->conn), "glusterfs",
+						"write_behind_window", 0);
+	conn->write_behind_timeout = lp_parm_int(SNUM(handle->conn),
+						 "glusterfs",
+						 "write_behind_timeout",
+						 DEFAULT_WRITE_BEHIND_TIMEOUT);
+	if (conn->write_behind_timeout <= 0) {
+		conn->write_behind_timeout = DEFAULT_WRITE_BEHIND_TIMEOUT;
+	}
+
+	conn->stat_cache = gluster_cache_init(conn, "stat",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "stat_cache_size", DEFAULT_STAT_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "stat_cache_ttl", 0));
+
+	conn->name_cache = gluster_cache_init(conn, "real filename",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "real_filename_cache_size",
+				    DEFAULT_NAME_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "real_filename_cache_ttl", 0));
+
+	conn->acl_cache = gluster_cache_init(conn, "acl",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "acl_cache_size", DEFAULT_ACL_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "acl_cache_ttl", 0));
+	conn->acl_bufsize = DEFAULT_ACL_BUFSIZE;
+
+	conn->xattr_cache = gluster_cache_init(conn, "xattr",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "xattr_cache_size",
+				    DEFAULT_XATTR_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "xattr_cache_ttl", 0));
+	conn->prefetch_xattrs = str_list_copy(conn,
+			lp_parm_string_list(SNUM(handle->conn), "glusterfs",
+					    "prefetch_xattrs",
+					    default_prefetch_xattrs));
+	conn->prefetch = lp_parm_bool(SNUM(handle->conn), "glusterfs",
+				      "prefetch", false);
+
+	conn->fd_cache = gluster_cache_init(conn, "fd",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "fd_cache_size", DEFAULT_FD_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "fd_cache_ttl", 0));
+
+	conn->lock_cache = lp_parm_bool(SNUM(handle->conn), "glusterfs",
+					"lock_cache", false);
+
+	conn->statvfs_cache_ttl = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					      "statvfs_cache_ttl", 0);
+	conn->statvfs_cache_max_age = lp_parm_int(SNUM(handle->conn),
+			"glusterfs", "statvfs_cache_max_age",
+			conn->statvfs_cache_ttl *
+			DEFAULT_STATVFS_MAX_AGE_FACTOR);
+
+	conn->async_unlink = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					 "async_unlink", 0);
+#ifndef HAVE_GLFS_SETFSGROUPS
+	if (conn->async_unlink > 0) {
+		DEBUG(1, ("glusterfs:async_unlink needs glfs_setfsgroups, "
+			  "unlinking synchronously\n"));
+		conn->async_unlink = 0;
+	}
+#endif
+	conn->metadata_threads = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					     "metadata_threads",
+					     DEFAULT_METADATA_THREADS);
+	conn->metadata_threads = MAX(1, MIN(conn->metadata_threads,
+					    MAX_METADATA_THREADS));
+
+	conn->shadow_copy = lp_parm_bool(SNUM(handle->conn), "glusterfs",
+					 "shadow_copy", false);
+	conn->snapshot_list_ttl = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					      "snapshot_list_ttl",
+					      DEFAULT_SNAPSHOT_LIST_TTL);
+	if (conn->shadow_copy) {
+		conn->snapshot_cache = gluster_cache_init(conn, "snapshot",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "snapshot_cache_size",
+				    DEFAULT_SNAPSHOT_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "snapshot_cache_ttl",
+				    DEFAULT_SNAPSHOT_CACHE_TTL));
+	}
+
+#ifdef HAVE_GLFS_HANDLES
+	conn->handle_cache = gluster_cache_init(conn, "handle",
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "handle_cache_size",
+				    DEFAULT_HANDLE_CACHE_SIZE),
+			lp_parm_int(SNUM(handle->conn), "glusterfs",
+				    "handle_cache_ttl", 0));
+#endif
+
+	volfile_server = lp_parm_const_string(SNUM(handle->conn), "glusterfs",
+					       "volfile_server", NULL);
+	if (volfile_server == NULL) {
+		volfile_server = DEFAULT_VOLFILE_SERVER;
+	}
+
+	volume = lp_parm_const_string(SNUM(handle->conn), "glusterfs", "volume",
+				      NULL);
+	if (volume == NULL) {
+		volume = service;
+	}
+
+	share_graph = lp_parm_bool(SNUM(handle->conn), "glusterfs",
+				   "share_volume_graph", false);
+	connectpath = share_graph ? "" : handle->conn->connectpath;
+
+	options = glfs_xlator_options(conn, SNUM(handle->conn), &options_key);
+	if (options == NULL) {
+		ret = -1;
+		goto done;
+	}
+
+	/* before any gfapi thread of this process is started */
+	glusterfs_set_affinity(SNUM(handle->conn));
+
+	preopened = glfs_find_preopened(volume, connectpath, options_key);
+	if (preopened) {
+		fs = preopened->fs;
+		goto done;
+	}
+
+	if (lp_parm_bool(SNUM(handle->conn), "glusterfs", "volfile_cache",
+			 false)) {
+		cache_path = glfs_volfile_cache_path(conn, volfile_server,
+						     volume);
+		cache_ttl = lp_parm_int(SNUM(handle->conn), "glusterfs",
+					"volfile_cache_ttl",
+					DEFAULT_VOLFILE_CACHE_TTL);
+	}
+
+	if (cache_path != NULL &&
+	    glfs_volfile_cache_valid(cache_path, cache_ttl)) {
+		fs = vfs_gluster_init_graph(handle, volume, NULL, 0,
+					    cache_path, share_graph, options);
+		if (fs == NULL) {
+			DEBUG(1, ("%s: cached volfile %s unusable, fetching "
+				  "from server\n", volume, cache_path));
+			unlink(cache_path);
+		} else {
+			DEBUG(5, ("%s: graph built from cached volfile\n",
+				  volume));
+		}
+	}
+
+	if (fs == NULL) {
+		num_servers = glfs_parse_volfile_servers(conn, volfile_server,
+							 &servers);
+		if (num_servers <= 0) {
+			DEBUG(0, ("%s: No usable volfile server in '%s'\n",
+				  volume, volfile_server));
+			ret = -1;
+			goto done;
+		}
+
+		if (num_servers > 1) {
+			probe_timeout = lp_parm_int(SNUM(handle->conn),
+						    "glusterfs",
+						    "volfile_probe_timeout",
+						    DEFAULT_VOLFILE_PROBE_TIMEOUT);
+			if (probe_timeout <= 0) {
+				probe_timeout = DEFAULT_VOLFILE_PROBE_TIMEOUT;
+			}
+			reachable = glfs_probe_volfile_servers(servers,
+							      num_servers,
+							      probe_timeout);
+			/* if none answered, the probes tell us nothing */
+			if (reachable > 0) {
+				num_servers = reachable;
+			}
+		}
+
+#ifdef HAVE_GLFS_UNSET_VOLFILE_SERVER
+		/* gfapi fails over between all registered servers itself */
+		per_graph = num_servers;
+#else
+		/* older gfapi only keeps the last server, try them in turn */
+		per_graph = 1;
+#endif
+		for (i = 0; fs == NULL && i < num_servers; i += per_graph) {
+			fs = vfs_gluster_init_graph(handle, volume, &servers[i],
+						    per_graph, NULL,
+						    share_graph, options);
+		}
+		TALLOC_FREE(servers);
+		if (fs == NULL) {
+			ret = -1;
+			goto done;
+		}
+
+		if (cache_path != NULL) {
+			glfs_volfile_cache_store(fs, cache_path);
+		}
+	}
+
+	preopened = glfs_set_preopened(volume, connectpath, options_key, fs);
+	if (preopened == NULL) {
+		DEBUG(0, ("%s: Failed to register volume (%s)\n",
+			  volume, strerror(errno)));
+		glfs_fini(fs);
+		ret = -1;
+		goto done;
+	}
+done:
+	GLUSTER_PROF_END(connect, ret < 0, 0);
+	if (ret < 0) {
+		if (conn->profile) {
+			gluster_prof_release();
+		}
+		talloc_free(conn);
+		return -1;
+	} else {
+		DEBUG(0, ("%s: Initialized volume from server %s\n",
+                         volume, volfile_server));
+		TALLOC_FREE(cache_path);
+		TALLOC_FREE(options);
+		conn->fs = fs;
+		conn->preopened = preopened;
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+		DLIST_ADD(glusterfs_conns, conn);
+#endif
+		SMB_VFS_HANDLE_SET_DATA(handle, conn, glusterfs_conn_free,
+					struct glusterfs_conn, goto no_data);
+		return 0;
+	}
+
+no_data:
+	/* what holds objects of the graph goes before its reference */
+	gluster_cache_flush(conn->fd_cache);
+#ifdef HAVE_GLFS_HANDLES
+	gluster_cache_flush(conn->handle_cache);
+#endif
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+	DLIST_REMOVE(glusterfs_conns, conn);
+#endif
+	glfs_clear_preopened(preopened);
+	if (conn->profile) {
+		gluster_prof_release();
+	}
+	talloc_free(conn);
+	return -1;
+}
+
+static void vfs_gluster_disconnect(struct vfs_handle_struct *handle)
+{
+	struct glusterfs_conn *conn = handle->data;
+
+	GLUSTER_PROF_START(disconnect);
+
+	if (conn->sendfile_calls) {
+		DEBUG(2, ("sendfile: %llu calls, %llu bytes sent\n",
+			  (unsigned long long)conn->sendfile_calls,
+			  (unsigned long long)conn->sendfile_bytes));
+	}
+
+	gluster_cache_report(conn->stat_cache);
+	gluster_cache_report(conn->name_cache);
+	gluster_cache_report(conn->acl_cache);
+	gluster_cache_report(conn->xattr_cache);
+
+	/* finishes the queued unlinks */
+	TALLOC_FREE(conn->meta_queue);
+
+	/* closes the parked fds */
+	gluster_cache_report(conn->fd_cache);
+	gluster_cache_flush(conn->fd_cache);
+
+	/* and the snapshot roots kept open */
+	gluster_cache_report(conn->snapshot_cache);
+	gluster_cache_flush(conn->snapshot_cache);
+
+#ifdef HAVE_GLFS_HANDLES
+	/* the handles have to be closed while fs is still there */
+	if (conn->handle_cache != NULL) {
+		gluster_cache_report(conn->handle_cache);
+		gluster_cache_flush(conn->handle_cache);
+	}
+#endif
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+	DLIST_REMOVE(glusterfs_conns, conn);
+#endif
+
+	glfs_clear_preopened(conn->preopened);
+
+	GLUSTER_PROF_END(disconnect, false, 0);
+	if (conn->profile) {
+		gluster_prof_release();
+		conn->profile = false;
+	}
+}
+
+static int glusterfs_statvfs(struct vfs_handle_struct *handle,
+			     const char *path, struct statvfs *st)
+{
+	struct glusterfs_conn *conn = handle->data;
+	char *abspath;
+	int ret;
+
+	if (conn->statvfs_cache_ttl <= 0) {
+		return glfs_statvfs(conn->fs, path, st);
+	}
+
+	/* smbd works relative to the share root */
+	if (path[0] == '/') {
+		abspath = talloc_strdup(talloc_tos(), path);
+	} else if (ISDOT(path)) {
+		abspath = talloc_strdup(talloc_tos(),
+					handle->conn->connectpath);
+	} else {
+		abspath = talloc_asprintf(talloc_tos(), "%s/%s",
+					  handle->conn->connectpath, path);
+	}
+	if (abspath == NULL) {
+		return glfs_statvfs(conn->fs, path, st);
+	}
+
+	if (glfs_statvfs_cache_fetch(conn->preopened, abspath,
+				     conn->statvfs_cache_ttl,
+				     conn->statvfs_cache_max_age, st)) {
+		TALLOC_FREE(abspath);
+		return 0;
+	}
+
+	ret = glfs_statvfs(conn->fs, path, st);
+	if (ret == 0) {
+		glfs_statvfs_cache_store(conn->preopened, abspath, st);
+	}
+	TALLOC_FREE(abspath);
+
+	return ret;
+}
+
+static uint64_t vfs_gluster_disk_free(struct vfs_handle_struct *handle,
+				      const char *path, bool small_query,
+				      uint64_t *bsize_p, uint64_t *dfree_p,
+				      uint64_t *dsize_p)
+{
+	struct statvfs statvfs = { 0, };
+	int ret;
+
+	GLUSTER_PROF_START(disk_free);
+	ret = GLUSTER_PROF_RET(disk_free,
+			       glusterfs_statvfs(handle, path, &statvfs));
+	if (ret < 0) {
+		DEBUG(0, ("glfs_statvfs(%s) failed: %s\n",
+			  path, strerror(errno)));
+		return -1;
+	}
+
+	if (bsize_p != NULL) {
+		*bsize_p = (uint64_t)statvfs.f_bsize; /* Block size */
+	}
+	if (dfree_p != NULL) {
+		*dfree_p = (uint64_t)statvfs.f_bavail; /* Available Block units */
+	}
+	if (dsize_p != NULL) {
+		*dsize_p = (uint64_t)statvfs.f_blocks; /* Total Block units */
+	}
+
+	return (uint64_t)statvfs.f_bavail;
+}
+
+static int vfs_gluster_get_quota(struct vfs_handle_struct *handle,
+				 enum SMB_QUOTA_TYPE qtype, unid_t id,
+				 SMB_DISK_QUOTA *qt)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static int
+vfs_gluster_set_quota(struct vfs_handle_struct *handle,
+		      enum SMB_QUOTA_TYPE qtype, unid_t id, SMB_DISK_QUOTA *qt)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static int vfs_gluster_statvfs(struct vfs_handle_struct *handle,
+			       const char *path,
+			       struct vfs_statvfs_struct *vfs_statvfs)
+{
+	struct statvfs statvfs = { 0, };
+	int ret;
+
+	GLUSTER_PROF_START(statvfs);
+	ret = GLUSTER_PROF_RET(statvfs,
+			       glusterfs_statvfs(handle, path, &statvfs));
+	if (ret < 0) {
+		DEBUG(0, ("glfs_statvfs(%s) failed: %s\n",
+			  path, strerror(errno)));
+		return -1;
+	}
+
+	ZERO_STRUCTP(vfs_statvfs);
+
+	vfs_statvfs->OptimalTransferSize = statvfs.f_frsize;
+	vfs_statvfs->BlockSize = statvfs.f_bsize;
+	vfs_statvfs->TotalBlocks = statvfs.f_blocks;
+	vfs_statvfs->BlocksAvail = statvfs.f_bfree;
+	vfs_statvfs->UserBlocksAvail = statvfs.f_bavail;
+	vfs_statvfs->TotalFileNodes = statvfs.f_files;
+	vfs_statvfs->FreeFileNodes = statvfs.f_ffree;
+	vfs_statvfs->FsIdentifier = statvfs.f_fsid;
+	vfs_statvfs->FsCapabilities =
+	    FILE_CASE_SENSITIVE_SEARCH | FILE_CASE_PRESERVED_NAMES;
+
+	return ret;
+}
+
+static uint32_t vfs_gluster_fs_capabilities(struct vfs_handle_struct *handle,
+					    enum timestamp_set_resolution *p_ts_res)
+{
+	uint32_t caps = FILE_CASE_SENSITIVE_SEARCH | FILE_CASE_PRESERVED_NAMES;
+
+#ifdef HAVE_GLFS_DISCARD
+	/* holes can be punched with FSCTL_SET_ZERO_DATA */
+	caps |= FILE_SUPPORTS_SPARSE_FILES;
+#endif
+
+#ifdef STAT_HAVE_NSEC
+	*p_ts_res = TIMESTAMP_SET_NT_OR_BETTER;
+#endif
+
+	return caps;
+}
+
+/*
+ * Snapshots as previous versions.
+ *
+ * snapview-client makes the snapshots of a volume available through a
+ * .snaps directory in every directory: dir/.snaps/<snap>/x is dir/x as it
+ * was in that snapshot. Snapshots created with a timestamp are named
+ * <name>_GMT-%Y.%m.%d-%H.%M.%S, and with glusterfs:shadow_copy those are
+ * offered to clients as previous versions. smbd passes the version a
+ * client asks for as a @GMT-%Y.%m.%d-%H.%M.%S component of the path,
+ * which the path based read calls map to the snapshot taken at that time;
+ * everything else sees such paths as they are and fails on them.
+ *
+ * The snapshots are listed once per graph and the list is kept for
+ * glusterfs:snapshot_list_ttl. The root directories of recently browsed
+ * snapshots are kept open per connection for snapshot_cache_ttl, so
+ * their inodes, and the snapshot graphs behind them in snapd, stay in
+ * use between the many accesses of a Previous Versions dialog.
+ */
+
+#define GLUSTER_SNAPDIR ".snaps"
+#define GMT_TOKEN "@GMT-"
+/* strlen("@GMT-YYYY.MM.DD-HH.MM.SS") */
+#define GMT_TOKEN_LEN 24
+
+struct glfs_snapshot {
+	SHADOW_COPY_LABEL label;
+	char *name;
+};
+
+struct glfs_snapshot_list {
+	struct glfs_snapshot *snaps;
+	int count;
+	struct timespec fetched;
+};
+
+/* an open snapshot root directory, in the snapshot cache */
+struct gluster_snapshot_entry {
+	glfs_fd_t *fd;
+};
+
+static int gluster_snapshot_entry_destructor(struct gluster_snapshot_entry *e)
+{
+	if (e->fd != NULL) {
+		glfs_closedir(e->fd);
+	}
+	return 0;
+}
+
+static int glfs_snapshot_cmp(const void *a, const void *b)
+{
+	const struct glfs_snapshot *x = a;
+	const struct glfs_snapshot *y = b;
+
+	/* newest first, the labels sort by time */
+	return strcmp(y->label, x->label);
+}
+
+/* The label for a snapshot name, false if it carries no timestamp. */
+static bool glfs_snapshot_label(const char *name, SHADOW_COPY_LABEL label)
+{
+	size_t len = strlen(name);
+	const char *gmt;
+	struct tm tm;
+	char *end;
+
+	/* the timestamp, without the @ */
+	if (len < GMT_TOKEN_LEN - 1) {
+		return false;
+	}
+	gmt = name + len - (GMT_TOKEN_LEN - 1);
+
+	ZERO_STRUCT(tm);
+	end = strptime(gmt, "GMT-%Y.%m.%d-%H.%M.%S", &tm);
+	if (end == NULL || *end != '\0') {
+		return false;
+	}
+
+	snprintf(label, sizeof(SHADOW_COPY_LABEL), "@%s", gmt);
+	return true;
+}
+
+static struct glfs_snapshot_list *glfs_snapshot_list_read(
+					struct vfs_handle_struct *handle)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glfs_snapshot_list *list;
+	struct glfs_snapshot *snaps;
+	struct dirent de, *result;
+	SHADOW_COPY_LABEL label;
+	glfs_fd_t *fd;
+	char *path;
+	int ret;
+
+	list = talloc_zero(NULL, struct glfs_snapshot_list);
+	if (list == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	path = talloc_asprintf(list, "%s/%s", handle->conn->connectpath,
+			       GLUSTER_SNAPDIR);
+	if (path == NULL) {
+		TALLOC_FREE(list);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	fd = glfs_opendir(conn->fs, path);
+	if (fd == NULL) {
+		DEBUG(1, ("glfs_opendir(%s) failed: %s\n", path,
+			  strerror(errno)));
+		TALLOC_FREE(list);
+		return NULL;
+	}
+
+	while ((ret = glfs_readdir_r(fd, &de, &result)) == 0 &&
+	       result != NULL) {
+		if (!glfs_snapshot_label(de.d_name, label)) {
+			DEBUG(10, ("snapshot %s has no timestamp\n",
+				   de.d_name));
+			continue;
+		}
+
+		snaps = talloc_realloc(list, list->snaps, struct glfs_snapshot,
+				       list->count + 1);
+		if (snaps == NULL) {
+			ret = ENOMEM;
+			break;
+		}
+		list->snaps = snaps;
+
+		memcpy(snaps[list->count].label, label, sizeof(label));
+		snaps[list->count].name = talloc_strdup(list->snaps,
+							de.d_name);
+		if (snaps[list->count].name == NULL) {
+			ret = ENOMEM;
+			break;
+		}
+		list->count++;
+	}
+	glfs_closedir(fd);
+
+	if (ret != 0) {
+		DEBUG(1, ("Listing %s failed: %s\n", path, strerror(ret)));
+		TALLOC_FREE(list);
+		errno = ret;
+		return NULL;
+	}
+
+	if (list->count > 1) {
+		qsort(list->snaps, list->count, sizeof(*list->snaps),
+		      glfs_snapshot_cmp);
+	}
+	clock_gettime_mono(&list->fetched);
+
+	DEBUG(5, ("%s: %d snapshots\n", path, list->count));
+	TALLOC_FREE(path);
+
+	return list;
+}
+
+/*
+ * The snapshots of the graph, read again when older than the TTL or with
+ * refresh. A failed read leaves the previous list, if any.
+ */
+static struct glfs_snapshot_list *glfs_snapshot_list(
+					struct vfs_handle_struct *handle,
+					bool refresh)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glfs_preopened *preopened = conn->preopened;
+	struct glfs_snapshot_list *list;
+	struct timespec now;
+
+	if (preopened->snapshots != NULL && !refresh) {
+		clock_gettime_mono(&now);
+		if (nsec_time_diff(&now, &preopened->snapshots->fetched) <
+		    (int64_t)conn->snapshot_list_ttl * 1000000) {
+			return preopened->snapshots;
+		}
+	}
+
+	list = glfs_snapshot_list_read(handle);
+	if (list != NULL) {
+		TALLOC_FREE(preopened->snapshots);
+		preopened->snapshots = talloc_steal(preopened, list);
+	}
+
+	return preopened->snapshots;
+}
+
+static const struct glfs_snapshot *glfs_snapshot_find(
+					struct vfs_handle_struct *handle,
+					const char *token)
+{
+	struct glfs_snapshot_list *list;
+	bool refresh = false;
+	int i;
+
+	do {
+		list = glfs_snapshot_list(handle, refresh);
+		for (i = 0; list != NULL && i < list->count; i++) {
+			if (strncmp(list->snaps[i].label, token,
+				    GMT_TOKEN_LEN) == 0) {
+				return &list->snaps[i];
+			}
+		}
+		/* taken since the list was read? */
+		refresh = !refresh;
+	} while (refresh);
+
+	return NULL;
+}
+
+/* Keep the root of a snapshot being browsed open for a while. */
+static void glusterfs_snapshot_touch(struct vfs_handle_struct *handle,
+				     const char *name)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct gluster_snapshot_entry *e;
+	char *path;
+
+	if (conn->snapshot_cache == NULL ||
+	    gluster_cache_lookup(conn->snapshot_cache, name) != NULL) {
+		return;
+	}
+
+	e = talloc_zero(NULL, struct gluster_snapshot_entry);
+	if (e == NULL) {
+		return;
+	}
+	path = talloc_asprintf(e, "%s/%s/%s", handle->conn->connectpath,
+			       GLUSTER_SNAPDIR, name);
+	if (path == NULL) {
+		TALLOC_FREE(e);
+		return;
+	}
+
+	e->fd = glfs_opendir(conn->fs, path);
+	TALLOC_FREE(path);
+	if (e->fd == NULL) {
+		TALLOC_FREE(e);
+		return;
+	}
+	talloc_set_destructor(e, gluster_snapshot_entry_destructor);
+
+	gluster_cache_add(conn->snapshot_cache, name, e);
+}
+
+/*
+ * path with its @GMT component replaced by the snapshot taken at that
+ * time. The snapshot goes in front of relative paths, which start at the
+ * share root, and in place of the token in absolute ones. Returns path
+ * itself without such a component, or NULL with errno set if there is no
+ * such snapshot. The result is on talloc_tos().
+ */
+static const char *glusterfs_snapshot_path(struct vfs_handle_struct *handle,
+					   const char *path)
+{
+	struct glusterfs_conn *conn = handle->data;
+	const struct glfs_snapshot *snap;
+	const char *token = path;
+	const char *rest;
+	size_t before;
+
+	if (!conn->shadow_copy) {
+		return path;
+	}
+
+	while ((token = strstr(token, GMT_TOKEN)) != NULL) {
+		if ((token == path || token[-1] == '/') &&
+		    strnlen(token, GMT_TOKEN_LEN) == GMT_TOKEN_LEN &&
+		    (token[GMT_TOKEN_LEN] == '\0' ||
+		     token[GMT_TOKEN_LEN] == '/')) {
+			break;
+		}
+		token++;
+	}
+	if (token == NULL) {
+		return path;
+	}
+
+	snap = glfs_snapshot_find(handle, token);
+	if (snap == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	glusterfs_snapshot_touch(handle, snap->name);
+
+	/* without the slashes around the token */
+	before = (token == path) ? 0 : token - path - 1;
+	rest = token + GMT_TOKEN_LEN;
+	if (*rest == '/') {
+		rest++;
+	}
+
+	if (path[0] == '/') {
+		path = talloc_asprintf(talloc_tos(), "%.*s/%s/%s%s%s",
+				       (int)before, path, GLUSTER_SNAPDIR,
+				       snap->name, (*rest != '\0') ? "/" : "",
+				       rest);
+	} else {
+		path = talloc_asprintf(talloc_tos(), "%s/%s%s%.*s%s%s",
+				       GLUSTER_SNAPDIR, snap->name,
+				       (before > 0) ? "/" : "",
+				       (int)before, path,
+				       (*rest != '\0') ? "/" : "", rest);
+	}
+	if (path == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	DEBUG(10, ("snapshot path %s\n", path));
+	return path;
+}
+
+static int vfs_gluster_get_shadow_copy_data(struct vfs_handle_struct *handle,
+					    struct files_struct *fsp,
+					    struct shadow_copy_data *shadow_copy_data,
+					    bool labels)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glfs_snapshot_list *list;
+	int i;
+
+	GLUSTER_PROF_START(get_shadow_copy_data);
+
+	if (!conn->shadow_copy) {
+		/* not an error of the call, not counted */
+		errno = ENOSYS;
+		return -1;
+	}
+
+	list = glfs_snapshot_list(handle, false);
+	if (list == NULL) {
+		return GLUSTER_PROF_RET(get_shadow_copy_data, -1);
+	}
+
+	shadow_copy_data->num_volumes = list->count;
+	shadow_copy_data->labels = NULL;
+
+	if (labels && list->count > 0) {
+		shadow_copy_data->labels = talloc_array(shadow_copy_data,
+							SHADOW_COPY_LABEL,
+							list->count);
+		if (shadow_copy_data->labels == NULL) {
+			errno = ENOMEM;
+			return GLUSTER_PROF_RET(get_shadow_copy_data, -1);
+		}
+		for (i = 0; i < list->count; i++) {
+			memcpy(shadow_copy_data->labels[i],
+			       list->snaps[i].label,
+			       sizeof(SHADOW_COPY_LABEL));
+		}
+	}
+
+	return GLUSTER_PROF_RET(get_shadow_copy_data, 0);
+}
+
+/*
+ * The DIR handed to smbd. Entries are read from gfapi in batches of
+ * readdir_batch entries (with their stats) into a buffer owned by the
+ * DIR, and handed out from there. gfapi has no call returning several
+ * entries: glfs_readdirplus_r() hands them out one at a time from its
+ * own buffer, which it fills with one READDIRP of up to 128KB, so the
+ * round trips are batched by gfapi and a batch here only gathers them.
+ * With glusterfs:readdir_lookahead a worker thread, one per DIR and
+ * started with its first lookahead, reads the next batch into a second
+ * buffer while smbd is busy with the current one; the main thread never
+ * touches the gfapi fd while the worker is busy.
+ *
+ * The DIR also remembers the path it was opened with, so that the stats
+ * returned by readdirplus can be put into the stat cache.
+ *
+ * smbd reads the DOS attributes of every entry it lists, one getxattr
+ * round trip each. With glusterfs:prefetch and user.DOSATTRIB among the
+ * cached xattrs, they are read for the whole batch right after it, in
+ * up to DIR_XATTR_THREADS shares in parallel on the worker pool, and put
+ * into the xattr cache together with the stat. The workers only use the
+ * batch and stack buffers, never talloc.
+ */
+
+#define DIR_XATTR_THREADS 8
+#define DIR_XATTR_BUFSIZE 256
+
+struct glusterfs_dirent {
+	struct stat st;
+	struct dirent dirent;
+
+	/* the DOS attributes, if the batch fetched them */
+	ssize_t xattr_len;
+	int xattr_err;
+	char xattr[DIR_XATTR_BUFSIZE];
+};
+
+struct glusterfs_dir_batch {
+	struct glusterfs_dirent *entries;
+	int count;
+	int next;
+	bool eof;
+	int err;
+};
+
+struct glusterfs_dir {
+	glfs_t *fs;
+	glfs_fd_t *fd;
+	char *path;
+	/* in the conn's list of listings */
+	struct glusterfs_conn *conn;
+	struct glusterfs_dir *prev, *next;
+	bool fetch_xattrs;
+	/*
+	 * Where the xattr threads find the entries: absolute, as the
+	 * working directory may move while they run, and snapshot paths
+	 * mapped.
+	 */
+	char *xattr_dir;
+
+	int batch_size;
+	struct glusterfs_dir_batch batch[2];
+	int cur;
+
+	bool lookahead;
+	/* the other batch is being or has been read ahead */
+	bool ahead;
+	bool worker_started;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* under the mutex */
+	bool busy;
+	bool stopping;
+
+	/* telldir() position of the next entry handed out */
+	long pos;
+
+	SMB_STRUCT_DIRENT result;
+};
+
+struct glusterfs_dir_xattr_worker {
+	struct glusterfs_dir *dir;
+	struct glusterfs_dir_batch *batch;
+	int first;
+	int step;
+	struct glusterfs_work work;
+};
+
+static void glusterfs_dir_xattr_run(void *private_data)
+{
+	struct glusterfs_dir_xattr_worker *w = private_data;
+	struct glusterfs_dirent *entry;
+	const char *name;
+	char path[PATH_MAX];
+	int len;
+	int i;
+
+	for (i = w->first; i < w->batch->count; i += w->step) {
+		entry = &w->batch->entries[i];
+		name = entry->dirent.d_name;
+
+		entry->xattr_len = -1;
+		entry->xattr_err = EINVAL;
+		if (ISDOT(name) || ISDOTDOT(name)) {
+			continue;
+		}
+
+		len = snprintf(path, sizeof(path), "%s%s%s",
+			       w->dir->xattr_dir,
+			       strcmp(w->dir->xattr_dir, "/") == 0 ? "" : "/",
+			       name);
+		if ((len < 0) || ((size_t)len >= sizeof(path))) {
+			continue;
+		}
+
+		entry->xattr_len = glfs_getxattr(w->dir->fs, path,
+						 SAMBA_XATTR_DOS_ATTRIB,
+						 entry->xattr,
+						 sizeof(entry->xattr));
+		entry->xattr_err = (entry->xattr_len == -1) ? errno : 0;
+	}
+}
+
+static void glusterfs_dir_fetch_xattrs(struct glusterfs_dir *dir,
+				       struct glusterfs_dir_batch *batch)
+{
+	struct glusterfs_dir_xattr_worker workers[DIR_XATTR_THREADS];
+	struct glusterfs_batch work_batch;
+	int count = MIN(DIR_XATTR_THREADS, batch->count);
+	bool queued;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		workers[i].dir = dir;
+		workers[i].batch = batch;
+		workers[i].first = i;
+		workers[i].step = count;
+	}
+
+	/* the first share is done by the calling thread */
+	queued = (count > 1) && glusterfs_pool_start(count - 1);
+	work_batch.pending = 0;
+	for (i = 1; queued && i < count; i++) {
+		glusterfs_pool_queue(&work_batch, &workers[i].work,
+				     glusterfs_dir_xattr_run, &workers[i]);
+	}
+
+	glusterfs_dir_xattr_run(&workers[0]);
+
+	if (queued) {
+		glusterfs_pool_wait(&work_batch);
+		return;
+	}
+	for (i = 1; i < count; i++) {
+		glusterfs_dir_xattr_run(&workers[i]);
+	}
+}
+
+static void glusterfs_dir_fill(struct glusterfs_dir *dir,
+			       struct glusterfs_dir_batch *batch)
+{
+	struct glusterfs_dirent *entry;
+	struct dirent *dirent = NULL;
+	int ret;
+
+	batch->count = 0;
+	batch->next = 0;
+	batch->eof = false;
+	batch->err = 0;
+
+	while (batch->count < dir->batch_size) {
+		entry = &batch->entries[batch->count];
+
+		ret = glfs_readdirplus_r(dir->fd, &entry->st, &entry->dirent,
+					 &dirent);
+		if (ret < 0) {
+			batch->err = errno;
+			batch->eof = true;
+			break;
+		}
+		if (dirent == NULL) {
+			batch->eof = true;
+			break;
+		}
+
+		batch->count++;
+	}
+
+	if (dir->fetch_xattrs && (batch->count > 0)) {
+		glusterfs_dir_fetch_xattrs(dir, batch);
+	}
+}
+
+static void *glusterfs_dir_lookahead(void *private_data)
+{
+	struct glusterfs_dir *dir = private_data;
+
+	pthread_mutex_lock(&dir->mutex);
+	for (;;) {
+		while (!dir->busy && !dir->stopping) {
+			pthread_cond_wait(&dir->cond, &dir->mutex);
+		}
+		if (dir->stopping) {
+			break;
+		}
+		pthread_mutex_unlock(&dir->mutex);
+
+		/* cur does not change while we are busy */
+		glusterfs_dir_fill(dir, &dir->batch[dir->cur ^ 1]);
+
+		pthread_mutex_lock(&dir->mutex);
+		dir->busy = false;
+		pthread_cond_broadcast(&dir->cond);
+	}
+	pthread_mutex_unlock(&dir->mutex);
+
+	return NULL;
+}
+
+/* Wait until the worker is done with the gfapi fd. */
+static void glusterfs_dir_wait(struct glusterfs_dir *dir)
+{
+	if (!dir->worker_started) {
+		return;
+	}
+
+	pthread_mutex_lock(&dir->mutex);
+	while (dir->busy) {
+		pthread_cond_wait(&dir->cond, &dir->mutex);
+	}
+	pthread_mutex_unlock(&dir->mutex);
+}
+
+static void glusterfs_dir_start_lookahead(struct glusterfs_dir *dir)
+{
+	if (!dir->lookahead || dir->batch[dir->cur].eof) {
+		return;
+	}
+
+	if (!dir->worker_started) {
+		if (glusterfs_thread_create(&dir->thread,
+					    glusterfs_dir_lookahead,
+					    dir) != 0) {
+			return;
+		}
+		dir->worker_started = true;
+	}
+
+	pthread_mutex_lock(&dir->mutex);
+	dir->busy = true;
+	pthread_cond_broadcast(&dir->cond);
+	pthread_mutex_unlock(&dir->mutex);
+	dir->ahead = true;
+}
+
+/* Make the next batch current, reading it unless the lookahead did. */
+static void glusterfs_dir_next_batch(struct glusterfs_dir *dir)
+{
+	if (dir->ahead) {
+		glusterfs_dir_wait(dir);
+		dir->ahead = false;
+		dir->cur ^= 1;
+	} else {
+		glusterfs_dir_fill(dir, &dir->batch[dir->cur]);
+	}
+
+	glusterfs_dir_start_lookahead(dir);
+}
+
+/* Throw away everything buffered, e.g. before a seekdir. */
+static void glusterfs_dir_reset(struct glusterfs_dir *dir)
+{
+	glusterfs_dir_wait(dir);
+	dir->ahead = false;
+
+	dir->batch[0].count = dir->batch[0].next = 0;
+	dir->batch[0].eof = false;
+	dir->batch[1].count = dir->batch[1].next = 0;
+	dir->batch[1].eof = false;
+	dir->cur = 0;
+}
+
+static int glusterfs_dir_destructor(struct glusterfs_dir *dir)
+{
+	if (dir->conn != NULL) {
+		DLIST_REMOVE(dir->conn->dirs, dir);
+	}
+	if (dir->worker_started) {
+		pthread_mutex_lock(&dir->mutex);
+		dir->stopping = true;
+		pthread_cond_broadcast(&dir->cond);
+		pthread_mutex_unlock(&dir->mutex);
+		pthread_join(dir->thread, NULL);
+	}
+	pthread_cond_destroy(&dir->cond);
+	pthread_mutex_destroy(&dir->mutex);
+
+	return 0;
+}
+
+/* Is the directory of path being listed? */
+static bool glusterfs_dir_listing(struct glusterfs_conn *conn,
+				  const char *path)
+{
+	struct glusterfs_dir *dir;
+	const char *p = strrchr(path, '/');
+	size_t len = (p == NULL) ? 0 : (size_t)(p - path);
+
+	for (dir = conn->dirs; dir != NULL; dir = dir->next) {
+		if (len == 0) {
+			/* an entry of the cwd */
+			if (p == NULL &&
+			    (ISDOT(dir->path) || dir->path[0] == '\0')) {
+				return true;
+			}
+		} else if (strlen(dir->path) == len &&
+			   strncmp(dir->path, path, len) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* A listing of path, opened as io_path. */
+static DIR *glusterfs_dir_new(struct vfs_handle_struct *handle,
+			      glfs_fd_t *fd, const char *path,
+			      const char *io_path)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_dir *dir;
+	int i;
+
+	dir = talloc_zero(NULL, struct glusterfs_dir);
+	if (dir == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_init(&dir->mutex, NULL);
+	pthread_cond_init(&dir->cond, NULL);
+	talloc_set_destructor(dir, glusterfs_dir_destructor);
+
+	dir->fs = conn->fs;
+	dir->fd = fd;
+	dir->path = talloc_strdup(dir, path);
+	if (dir->path == NULL) {
+		talloc_free(dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	dir->batch_size = conn->readdir_batch;
+	dir->lookahead = conn->readdir_lookahead;
+	dir->fetch_xattrs = conn->prefetch &&
+		(conn->xattr_cache != NULL) &&
+		gluster_xattr_cached_name(handle, SAMBA_XATTR_DOS_ATTRIB);
+	if (dir->fetch_xattrs) {
+		dir->xattr_dir = glusterfs_abspath(dir, dir->fs, io_path);
+		if (dir->xattr_dir == NULL) {
+			dir->fetch_xattrs = false;
+		}
+	}
+
+	for (i = 0; i < (dir->lookahead ? 2 : 1); i++) {
+		dir->batch[i].entries = talloc_array(dir,
+						     struct glusterfs_dirent,
+						     dir->batch_size);
+		if (dir->batch[i].entries == NULL) {
+			talloc_free(dir);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	dir->pos = glfs_telldir(fd);
+
+	dir->conn = conn;
+	DLIST_ADD(conn->dirs, dir);
+
+	return (DIR *) dir;
+}
+
+static DIR *vfs_gluster_opendir(struct vfs_handle_struct *handle,
+				const char *path, const char *mask,
+				uint32 attributes)
+{
+	const char *snap_path;
+	glfs_fd_t *fd;
+	DIR *dirp;
+
+	GLUSTER_PROF_START(opendir);
+
+	glusterfs_meta_drain(handle);
+
+	snap_path = glusterfs_snapshot_path(handle, path);
+	if (snap_path == NULL) {
+		GLUSTER_PROF_END(opendir, true, 0);
+		return NULL;
+	}
+
+	fd = glfs_opendir(vfs_gluster_fs(handle), snap_path);
+	if (fd == NULL) {
+		GLUSTER_PROF_END(opendir, true, 0);
+		DEBUG(0, ("glfs_opendir(%s) failed: %s\n",
+			  snap_path, strerror(errno)));
+		return NULL;
+	}
+
+	/* entries are cached by the names smbd will ask for */
+	dirp = glusterfs_dir_new(handle, fd, path, snap_path);
+	if (dirp == NULL) {
+		glfs_closedir(fd);
+	}
+
+	GLUSTER_PROF_END(opendir, dirp == NULL, 0);
+	return dirp;
+}
+
+static DIR *vfs_gluster_fdopendir(struct vfs_handle_struct *handle,
+				  files_struct *fsp, const char *mask,
+				  uint32 attributes)
+{
+	const char *io_path;
+	DIR *dirp;
+
+	GLUSTER_PROF_START(fdopendir);
+	glusterfs_meta_drain(handle);
+	io_path = glusterfs_snapshot_path(handle, fsp->fsp_name->base_name);
+	if (io_path == NULL) {
+		GLUSTER_PROF_END(fdopendir, true, 0);
+		return NULL;
+	}
+	dirp = glusterfs_dir_new(handle,
+				 vfs_gluster_fetch_glfd(handle, fsp),
+				 fsp->fsp_name->base_name, io_path);
+	GLUSTER_PROF_END(fdopendir, dirp == NULL, 0);
+
+	return dirp;
+}
+
+static int vfs_gluster_closedir(struct vfs_handle_struct *handle, DIR *dirp)
+{
+	struct glusterfs_dir *dir = (struct glusterfs_dir *)dirp;
+	int ret;
+
+	GLUSTER_PROF_START(closedir);
+
+	glusterfs_dir_wait(dir);
+
+	ret = glfs_closedir(dir->fd);
+	talloc_free(dir);
+
+	return GLUSTER_PROF_RET(closedir, ret);
+}
+
+static void glusterfs_dir_cache_entry(struct vfs_handle_struct *handle,
+				      struct glusterfs_dir *dir,
+				      const struct glusterfs_dirent *entry,
+				      const SMB_STRUCT_STAT *st)
+{
+	const char *name = entry->dirent.d_name;
+	char *path;
+
+	if ((gluster_stat_cache(handle) == NULL && !dir->fetch_xattrs) ||
+	    ISDOT(name) || ISDOTDOT(name)) {
+		return;
+	}
+
+	/* smbd looks up entries of the cwd without a leading "./" */
+	if (ISDOT(dir->path) || dir->path[0] == '\0') {
+		path = talloc_strdup(NULL, name);
+	} else {
+		path = talloc_asprintf(NULL, "%s/%s", dir->path, name);
+	}
+	if (path == NULL) {
+		return;
+	}
+
+	gluster_stat_cache_store(handle, path, true, st);
+
+	if (!dir->fetch_xattrs) {
+		/* nothing fetched */
+	} else if (entry->xattr_len >= 0) {
+		gluster_xattr_cache_store(handle, path, SAMBA_XATTR_DOS_ATTRIB,
+					  entry->xattr, entry->xattr_len);
+	} else if (entry->xattr_err == ENODATA) {
+		gluster_xattr_cache_store(handle, path, SAMBA_XATTR_DOS_ATTRIB,
+					  NULL, -1);
+	}
+
+	TALLOC_FREE(path);
+}
+
+static SMB_STRUCT_DIRENT *vfs_gluster_readdir(struct vfs_handle_struct *handle,
+					      SMB_STRUCT_DIR *dirp,
+					      SMB_STRUCT_STAT *sbuf)
+{
+	struct glusterfs_dir *dir = (struct glusterfs_dir *)dirp;
+	struct glusterfs_dir_batch *batch;
+	struct glusterfs_dirent *entry;
+	SMB_STRUCT_STAT st;
+
+	GLUSTER_PROF_START(readdir);
+
+	batch = &dir->batch[dir->cur];
+
+	if (batch->next == batch->count) {
+		if (batch->eof) {
+			GLUSTER_PROF_END(readdir, batch->err != 0, 0);
+			errno = batch->err;
+			return NULL;
+		}
+
+		glusterfs_dir_next_batch(dir);
+
+		batch = &dir->batch[dir->cur];
+		if (batch->count == 0) {
+			GLUSTER_PROF_END(readdir, batch->err != 0, 0);
+			errno = batch->err;
+			return NULL;
+		}
+	}
+
+	entry = &batch->entries[batch->next++];
+
+	/* straight into the caller's buffer, smbd passes one for listings */
+	if (sbuf == NULL) {
+		sbuf = &st;
+	}
+	smb_stat_ex_from_stat(sbuf, &entry->st);
+	glusterfs_dir_cache_entry(handle, dir, entry, sbuf);
+	if (!gluster_stat_valid(sbuf)) {
+		/* smbd stats the entry itself */
+		SET_STAT_INVALID(*sbuf);
+	}
+
+	dir->pos = entry->dirent.d_off;
+
+	dir->result.d_ino = entry->dirent.d_ino;
+	dir->result.d_off = entry->dirent.d_off;
+	dir->result.d_reclen = entry->dirent.d_reclen;
+	dir->result.d_type = entry->dirent.d_type;
+	strncpy(dir->result.d_name, entry->dirent.d_name, 256);
+
+	GLUSTER_PROF_END(readdir, false, 0);
+	return &dir->result;
+}
+
+static long vfs_gluster_telldir(struct vfs_handle_struct *handle, DIR *dirp)
+{
+	/* the gfapi fd is ahead of us by whatever is still buffered */
+	return ((struct glusterfs_dir *)dirp)->pos;
+}
+
+static void glusterfs_dir_seek(struct glusterfs_dir *dir, long offset)
+{
+	glusterfs_dir_reset(dir);
+	glfs_seekdir(dir->fd, offset);
+	dir->pos = offset;
+}
+
+static void vfs_gluster_seekdir(struct vfs_handle_struct *handle, DIR *dirp,
+				long offset)
+{
+	GLUSTER_PROF_START(seekdir);
+	glusterfs_dir_seek((struct glusterfs_dir *)dirp, offset);
+	GLUSTER_PROF_END(seekdir, false, 0);
+}
+
+static void vfs_gluster_rewinddir(struct vfs_handle_struct *handle, DIR *dirp)
+{
+	GLUSTER_PROF_START(rewinddir);
+	glusterfs_dir_seek((struct glusterfs_dir *)dirp, 0);
+	GLUSTER_PROF_END(rewinddir, false, 0);
+}
+
+static void vfs_gluster_init_search_op(struct vfs_handle_struct *handle,
+				       DIR *dirp)
+{
+	return;
+}
+
+static int vfs_gluster_mkdir(struct vfs_handle_struct *handle, const char *path,
+			     mode_t mode)
+{
+	GLUSTER_PROF_START(mkdir);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_name_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(mkdir,
+				glfs_mkdir(vfs_gluster_fs(handle), path, mode));
+}
+
+static int vfs_gluster_rmdir(struct vfs_handle_struct *handle, const char *path)
+{
+	GLUSTER_PROF_START(rmdir);
+	glusterfs_meta_drain(handle);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_cache_delete_tree(gluster_stat_cache(handle), path);
+	gluster_name_cache_invalidate(handle, path);
+	gluster_cache_delete_tree(gluster_name_cache(handle), path);
+	gluster_cache_delete_tree(gluster_xattr_cache(handle), path);
+	gluster_cache_delete_tree(gluster_fd_cache(handle), path);
+#ifdef HAVE_GLFS_HANDLES
+	glusterfs_handle_forget(handle, path);
+#endif
+	return GLUSTER_PROF_RET(rmdir,
+				glfs_rmdir(vfs_gluster_fs(handle), path));
+}
+
+/*
+ * Read ahead and write behind.
+ *
+ * Small sequential SMB reads and writes otherwise map one to one onto
+ * glfs_pread/glfs_pwrite, each a network round trip. With
+ * glusterfs:readahead_window a run of readahead_trigger sequential reads
+ * makes the next read fetch a whole window, and following reads are
+ * served from it. With glusterfs:write_behind_window adjacent small
+ * writes are collected and sent as one write.
+ *
+ * Pending writes are sent before anything else touches the fd (close,
+ * fsync, locks, stat, truncate, reads of the range, non adjacent writes)
+ * and the window is dropped on every write and lock. A write that fails
+ * while flushing is reported by the next call that flushes, or by
+ * fsync/close, like the write-behind translator does.
+ *
+ * Other fds of the same file in this connection are kept coherent: a
+ * write, an open or a path based stat sends their pending writes and
+ * drops their window, and so does a read while any fd holds pending
+ * writes. Pending writes are sent after write_behind_timeout at the
+ * latest, until then other clients don't see them. A window may still
+ * return data other clients or connections changed since it was read.
+ */
+
+/*
+ * glfs_pwritev until everything is out. Returns the number of bytes
+ * written, which is short with errno set if a write failed part way.
+ */
+static ssize_t glusterfs_pwritev_full(glfs_fd_t *glfd, struct iovec *iov,
+				      int iovcnt, off_t offset)
+{
+	ssize_t done = 0;
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = glfs_pwritev(glfd, iov, iovcnt, offset + done, 0);
+		if (ret <= 0) {
+			if (ret == 0) {
+				errno = EIO;
+			}
+			return (done > 0) ? done : -1;
+		}
+		done += ret;
+
+		while ((iovcnt > 0) && (ret >= (ssize_t)iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return done;
+}
+
+/* The pending writes of fd are out, or failed. */
+static void glusterfs_fd_wb_clear(struct glusterfs_fd *fd)
+{
+	struct glusterfs_conn *conn = fd->conn;
+
+	if (fd->wb_len > 0) {
+		fd->wb_len = 0;
+		conn->wb_fds--;
+		/* a stat may have been cached in between */
+		if (conn->stat_cache != NULL) {
+			gluster_cache_delete(conn->stat_cache,
+					     fd->fsp->fsp_name->base_name);
+		}
+	}
+	TALLOC_FREE(fd->wb_timer);
+}
+
+static int glusterfs_fd_flush(struct glusterfs_fd *fd)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	if (fd->wb_len > 0) {
+		iov.iov_base = fd->wb_buf;
+		iov.iov_len = fd->wb_len;
+		ret = glusterfs_pwritev_full(fd->glfd, &iov, 1, fd->wb_offset);
+		if (ret < (ssize_t)fd->wb_len) {
+			DEBUG(1, ("write behind of %zu bytes at %jd failed: "
+				  "%s\n", fd->wb_len, (intmax_t)fd->wb_offset,
+				  strerror(errno)));
+			fd->wb_errno = errno;
+		}
+	}
+
+	glusterfs_fd_wb_clear(fd);
+
+	if (fd->wb_errno != 0) {
+		errno = fd->wb_errno;
+		fd->wb_errno = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Flush for a caller that has no way to report an earlier write error,
+ * keep it for the next fsync or close.
+ */
+static void glusterfs_fd_flush_deferred(struct glusterfs_fd *fd)
+{
+	int saved_errno = errno;
+
+	if ((fd->wb_len > 0) && (glusterfs_fd_flush(fd) == -1)) {
+		fd->wb_errno = errno;
+	}
+
+	errno = saved_errno;
+}
+
+static void glusterfs_fd_drop_readahead(struct glusterfs_fd *fd)
+{
+	fd->ra_len = 0;
+	fd->seq_reads = 0;
+}
+
+static void glusterfs_fd_wb_expired(struct tevent_context *ev_ctx,
+				    struct tevent_timer *te,
+				    struct timeval now, void *private_data)
+{
+	struct glusterfs_fd *fd = private_data;
+
+	fd->wb_timer = NULL;
+	glusterfs_fd_flush_deferred(fd);
+}
+
+/*
+ * Send the pending writes and drop the window of the other fds of the
+ * file of fsp, or of path for an fsp that is not open yet.
+ */
+static void glusterfs_fd_sync_others(struct glusterfs_conn *conn,
+				     files_struct *fsp, const char *path)
+{
+	struct glusterfs_fd *fd;
+
+	if ((conn->readahead_window == 0) && (conn->wb_fds == 0)) {
+		return;
+	}
+
+	for (fd = conn->fds; fd != NULL; fd = fd->next) {
+		if (fd->fsp == fsp) {
+			continue;
+		}
+		if ((fsp != NULL) ?
+		    !file_id_equal(&fd->fsp->file_id, &fsp->file_id) :
+		    (strcmp(fd->fsp->fsp_name->base_name, path) != 0)) {
+			continue;
+		}
+		glusterfs_fd_drop_readahead(fd);
+		glusterfs_fd_flush_deferred(fd);
+	}
+}
+
+/* Send pending writes and forget cached data before fd is modified. */
+static int glusterfs_fd_prepare_write(struct vfs_handle_struct *handle,
+				      files_struct *fsp)
+{
+	struct glusterfs_fd *fd = vfs_gluster_fetch_fd(handle, fsp);
+
+	glusterfs_fd_sync_others(handle->data, fsp, NULL);
+	glusterfs_fd_drop_readahead(fd);
+	if ((fd->wb_len > 0) || (fd->wb_errno != 0)) {
+		return glusterfs_fd_flush(fd);
+	}
+	return 0;
+}
+
+/* Send pending writes before fd is read through gfapi directly. */
+static void glusterfs_fd_prepare_read(struct vfs_handle_struct *handle,
+				      files_struct *fsp)
+{
+	glusterfs_fd_flush_deferred(vfs_gluster_fetch_fd(handle, fsp));
+}
+
+static ssize_t glusterfs_fd_pread(struct glusterfs_conn *conn,
+				  struct glusterfs_fd *fd, void *data,
+				  size_t n, off_t offset)
+{
+	size_t window = conn->readahead_window;
+	struct iovec iov[2];
+	ssize_t ret;
+
+	/* another fd of the file may hold writes to what is read */
+	if (conn->wb_fds > ((fd->wb_len > 0) ? 1 : 0)) {
+		glusterfs_fd_sync_others(conn, fd->fsp, NULL);
+	}
+
+	if ((fd->wb_len > 0) && (offset < fd->wb_offset + fd->wb_len) &&
+	    (offset + n > fd->wb_offset)) {
+		glusterfs_fd_flush_deferred(fd);
+	}
+
+	if (window == 0) {
+		return glfs_pread(fd->glfd, data, n, offset, 0);
+	}
+
+	if ((offset >= fd->ra_offset) &&
+	    (offset + n <= fd->ra_offset + fd->ra_len)) {
+		memcpy(data, fd->ra_buf + (offset - fd->ra_offset), n);
+		fd->next_read = offset + n;
+		return n;
+	}
+
+	if (offset == fd->next_read) {
+		fd->seq_reads++;
+	} else {
+		fd->seq_reads = 0;
+	}
+	fd->next_read = offset + n;
+
+	if ((fd->seq_reads < conn->readahead_trigger) || (n >= window)) {
+		return glfs_pread(fd->glfd, data, n, offset, 0);
+	}
+
+	if (fd->ra_buf == NULL) {
+		fd->ra_buf = talloc_array(fd->mem_ctx, char, window);
+		if (fd->ra_buf == NULL) {
+			return glfs_pread(fd->glfd, data, n, offset, 0);
+		}
+	}
+
+	/* the window must not miss writes still pending */
+	glusterfs_fd_flush_deferred(fd);
+
+	/* the caller's part goes straight into its buffer */
+	iov[0].iov_base = data;
+	iov[0].iov_len = n;
+	iov[1].iov_base = fd->ra_buf;
+	iov[1].iov_len = window - n;
+
+	fd->ra_len = 0;
+	ret = glfs_preadv(fd->glfd, iov, 2, offset, 0);
+	if (ret <= (ssize_t)n) {
+		return ret;
+	}
+
+	fd->ra_offset = offset + n;
+	fd->ra_len = ret - n;
+
+	return n;
+}
+
+/*
+ * A write continuing the pending ones that does not fit the window goes
+ * out together with them, in one vectored write and without copying it.
+ */
+static ssize_t glusterfs_fd_pwrite_pending(struct glusterfs_fd *fd,
+					   const void *data, size_t n)
+{
+	struct iovec iov[2];
+	size_t pending = fd->wb_len;
+	ssize_t ret;
+
+	iov[0].iov_base = fd->wb_buf;
+	iov[0].iov_len = pending;
+	iov[1].iov_base = discard_const_p(void, data);
+	iov[1].iov_len = n;
+
+	ret = glusterfs_pwritev_full(fd->glfd, iov, 2, fd->wb_offset);
+	glusterfs_fd_wb_clear(fd);
+
+	if (ret < (ssize_t)pending) {
+		DEBUG(1, ("write behind of %zu bytes at %jd failed: %s\n",
+			  pending, (intmax_t)fd->wb_offset, strerror(errno)));
+		return -1;
+	}
+
+	return ret - pending;
+}
+
+static ssize_t glusterfs_fd_pwrite(struct glusterfs_conn *conn,
+				   struct glusterfs_fd *fd, const void *data,
+				   size_t n, off_t offset)
+{
+	size_t window = conn->write_behind_window;
+
+	glusterfs_fd_sync_others(conn, fd->fsp, NULL);
+	glusterfs_fd_drop_readahead(fd);
+
+	if ((fd->wb_len > 0) && (fd->wb_errno == 0) &&
+	    (offset == fd->wb_offset + fd->wb_len) &&
+	    (fd->wb_len + n > window)) {
+		return glusterfs_fd_pwrite_pending(fd, data, n);
+	}
+
+	if ((fd->wb_len > 0) &&
+	    ((offset != fd->wb_offset + fd->wb_len) ||
+	     (fd->wb_len + n > window))) {
+		if (glusterfs_fd_flush(fd) == -1) {
+			return -1;
+		}
+	}
+
+	if ((window == 0) || (n >= window)) {
+		return glfs_pwrite(fd->glfd, data, n, offset, 0);
+	}
+
+	if (fd->wb_buf == NULL) {
+		fd->wb_buf = talloc_array(fd->mem_ctx, char, window);
+		if (fd->wb_buf == NULL) {
+			return glfs_pwrite(fd->glfd, data, n, offset, 0);
+		}
+	}
+
+	if (fd->wb_len == 0) {
+		fd->wb_timer = tevent_add_timer(server_event_context(),
+				fd->mem_ctx,
+				timeval_current_ofs_msec(conn->write_behind_timeout),
+				glusterfs_fd_wb_expired, fd);
+		if (fd->wb_timer == NULL) {
+			return glfs_pwrite(fd->glfd, data, n, offset, 0);
+		}
+		fd->wb_offset = offset;
+		conn->wb_fds++;
+	}
+	memcpy(fd->wb_buf + fd->wb_len, data, n);
+	fd->wb_len += n;
+
+	return n;
+}
+
+static int vfs_gluster_open(struct vfs_handle_struct *handle,
+			    struct smb_filename *smb_fname, files_struct *fsp,
+			    int flags, mode_t mode)
+{
+	glfs_fd_t *glfd;
+	struct glusterfs_fd *fd;
+	const char *path;
+
+	GLUSTER_PROF_START(open);
+
+	if (flags & O_DIRECTORY) {
+		glusterfs_meta_drain(handle);
+	} else {
+		glusterfs_meta_wait(handle, smb_fname->base_name);
+	}
+
+	if (flags & (O_CREAT | O_TRUNC)) {
+		gluster_stat_cache_invalidate(handle, smb_fname->base_name);
+	}
+	if (flags & O_CREAT) {
+		gluster_name_cache_invalidate(handle, smb_fname->base_name);
+		gluster_xattr_cache_invalidate(handle, smb_fname->base_name);
+	}
+
+	path = glusterfs_snapshot_path(handle, smb_fname->base_name);
+	if (path == NULL) {
+		GLUSTER_PROF_END(open, true, 0);
+		return -1;
+	}
+
+	/* what other fds of the file hold back must be visible */
+	glusterfs_fd_sync_others(handle->data, NULL, smb_fname->base_name);
+
+	glfd = glusterfs_fd_cache_get(handle, smb_fname->base_name, flags);
+
+	if (glfd != NULL) {
+		/* parked on an earlier close */
+	} else if (flags & O_DIRECTORY) {
+		glfd = glfs_opendir(vfs_gluster_fs(handle), path);
+	} else if (flags & O_CREAT) {
+		glfd = glfs_creat(vfs_gluster_fs(handle), path, flags, mode);
+	} else {
+		glfd = glfs_open(vfs_gluster_fs(handle), path, flags);
+	}
+
+	if (glfd == NULL) {
+		GLUSTER_PROF_END(open, true, 0);
+		return -1;
+	}
+	fd = (struct glusterfs_fd *)VFS_ADD_FSP_EXTENSION(handle, fsp,
+							  struct glusterfs_fd,
+							  NULL);
+	if (fd == NULL) {
+		glfs_close(glfd);
+		errno = ENOMEM;
+		GLUSTER_PROF_END(open, true, 0);
+		return -1;
+	}
+	fd->glfd = glfd;
+	fd->mem_ctx = fsp;
+	fd->fsp = fsp;
+	fd->conn = handle->data;
+	fd->flags = flags;
+	DLIST_ADD(fd->conn->fds, fd);
+	GLUSTER_PROF_END(open, false, 0);
+	/* An arbitrary value for error reporting, so you know its us. */
+	return 13371337;
+}
+
+/* in the lock cache code below */
+static void glusterfs_lock_table_clear(struct glusterfs_fd *fd);
+
+/* Free what hangs off fd, before its extension goes away. */
+static void glusterfs_fd_release(struct glusterfs_fd *fd)
+{
+	glusterfs_fd_wb_clear(fd);
+	DLIST_REMOVE(fd->conn->fds, fd);
+	TALLOC_FREE(fd->ra_buf);
+	TALLOC_FREE(fd->wb_buf);
+	glusterfs_lock_table_clear(fd);
+}
+
+static int vfs_gluster_close(struct vfs_handle_struct *handle,
+			     files_struct *fsp)
+{
+	struct glusterfs_fd *fd;
+	glfs_fd_t *glfd;
+	int flushed;
+	int ret;
+
+	GLUSTER_PROF_START(close);
+	flushed = glusterfs_fd_prepare_write(handle, fsp);
+	fd = vfs_gluster_fetch_fd(handle, fsp);
+	glfd = fd->glfd;
+	if (flushed == 0 && glusterfs_fd_cache_put(handle, fsp, fd)) {
+		glusterfs_fd_release(fd);
+		VFS_REMOVE_FSP_EXTENSION(handle, fsp);
+		return GLUSTER_PROF_RET(close, 0);
+	}
+	glusterfs_fd_release(fd);
+	VFS_REMOVE_FSP_EXTENSION(handle, fsp);
+	ret = glfs_close(glfd);
+	if ((ret == 0) && (flushed == -1)) {
+		ret = -1;
+	}
+	return GLUSTER_PROF_RET(close, ret);
+}
+
+static ssize_t vfs_gluster_read(struct vfs_handle_struct *handle,
+				files_struct *fsp, void *data, size_t n)
+{
+	GLUSTER_PROF_START(read);
+	glusterfs_fd_prepare_read(handle, fsp);
+	return GLUSTER_PROF_RET_BYTES(read,
+		glfs_read(vfs_gluster_fetch_glfd(handle, fsp),
+			  data, n, 0));
+}
+
+static ssize_t vfs_gluster_pread(struct vfs_handle_struct *handle,
+				 files_struct *fsp, void *data,
+				 size_t n, off_t offset)
+{
+	GLUSTER_PROF_START(pread);
+	return GLUSTER_PROF_RET_BYTES(pread,
+		glusterfs_fd_pread(handle->data,
+				   vfs_gluster_fetch_fd(handle, fsp),
+				   data, n, offset));
+}
+
+static ssize_t vfs_gluster_write(struct vfs_handle_struct *handle,
+				 files_struct *fsp, const void *data, size_t n)
+{
+	GLUSTER_PROF_START(write);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
+		GLUSTER_PROF_END(write, true, 0);
+		return -1;
+	}
+	return GLUSTER_PROF_RET_BYTES(write,
+		glfs_write(vfs_gluster_fetch_glfd(handle, fsp),
+			   data, n, 0));
+}
+
+static ssize_t vfs_gluster_pwrite(struct vfs_handle_struct *handle,
+				  files_struct *fsp, const void *data,
+				  size_t n, off_t offset)
+{
+	GLUSTER_PROF_START(pwrite);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	return GLUSTER_PROF_RET_BYTES(pwrite,
+		glusterfs_fd_pwrite(handle->data,
+				    vfs_gluster_fetch_fd(handle, fsp),
+				    data, n, offset));
+}
+
+static off_t vfs_gluster_lseek(struct vfs_handle_struct *handle,
+			       files_struct *fsp, off_t offset, int whence)
+{
+	GLUSTER_PROF_START(lseek);
+	glusterfs_fd_prepare_read(handle, fsp);
+	return GLUSTER_PROF_RET(lseek,
+		glfs_lseek(vfs_gluster_fetch_glfd(handle, fsp),
+			   offset, whence));
+}
+
+/*
+ * Read the file through one page aligned buffer per connection and write
+ * the header and data to the socket with a single writev. This avoids the
+ * talloc'ed read buffer of the regular read path and the copy into it.
+ *
+ * Returning ENOSYS makes smbd fall back to a normal read, which is only
+ * safe as long as nothing has been written to the socket yet.
+ */
+static ssize_t glusterfs_sendfile(struct vfs_handle_struct *handle, int tofd,
+				  files_struct *fromfsp,
+				  const DATA_BLOB *hdr,
+				  off_t offset, size_t n)
+{
+	struct glusterfs_conn *conn = handle->data;
+	glfs_fd_t *glfd;
+	struct iovec iov[2];
+	int iovcnt;
+	size_t hdr_len = (hdr != NULL) ? hdr->length : 0;
+	ssize_t nread;
+	ssize_t nwritten;
+	ssize_t total = 0;
+	size_t chunk;
+
+	if (!conn->use_sendfile) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (conn->sendfile_buf == NULL) {
+		conn->sendfile_buf = glusterfs_alloc_iobuf(&conn->sendfile_bufsize,
+							   1);
+		if (conn->sendfile_buf == NULL) {
+			errno = ENOSYS;
+			return -1;
+		}
+	}
+
+	glusterfs_fd_prepare_read(handle, fromfsp);
+	glfd = vfs_gluster_fetch_glfd(handle, fromfsp);
+
+	do {
+		chunk = MIN(n, conn->sendfile_bufsize);
+
+		nread = 0;
+		if (chunk > 0) {
+			nread = glfs_pread(glfd, conn->sendfile_buf, chunk,
+					   offset, 0);
+			if (nread < 0) {
+				if (total == 0) {
+					errno = ENOSYS;
+				}
+				DEBUG(1, ("sendfile: glfs_pread of %zu bytes at "
+					  "%llu failed: %s\n", chunk,
+					  (unsigned long long)offset,
+					  strerror(errno)));
+				return -1;
+			}
+		}
+
+		iovcnt = 0;
+		if (hdr_len > 0) {
+			iov[iovcnt].iov_base = (void *)hdr->data;
+			iov[iovcnt].iov_len = hdr_len;
+			iovcnt++;
+		}
+		if (nread > 0) {
+			iov[iovcnt].iov_base = conn->sendfile_buf;
+			iov[iovcnt].iov_len = nread;
+			iovcnt++;
+		}
+		if (iovcnt == 0) {
+			/* EOF */
+			break;
+		}
+
+		nwritten = write_data_iov(tofd, iov, iovcnt);
+		if (nwritten < 0 || (size_t)nwritten != hdr_len + nread) {
+			return -1;
+		}
+
+		total += nwritten;
+		offset += nread;
+		n -= nread;
+		hdr_len = 0;
+	} while (n > 0 && nread == chunk);
+
+	conn->sendfile_calls++;
+	conn->sendfile_bytes += total;
+
+	DEBUG(10, ("sendfile: sent %zd bytes\n", total));
+
+	return total;
+}
+
+static ssize_t vfs_gluster_sendfile(struct vfs_handle_struct *handle, int tofd,
+				    files_struct *fromfsp,
+				    const DATA_BLOB *hdr,
+				    off_t offset, size_t n)
+{
+	GLUSTER_PROF_START(sendfile);
+	return GLUSTER_PROF_RET_BYTES(sendfile,
+		glusterfs_sendfile(handle, tofd, fromfsp, hdr, offset, n));
+}
+
+/*
+ * recvfile and copychunk pipeline reads with gfapi writes: while one
+ * buffer is being written out with glfs_pwrite_async, the next chunk is
+ * read into the other one.
+ */
+
+struct glusterfs_write_io {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool busy;
+	/* of the outstanding write */
+	size_t len;
+	ssize_t ret;
+	int err;
+};
+
+static void glusterfs_write_done(glfs_fd_t *fd, ssize_t ret, void *data)
+{
+	struct glusterfs_write_io *io = data;
+
+	pthread_mutex_lock(&io->mutex);
+	io->ret = ret;
+	io->err = (ret < 0) ? errno : 0;
+	io->busy = false;
+	pthread_cond_signal(&io->cond);
+	pthread_mutex_unlock(&io->mutex);
+}
+
+/*
+ * Wait for the outstanding write, if any, and add what it wrote to
+ * *written. Returns -1 with errno set if it failed or was short, as
+ * nothing may be written after it then.
+ */
+static int glusterfs_write_wait(struct glusterfs_write_io *io,
+				size_t *written)
+{
+	ssize_t ret;
+	size_t len;
+
+	pthread_mutex_lock(&io->mutex);
+	while (io->busy) {
+		pthread_cond_wait(&io->cond, &io->mutex);
+	}
+	ret = io->ret;
+	len = io->len;
+	io->ret = 0;
+	io->len = 0;
+	pthread_mutex_unlock(&io->mutex);
+
+	if (ret < 0) {
+		errno = io->err;
+		return -1;
+	}
+
+	*written += ret;
+	if ((size_t)ret < len) {
+		/* gfapi gives no reason, the bricks are most likely full */
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int recvfile_read_chunk(int fromfd, char *buf, size_t len)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < len) {
+		ret = sys_read(fromfd, buf + total, len - total);
+		if (ret <= 0) {
+			/* EOF or socket error */
+			return -1;
+		}
+		total += ret;
+	}
+
+	return 0;
+}
+
+static ssize_t glusterfs_recvfile(struct vfs_handle_struct *handle,
+				  int fromfd, files_struct *tofsp,
+				  off_t offset, size_t n)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_write_io io;
+	glfs_fd_t *glfd;
+	char *buf[2];
+	int cur = 0;
+	size_t total = 0;
+	size_t total_written = 0;
+	size_t chunk;
+	ssize_t ret;
+	int saved_errno = 0;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (conn->recvfile_buf == NULL) {
+		conn->recvfile_buf = glusterfs_alloc_iobuf(&conn->recvfile_bufsize,
+							   2);
+		if (conn->recvfile_buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	buf[0] = conn->recvfile_buf;
+	buf[1] = conn->recvfile_buf + conn->recvfile_bufsize;
+
+	gluster_stat_cache_invalidate_fsp(handle, tofsp);
+
+	if (glusterfs_fd_prepare_write(handle, tofsp) == -1) {
+		return -1;
+	}
+	glfd = vfs_gluster_fetch_glfd(handle, tofsp);
+
+	ZERO_STRUCT(io);
+	pthread_mutex_init(&io.mutex, NULL);
+	pthread_cond_init(&io.cond, NULL);
+
+	while (total < n) {
+		chunk = MIN(conn->recvfile_bufsize, n - total);
+
+		if (recvfile_read_chunk(fromfd, buf[cur], chunk) == -1) {
+			saved_errno = errno;
+			glusterfs_write_wait(&io, &total_written);
+			pthread_mutex_destroy(&io.mutex);
+			pthread_cond_destroy(&io.cond);
+			errno = saved_errno;
+			return -1;
+		}
+
+		/* The previous chunk has to be out before we queue this one. */
+		if (glusterfs_write_wait(&io, &total_written) == -1 &&
+		    saved_errno == 0) {
+			saved_errno = errno;
+		}
+
+		/*
+		 * After a failed or short write keep draining the socket,
+		 * the client has already sent the data, but write nothing
+		 * more so that what was written has no holes.
+		 */
+		if (saved_errno == 0) {
+			io.busy = true;
+			io.len = chunk;
+			ret = glfs_pwrite_async(glfd, buf[cur], chunk,
+						offset + total, 0,
+						glusterfs_write_done, &io);
+			if (ret < 0) {
+				io.busy = false;
+				io.len = 0;
+				saved_errno = errno;
+			}
+		}
+
+		total += chunk;
+		cur ^= 1;
+	}
+
+	if (glusterfs_write_wait(&io, &total_written) == -1 &&
+	    saved_errno == 0) {
+		saved_errno = errno;
+	}
+
+	pthread_mutex_destroy(&io.mutex);
+	pthread_cond_destroy(&io.cond);
+
+	if (saved_errno) {
+		errno = saved_errno;
+	}
+
+	return total_written;
+}
+
+static ssize_t vfs_gluster_recvfile(struct vfs_handle_struct *handle,
+				    int fromfd, files_struct *tofsp,
+				    off_t offset, size_t n)
+{
+	GLUSTER_PROF_START(recvfile);
+	return GLUSTER_PROF_RET_BYTES(recvfile,
+		glusterfs_recvfile(handle, fromfd, tofsp, offset, n));
+}
+
+static int vfs_gluster_rename(struct vfs_handle_struct *handle,
+			      const struct smb_filename *smb_fname_src,
+			      const struct smb_filename *smb_fname_dst)
+{
+	struct gluster_cache *cache = gluster_stat_cache(handle);
+
+	GLUSTER_PROF_START(rename);
+
+	glusterfs_meta_drain(handle);
+
+	gluster_stat_cache_invalidate(handle, smb_fname_src->base_name);
+	gluster_stat_cache_invalidate(handle, smb_fname_dst->base_name);
+	gluster_cache_delete_tree(cache, smb_fname_src->base_name);
+	gluster_cache_delete_tree(cache, smb_fname_dst->base_name);
+
+	cache = gluster_name_cache(handle);
+
+	gluster_name_cache_invalidate(handle, smb_fname_src->base_name);
+	gluster_name_cache_invalidate(handle, smb_fname_dst->base_name);
+	gluster_cache_delete_tree(cache, smb_fname_src->base_name);
+	gluster_cache_delete_tree(cache, smb_fname_dst->base_name);
+
+	cache = gluster_xattr_cache(handle);
+
+	gluster_cache_delete_tree(cache, smb_fname_src->base_name);
+	gluster_cache_delete_tree(cache, smb_fname_dst->base_name);
+
+	cache = gluster_fd_cache(handle);
+
+	gluster_cache_delete_tree(cache, smb_fname_src->base_name);
+	gluster_cache_delete_tree(cache, smb_fname_dst->base_name);
+
+#ifdef HAVE_GLFS_HANDLES
+	glusterfs_handle_forget(handle, smb_fname_src->base_name);
+	glusterfs_handle_forget(handle, smb_fname_dst->base_name);
+#endif
+
+	return GLUSTER_PROF_RET(rename,
+		glfs_rename(vfs_gluster_fs(handle), smb_fname_src->base_name,
+			    smb_fname_dst->base_name));
+}
+
+static int vfs_gluster_fsync(struct vfs_handle_struct *handle,
+			     files_struct *fsp)
+{
+	GLUSTER_PROF_START(fsync);
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
+		GLUSTER_PROF_END(fsync, true, 0);
+		return -1;
+	}
+	return GLUSTER_PROF_RET(fsync,
+		glfs_fsync(vfs_gluster_fetch_glfd(handle, fsp)));
+}
+
+static int vfs_gluster_stat(struct vfs_handle_struct *handle,
+			    struct smb_filename *smb_fname)
+{
+	struct stat st;
+	struct glusterfs_prefetch *prefetch;
+	const char *path;
+	int ret;
+
+	GLUSTER_PROF_START(stat);
+
+	glusterfs_meta_wait(handle, smb_fname->base_name);
+	glusterfs_fd_sync_others(handle->data, NULL, smb_fname->base_name);
+
+	if (gluster_stat_cache_fetch(handle, smb_fname->base_name, false,
+				     &smb_fname->st)) {
+		GLUSTER_PROF_END(stat, false, 0);
+		return 0;
+	}
+
+	path = glusterfs_snapshot_path(handle, smb_fname->base_name);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET(stat, -1);
+	}
+
+	prefetch = glusterfs_prefetch_start(handle, smb_fname->base_name, path);
+
+	ret = GLUSTER_PROF_RET(stat,
+		glusterfs_path_stat(handle, path, true, &st));
+
+	if (prefetch != NULL) {
+		glusterfs_prefetch_finish(handle, prefetch, ret == 0);
+	}
+
+	if (ret == 0) {
+		smb_stat_ex_from_stat(&smb_fname->st, &st);
+		gluster_stat_cache_store(handle, smb_fname->base_name, false,
+					 &smb_fname->st);
+	}
+	if (ret < 0 && errno != ENOENT) {
+		DEBUG(0, ("glfs_stat(%s) failed: %s\n",
+			  smb_fname->base_name, strerror(errno)));
+	}
+	return ret;
+}
+
+static int vfs_gluster_fstat(struct vfs_handle_struct *handle,
+			     files_struct *fsp, SMB_STRUCT_STAT *sbuf)
+{
+	struct stat st;
+	int ret;
+
+	GLUSTER_PROF_START(fstat);
+	glusterfs_fd_prepare_read(handle, fsp);
+	ret = GLUSTER_PROF_RET(fstat,
+		glfs_fstat(vfs_gluster_fetch_glfd(handle, fsp),
+			   &st));
+	if (ret == 0) {
+		smb_stat_ex_from_stat(sbuf, &st);
+		/* the freshest we can get, refresh the cache with it */
+		gluster_stat_cache_store(handle, fsp->fsp_name->base_name,
+					 false, sbuf);
+	}
+	if (ret < 0) {
+		DEBUG(0, ("glfs_fstat(%d) failed: %s\n",
+			  fsp->fh->fd, strerror(errno)));
+	}
+	return ret;
+}
+
+static int vfs_gluster_lstat(struct vfs_handle_struct *handle,
+			     struct smb_filename *smb_fname)
+{
+	struct stat st;
+	const char *path;
+	int ret;
+
+	GLUSTER_PROF_START(lstat);
+
+	glusterfs_meta_wait(handle, smb_fname->base_name);
+	glusterfs_fd_sync_others(handle->data, NULL, smb_fname->base_name);
+
+	if (gluster_stat_cache_fetch(handle, smb_fname->base_name, true,
+				     &smb_fname->st)) {
+		GLUSTER_PROF_END(lstat, false, 0);
+		return 0;
+	}
+
+	path = glusterfs_snapshot_path(handle, smb_fname->base_name);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET(lstat, -1);
+	}
+
+	ret = GLUSTER_PROF_RET(lstat,
+		glusterfs_path_stat(handle, path, false, &st));
+	if (ret == 0) {
+		smb_stat_ex_from_stat(&smb_fname->st, &st);
+		gluster_stat_cache_store(handle, smb_fname->base_name, true,
+					 &smb_fname->st);
+	}
+	if (ret < 0 && errno != ENOENT) {
+		DEBUG(0, ("glfs_lstat(%s) failed: %s\n",
+			  smb_fname->base_name, strerror(errno)));
+	}
+	return ret;
+}
+
+static uint64_t vfs_gluster_get_alloc_size(struct vfs_handle_struct *handle,
+					   files_struct *fsp,
+					   const SMB_STRUCT_STAT *sbuf)
+{
+	uint64_t result;
+
+	if (S_ISDIR(sbuf->st_ex_mode)) {
+		return 0;
+	}
+
+	/* the bricks report what is really allocated, holes included */
+	result = sbuf->st_ex_blocks * 512;
+
+	if (fsp != NULL && fsp->initial_allocation_size) {
+		result = MAX(result, fsp->initial_allocation_size);
+	}
+
+	return smb_roundup(handle->conn, result);
+}
+
+static int vfs_gluster_unlink(struct vfs_handle_struct *handle,
+			      const struct smb_filename *smb_fname)
+{
+	GLUSTER_PROF_START(unlink);
+	gluster_stat_cache_invalidate(handle, smb_fname->base_name);
+	gluster_name_cache_invalidate(handle, smb_fname->base_name);
+	gluster_xattr_cache_invalidate(handle, smb_fname->base_name);
+	gluster_cache_delete(gluster_fd_cache(handle), smb_fname->base_name);
+	return GLUSTER_PROF_RET(unlink, glusterfs_meta_unlink(handle, smb_fname));
+}
+
+static int vfs_gluster_chmod(struct vfs_handle_struct *handle,
+			     const char *path, mode_t mode)
+{
+	GLUSTER_PROF_START(chmod);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(chmod, glusterfs_path_chmod(handle, path, mode));
+}
+
+static int vfs_gluster_fchmod(struct vfs_handle_struct *handle,
+			      files_struct *fsp, mode_t mode)
+{
+	GLUSTER_PROF_START(fchmod);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	gluster_xattr_cache_invalidate(handle, fsp->fsp_name->base_name);
+	return GLUSTER_PROF_RET(fchmod,
+		glfs_fchmod(vfs_gluster_fetch_glfd(handle, fsp), mode));
+}
+
+static int vfs_gluster_chown(struct vfs_handle_struct *handle,
+			     const char *path, uid_t uid, gid_t gid)
+{
+	GLUSTER_PROF_START(chown);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(chown,
+		glfs_chown(vfs_gluster_fs(handle), path, uid, gid));
+}
+
+static int vfs_gluster_fchown(struct vfs_handle_struct *handle,
+			      files_struct *fsp, uid_t uid, gid_t gid)
+{
+	GLUSTER_PROF_START(fchown);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	return GLUSTER_PROF_RET(fchown,
+		glfs_fchown(vfs_gluster_fetch_glfd(handle, fsp), uid, gid));
+}
+
+static int vfs_gluster_lchown(struct vfs_handle_struct *handle,
+			      const char *path, uid_t uid, gid_t gid)
+{
+	GLUSTER_PROF_START(lchown);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(lchown,
+		glfs_lchown(vfs_gluster_fs(handle), path, uid, gid));
+}
+
+static int vfs_gluster_chdir(struct vfs_handle_struct *handle, const char *path)
+{
+#ifdef HAVE_GLFS_HANDLES
+	struct glusterfs_conn *conn = handle->data;
+	char cwd[PATH_MAX];
+#endif
+	int ret;
+
+	GLUSTER_PROF_START(chdir);
+	/* cached fds are keyed by paths relative to the old directory */
+	gluster_cache_flush(gluster_fd_cache(handle));
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET(chdir, -1);
+	}
+	ret = GLUSTER_PROF_RET(chdir,
+		glfs_chdir(vfs_gluster_fs(handle), path));
+
+#ifdef HAVE_GLFS_HANDLES
+	/* relative paths are resolved against this for the handle cache */
+	if (ret == 0 && conn->handle_cache != NULL) {
+		TALLOC_FREE(conn->cwd);
+		if (glfs_getcwd(conn->fs, cwd, sizeof(cwd)) != NULL) {
+			conn->cwd = talloc_strdup(conn, cwd);
+		}
+	}
+#endif
+
+	return ret;
+}
+
+static char *vfs_gluster_getwd(struct vfs_handle_struct *handle, char *path)
+{
+	char *ret;
+
+	GLUSTER_PROF_START(getwd);
+	ret = glfs_getcwd(vfs_gluster_fs(handle), path, PATH_MAX);
+	GLUSTER_PROF_END(getwd, ret == NULL, 0);
+
+	return ret;
+}
+
+static int vfs_gluster_ntimes(struct vfs_handle_struct *handle,
+			      const struct smb_filename *smb_fname,
+			      struct smb_file_time *ft)
+{
+	struct timespec times[2];
+
+	GLUSTER_PROF_START(ntimes);
+	glusterfs_meta_wait(handle, smb_fname->base_name);
+
+	if (null_timespec(ft->atime)) {
+		times[0].tv_sec = smb_fname->st.st_ex_atime.tv_sec;
+		times[0].tv_nsec = smb_fname->st.st_ex_atime.tv_nsec;
+	} else {
+		times[0].tv_sec = ft->atime.tv_sec;
+		times[0].tv_nsec = ft->atime.tv_nsec;
+	}
+
+	if (null_timespec(ft->mtime)) {
+		times[1].tv_sec = smb_fname->st.st_ex_mtime.tv_sec;
+		times[1].tv_nsec = smb_fname->st.st_ex_mtime.tv_nsec;
+	} else {
+		times[1].tv_sec = ft->mtime.tv_sec;
+		times[1].tv_nsec = ft->mtime.tv_nsec;
+	}
+
+	if ((timespec_compare(&times[0],
+			      &smb_fname->st.st_ex_atime) == 0) &&
+	    (timespec_compare(&times[1],
+			      &smb_fname->st.st_ex_mtime) == 0)) {
+		GLUSTER_PROF_END(ntimes, false, 0);
+		return 0;
+	}
+
+	gluster_stat_cache_invalidate(handle, smb_fname->base_name);
+
+	return GLUSTER_PROF_RET(ntimes,
+		glfs_utimens(vfs_gluster_fs(handle), smb_fname->base_name,
+			     times));
+}
+
+static int vfs_gluster_ftruncate(struct vfs_handle_struct *handle,
+				 files_struct *fsp, off_t offset)
+{
+	GLUSTER_PROF_START(ftruncate);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
+		GLUSTER_PROF_END(ftruncate, true, 0);
+		return -1;
+	}
+	return GLUSTER_PROF_RET(ftruncate,
+		glfs_ftruncate(vfs_gluster_fetch_glfd(handle, fsp), offset));
+}
+
+static int vfs_gluster_fallocate(struct vfs_handle_struct *handle,
+				 struct files_struct *fsp,
+				 enum vfs_fallocate_mode mode,
+				 off_t offset, off_t len)
+{
+#ifdef HAVE_GLFS_FALLOCATE
+	int keep_size;
+
+	switch (mode) {
+	case VFS_FALLOCATE_EXTEND_SIZE:
+		keep_size = 0;
+		break;
+	case VFS_FALLOCATE_KEEP_SIZE:
+		keep_size = 1;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	GLUSTER_PROF_START(fallocate);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
+		GLUSTER_PROF_END(fallocate, true, 0);
+		return -1;
+	}
+	return GLUSTER_PROF_RET(fallocate,
+		glfs_fallocate(vfs_gluster_fetch_glfd(handle, fsp),
+			       keep_size, offset, len));
+#else
+	/* smbd writes zeros itself */
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static char *vfs_gluster_realpath(struct vfs_handle_struct *handle,
+				  const char *path)
+{
+	char *ret;
+
+	GLUSTER_PROF_START(realpath);
+	glusterfs_meta_wait(handle, path);
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		GLUSTER_PROF_END(realpath, true, 0);
+		return NULL;
+	}
+	ret = glfs_realpath(vfs_gluster_fs(handle), path, 0);
+	GLUSTER_PROF_END(realpath, ret == NULL, 0);
+
+	return ret;
+}
+
+/*
+ * Lock tests answered locally.
+ *
+ * smbd tests for conflicting POSIX locks around most of its own locking,
+ * and the answer is nearly always that there are none. With
+ * glusterfs:lock_cache each fd remembers the ranges it holds: nobody
+ * else can hold a conflicting lock in a range we hold a write lock on,
+ * nor a write lock where we hold a read lock, so tests for such ranges
+ * need no round trip. Neither do tests while the fd has a read-write
+ * lease, which no other open of the file can coexist with.
+ */
+
+/* end of a range locked up to the end of the file */
+#define LOCK_RANGE_EOF INT64_MAX
+
+struct glusterfs_lock_range {
+	struct glusterfs_lock_range *prev, *next;
+	off_t start;
+	/* exclusive */
+	off_t end;
+	int type;
+};
+
+#ifdef HAVE_GLFS_LEASE
+/* in the lease code below */
+static bool glusterfs_lease_exclusive(files_struct *fsp);
+#endif
+
+static void glusterfs_lock_table_clear(struct glusterfs_fd *fd)
+{
+	struct glusterfs_lock_range *r;
+
+	while ((r = fd->locks) != NULL) {
+		DLIST_REMOVE(fd->locks, r);
+		TALLOC_FREE(r);
+	}
+}
+
+/* The range of a lock request, false if it is not one we track. */
+static bool glusterfs_lock_range(off_t offset, off_t count,
+				 off_t *start, off_t *end)
+{
+	if (offset < 0 || count < 0) {
+		return false;
+	}
+
+	*start = offset;
+	if (count == 0 || count > LOCK_RANGE_EOF - offset) {
+		*end = LOCK_RANGE_EOF;
+	} else {
+		*end = offset + count;
+	}
+
+	return true;
+}
+
+/* Forget [start, end), splitting ranges that extend past it. */
+static bool glusterfs_lock_table_remove(struct glusterfs_fd *fd,
+					off_t start, off_t end)
+{
+	struct glusterfs_lock_range *r, *next, *tail;
+
+	for (r = fd->locks; r != NULL; r = next) {
+		next = r->next;
+
+		if (r->end <= start || r->start >= end) {
+			continue;
+		}
+
+		if (r->start < start && r->end > end) {
+			tail = talloc_zero(fd->mem_ctx,
+					   struct glusterfs_lock_range);
+			if (tail == NULL) {
+				return false;
+			}
+			tail->start = end;
+			tail->end = r->end;
+			tail->type = r->type;
+			DLIST_ADD(fd->locks, tail);
+			r->end = start;
+		} else if (r->start < start) {
+			r->end = start;
+		} else if (r->end > end) {
+			r->start = end;
+		} else {
+			DLIST_REMOVE(fd->locks, r);
+			TALLOC_FREE(r);
+		}
+	}
+
+	return true;
+}
+
+/* A lock request on fsp succeeded, lock ranges replace what they cover. */
+static void glusterfs_lock_table_update(struct vfs_handle_struct *handle,
+					files_struct *fsp, off_t offset,
+					off_t count, int type)
+{
+	struct glusterfs_fd *fd = vfs_gluster_fetch_fd(handle, fsp);
+	struct glusterfs_lock_range *r;
+	struct glusterfs_fd *other_fd;
+	files_struct *other;
+	off_t start, end;
+
+	if (type == F_UNLCK) {
+		/*
+		 * Depending on the lock owner gfapi uses, unlocking through
+		 * one fd may drop locks taken through another of the file.
+		 */
+		for (other = file_find_di_first(handle->conn->sconn,
+						fsp->file_id);
+		     other != NULL; other = file_find_di_next(other)) {
+			if (other == fsp) {
+				continue;
+			}
+			other_fd = vfs_gluster_fetch_fd(handle, other);
+			if (other_fd != NULL) {
+				glusterfs_lock_table_clear(other_fd);
+			}
+		}
+	}
+
+	if (!glusterfs_lock_range(offset, count, &start, &end) ||
+	    !glusterfs_lock_table_remove(fd, start, end)) {
+		glusterfs_lock_table_clear(fd);
+		return;
+	}
+
+	if (type == F_UNLCK) {
+		return;
+	}
+
+	r = talloc_zero(fd->mem_ctx, struct glusterfs_lock_range);
+	if (r == NULL) {
+		glusterfs_lock_table_clear(fd);
+		return;
+	}
+	r->start = start;
+	r->end = end;
+	r->type = type;
+	DLIST_ADD(fd->locks, r);
+}
+
+/* True if nobody else can hold a lock conflicting with type there. */
+static bool glusterfs_lock_table_test(files_struct *fsp,
+				      struct glusterfs_fd *fd,
+				      off_t offset, off_t count, int type)
+{
+	struct glusterfs_lock_range *r;
+	off_t pos, end;
+
+#ifdef HAVE_GLFS_LEASE
+	if (glusterfs_lease_exclusive(fsp)) {
+		return true;
+	}
+#endif
+
+	if (!glusterfs_lock_range(offset, count, &pos, &end)) {
+		return false;
+	}
+
+	while (pos < end) {
+		for (r = fd->locks; r != NULL; r = r->next) {
+			if (r->start <= pos && pos < r->end &&
+			    (r->type == F_WRLCK || type == F_RDLCK)) {
+				break;
+			}
+		}
+		if (r == NULL) {
+			return false;
+		}
+		pos = r->end;
+	}
+
+	return true;
+}
+
+static bool vfs_gluster_lock(struct vfs_handle_struct *handle,
+			     files_struct *fsp, int op, off_t offset,
+			     off_t count, int type)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_fd *fd = vfs_gluster_fetch_fd(handle, fsp);
+	struct flock flock = { 0, };
+	int ret;
+
+	GLUSTER_PROF_START(lock);
+
+	flock.l_type = type;
+	flock.l_whence = SEEK_SET;
+	flock.l_start = offset;
+	flock.l_len = count;
+	flock.l_pid = 0;
+
+	if (op == F_GETLK && conn->lock_cache &&
+	    glusterfs_lock_table_test(fsp, fd, offset, count, type)) {
+		GLUSTER_PROF_END(lock, false, 0);
+		return false;
+	}
+
+	/* others may have changed what we read ahead before the lock */
+	glusterfs_fd_flush_deferred(fd);
+	glusterfs_fd_drop_readahead(fd);
+
+	ret = GLUSTER_PROF_RET(lock,
+		glfs_posix_lock(vfs_gluster_fetch_glfd(handle, fsp),
+				op, &flock));
+
+	if (op != F_GETLK && ret == 0 && type != F_UNLCK) {
+		fd->locked = true;
+	}
+
+	if (op != F_GETLK && conn->lock_cache) {
+		if (ret == 0) {
+			glusterfs_lock_table_update(handle, fsp, offset,
+						    count, type);
+		} else if (type == F_UNLCK) {
+			/* we no longer know what we hold */
+			glusterfs_lock_table_clear(fd);
+		}
+	}
+
+	if (op == F_GETLK) {
+		/* lock query, true if someone else has locked */
+		if ((ret != -1) &&
+		    (flock.l_type != F_UNLCK) &&
+		    (flock.l_pid != 0) && (flock.l_pid != getpid()))
+			return true;
+		/* not me */
+		return false;
+	}
+
+	if (ret == -1) {
+		return false;
+	}
+
+	return true;
+}
+
+static int vfs_gluster_kernel_flock(struct vfs_handle_struct *handle,
+				    files_struct *fsp, uint32 share_mode,
+				    uint32_t access_mask)
+{
+	return 0;
+}
+
+/*
+ * Kernel oplocks (kernel oplocks = yes) mapped onto Gluster leases, which
+ * need features.leases on the volume. Every lease gets an id of its own,
+ * so that gfapi recalls it when another client (or another smbd) opens
+ * the file in a conflicting way. The recall arrives on a gfapi thread
+ * and is passed to the main thread through a pipe by lease id, where it
+ * is turned into an oplock break, the same way smbd handles kernel lease
+ * breaks. smbd then releases the lease with F_UNLCK.
+ */
+
+#ifdef HAVE_GLFS_LEASE
+
+struct glusterfs_lease {
+	struct glusterfs_lease *prev, *next;
+	files_struct *fsp;
+	glfs_leaseid_t id;
+	/* GLFS_RD_LEASE or GLFS_RW_LEASE once granted */
+	int type;
+};
+
+static struct glusterfs_lease *glusterfs_leases;
+static uint64_t glusterfs_lease_counter;
+static int lease_pipe_read_fd = -1;
+static int lease_pipe_write_fd = -1;
+static struct tevent_fd *lease_read_event;
+
+/* runs on a gfapi thread */
+static void glusterfs_lease_recall(struct glfs_lease lease, void *data)
+{
+	if (write(lease_pipe_write_fd, lease.lease_id,
+		  sizeof(glfs_leaseid_t)) != sizeof(glfs_leaseid_t)) {
+		DEBUG(0, ("lease recall lost: %s\n", strerror(errno)));
+	}
+}
+
+static void glusterfs_lease_handler(struct tevent_context *ev_ctx,
+				    struct tevent_fd *fde,
+				    uint16_t flags, void *private_data)
+{
+	glfs_leaseid_t id;
+	struct glusterfs_lease *l;
+
+	if (sys_read(lease_pipe_read_fd, id, sizeof(id)) != sizeof(id)) {
+		return;
+	}
+
+	for (l = glusterfs_leases; l != NULL; l = l->next) {
+		if (memcmp(l->id, id, sizeof(id)) == 0) {
+			break;
+		}
+	}
+	if (l == NULL) {
+		/* already released */
+		return;
+	}
+
+	DEBUG(10, ("lease recall for %s\n", fsp_str_dbg(l->fsp)));
+	break_kernel_oplock(server_messaging_context(), l->fsp);
+}
+
+static bool glusterfs_lease_init(void)
+{
+	int fds[2];
+
+	if (lease_read_event != NULL) {
+		return true;
+	}
+
+	if (pipe(fds) == -1) {
+		DEBUG(0, ("Failed to create lease pipe (%s)\n",
+			  strerror(errno)));
+		return false;
+	}
+
+	/* never stall a gfapi thread on a full pipe */
+	set_blocking(fds[0], false);
+	set_blocking(fds[1], false);
+
+	lease_pipe_read_fd = fds[0];
+	lease_pipe_write_fd = fds[1];
+
+	lease_read_event = tevent_add_fd(server_event_context(), NULL,
+					 lease_pipe_read_fd, TEVENT_FD_READ,
+					 glusterfs_lease_handler, NULL);
+	if (lease_read_event == NULL) {
+		DEBUG(0, ("Failed to register lease pipe\n"));
+		close(lease_pipe_read_fd);
+		close(lease_pipe_write_fd);
+		lease_pipe_read_fd = -1;
+		lease_pipe_write_fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static int glusterfs_lease_destructor(struct glusterfs_lease *l)
+{
+	DLIST_REMOVE(glusterfs_leases, l);
+	return 0;
+}
+
+static struct glusterfs_lease *glusterfs_lease_find(files_struct *fsp)
+{
+	struct glusterfs_lease *l;
+
+	for (l = glusterfs_leases; l != NULL; l = l->next) {
+		if (l->fsp == fsp) {
+			return l;
+		}
+	}
+
+	return NULL;
+}
+
+/* no other open of the file can exist while fsp holds a RW lease */
+static bool glusterfs_lease_exclusive(files_struct *fsp)
+{
+	struct glusterfs_lease *l = glusterfs_lease_find(fsp);
+
+	return (l != NULL) && (l->type == GLFS_RW_LEASE);
+}
+
+static int glusterfs_setlease(struct vfs_handle_struct *handle,
+			      files_struct *fsp, int leasetype)
+{
+	glfs_fd_t *glfd = vfs_gluster_fetch_glfd(handle, fsp);
+	struct glfs_lease lease;
+	struct glusterfs_lease *l;
+	int ret;
+
+	ZERO_STRUCT(lease);
+
+	l = glusterfs_lease_find(fsp);
+
+	if (leasetype == F_UNLCK) {
+		if (l == NULL) {
+			return 0;
+		}
+		lease.cmd = GLFS_UNLK_LEASE;
+		memcpy(lease.lease_id, l->id, sizeof(l->id));
+		ret = glfs_lease(glfd, &lease, glusterfs_lease_recall, NULL);
+		TALLOC_FREE(l);
+		return ret;
+	}
+
+	if (leasetype == F_WRLCK) {
+		lease.lease_type = GLFS_RW_LEASE;
+	} else if (leasetype == F_RDLCK) {
+		lease.lease_type = GLFS_RD_LEASE;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!glusterfs_lease_init()) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (l == NULL) {
+		/* freed with the fsp if smbd never releases it */
+		l = talloc_zero(fsp, struct glusterfs_lease);
+		if (l == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		l->fsp = fsp;
+		SIVAL(l->id, 0, getpid());
+		SIVAL(l->id, 4, fsp->fnum);
+		SBVAL(l->id, 8, ++glusterfs_lease_counter);
+		DLIST_ADD(glusterfs_leases, l);
+		talloc_set_destructor(l, glusterfs_lease_destructor);
+	}
+
+	lease.cmd = GLFS_SET_LEASE;
+	memcpy(lease.lease_id, l->id, sizeof(l->id));
+
+	ret = glfs_lease(glfd, &lease, glusterfs_lease_recall, NULL);
+	if (ret == -1) {
+		DEBUG(5, ("glfs_lease(%s) failed: %s\n", fsp_str_dbg(fsp),
+			  strerror(errno)));
+		TALLOC_FREE(l);
+	} else {
+		l->type = lease.lease_type;
+	}
+
+	return ret;
+}
+
+#endif /* HAVE_GLFS_LEASE */
+
+static int vfs_gluster_linux_setlease(struct vfs_handle_struct *handle,
+				      files_struct *fsp, int leasetype)
+{
+#ifdef HAVE_GLFS_LEASE
+	GLUSTER_PROF_START(linux_setlease);
+	return GLUSTER_PROF_RET(linux_setlease,
+		glusterfs_setlease(handle, fsp, leasetype));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static bool vfs_gluster_getlock(struct vfs_handle_struct *handle,
+				files_struct *fsp, off_t *poffset,
+				off_t *pcount, int *ptype, pid_t *ppid)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct flock flock = { 0, };
+	int ret;
+
+	GLUSTER_PROF_START(getlock);
+
+	flock.l_type = *ptype;
+	flock.l_whence = SEEK_SET;
+	flock.l_start = *poffset;
+	flock.l_len = *pcount;
+	flock.l_pid = 0;
+
+	if (conn->lock_cache &&
+	    glusterfs_lock_table_test(fsp, vfs_gluster_fetch_fd(handle, fsp),
+				      *poffset, *pcount, *ptype)) {
+		GLUSTER_PROF_END(getlock, false, 0);
+		*ptype = F_UNLCK;
+		return true;
+	}
+	glusterfs_fd_prepare_read(handle, fsp);
+	ret = GLUSTER_PROF_RET(getlock,
+		glfs_posix_lock(vfs_gluster_fetch_glfd(handle, fsp),
+				F_GETLK, &flock));
+
+	if (ret == -1) {
+		return false;
+	}
+
+	*ptype = flock.l_type;
+	*poffset = flock.l_start;
+	*pcount = flock.l_len;
+	*ppid = flock.l_pid;
+
+	return true;
+}
+
+static int vfs_gluster_symlink(struct vfs_handle_struct *handle,
+			       const char *oldpath, const char *newpath)
+{
+	GLUSTER_PROF_START(symlink);
+	glusterfs_meta_wait(handle, newpath);
+	gluster_stat_cache_invalidate(handle, newpath);
+	gluster_name_cache_invalidate(handle, newpath);
+	gluster_xattr_cache_invalidate(handle, newpath);
+	return GLUSTER_PROF_RET(symlink,
+		glfs_symlink(vfs_gluster_fs(handle), oldpath, newpath));
+}
+
+static int vfs_gluster_readlink(struct vfs_handle_struct *handle,
+				const char *path, char *buf, size_t bufsiz)
+{
+	GLUSTER_PROF_START(readlink);
+	glusterfs_meta_wait(handle, path);
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET(readlink, -1);
+	}
+	return GLUSTER_PROF_RET_BYTES(readlink,
+		glfs_readlink(vfs_gluster_fs(handle), path, buf, bufsiz));
+}
+
+static int vfs_gluster_link(struct vfs_handle_struct *handle,
+			    const char *oldpath, const char *newpath)
+{
+	GLUSTER_PROF_START(link);
+	glusterfs_meta_wait(handle, newpath);
+	/* the link count of oldpath changes as well */
+	gluster_stat_cache_invalidate(handle, oldpath);
+	gluster_stat_cache_invalidate(handle, newpath);
+	gluster_name_cache_invalidate(handle, newpath);
+	gluster_xattr_cache_invalidate(handle, newpath);
+	return GLUSTER_PROF_RET(link,
+		glfs_link(vfs_gluster_fs(handle), oldpath, newpath));
+}
+
+static int vfs_gluster_mknod(struct vfs_handle_struct *handle, const char *path,
+			     mode_t mode, SMB_DEV_T dev)
+{
+	GLUSTER_PROF_START(mknod);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_name_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(mknod,
+		glfs_mknod(vfs_gluster_fs(handle), path, mode, dev));
+}
+
+/*
+ * Change notify from GlusterFS cache invalidation upcalls (the volume
+ * needs features.cache-invalidation). The upcalls are delivered on a
+ * gfapi thread, which passes them to the main thread through a pipe as
+ * fixed size messages carrying the gfids involved. There they are
+ * matched against the watched directories and merged into a pending
+ * filter per watch; after glusterfs:notify_delay msec every watch with
+ * something pending gets a single event, however many upcalls came in.
+ *
+ * Upcalls do not carry names, so the event has an empty name and tells
+ * the client to read the directory again. Changes made through this
+ * smbd are reported by smbd itself, the watch filter is left alone.
+ */
+
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+
+#define DEFAULT_NOTIFY_DELAY 100
+
+#ifndef FILE_NOTIFY_CHANGE_EA
+#define FILE_NOTIFY_CHANGE_EA 0x80
+#endif
+
+struct glusterfs_notify_msg {
+	glfs_t *fs;
+	uint64_t flags;
+	unsigned char gfid[GFAPI_HANDLE_LENGTH];
+	unsigned char pgfid[GFAPI_HANDLE_LENGTH];
+	unsigned char oldpgfid[GFAPI_HANDLE_LENGTH];
+};
+
+struct glusterfs_notify_watch {
+	struct glusterfs_notify_watch *prev, *next;
+	glfs_t *fs;
+	unsigned char gfid[GFAPI_HANDLE_LENGTH];
+	uint32_t filter;
+	uint32_t pending;
+	struct sys_notify_context *ctx;
+	void (*callback)(struct sys_notify_context *ctx, void *private_data,
+			 struct notify_event *ev);
+	void *private_data;
+};
+
+static struct glusterfs_notify_watch *notify_watches;
+static int notify_pipe_read_fd = -1;
+static int notify_pipe_write_fd = -1;
+static struct tevent_fd *notify_read_event;
+static struct tevent_timer *notify_timer;
+static int notify_delay = DEFAULT_NOTIFY_DELAY;
+/* set by the upcall thread when the pipe was full */
+static volatile bool notify_overflow;
+
+static void glusterfs_upcall_extract(struct glfs_object *object,
+				     unsigned char *gfid)
+{
+	if (object != NULL) {
+		glfs_h_extract_handle(object, gfid, GFAPI_HANDLE_LENGTH);
+	}
+}
+
+/* runs on a gfapi thread */
+static void glusterfs_upcall(struct glfs_upcall *up, void *data)
+{
+	struct glusterfs_notify_msg msg;
+	struct glfs_upcall_inode *in;
+
+	if (glfs_upcall_get_reason(up) != GLFS_UPCALL_INODE_INVALIDATE) {
+		glfs_free(up);
+		return;
+	}
+
+	in = glfs_upcall_get_event(up);
+
+	ZERO_STRUCT(msg);
+	msg.fs = glfs_upcall_get_fs(up);
+	msg.flags = glfs_upcall_inode_get_flags(in);
+	glusterfs_upcall_extract(glfs_upcall_inode_get_object(in), msg.gfid);
+	glusterfs_upcall_extract(glfs_upcall_inode_get_pobject(in), msg.pgfid);
+	glusterfs_upcall_extract(glfs_upcall_inode_get_oldpobject(in),
+				 msg.oldpgfid);
+
+	glfs_free(up);
+
+	/* smaller than PIPE_BUF, so written whole or not at all */
+	if (write(notify_pipe_write_fd, &msg, sizeof(msg)) != sizeof(msg)) {
+		notify_overflow = true;
+	}
+}
+
+static uint32_t glusterfs_notify_filter(const struct glusterfs_notify_watch *w,
+					const struct glusterfs_notify_msg *msg)
+{
+	uint32_t filter = 0;
+
+	if (memcmp(msg->gfid, w->gfid, GFAPI_HANDLE_LENGTH) == 0) {
+		/* the directory itself: entries came or went */
+		if (msg->flags & (GFAPI_UP_TIMES | GFAPI_UP_NLINK)) {
+			filter |= FILE_NOTIFY_CHANGE_FILE_NAME |
+				  FILE_NOTIFY_CHANGE_DIR_NAME;
+		}
+		return filter;
+	}
+
+	if (memcmp(msg->pgfid, w->gfid, GFAPI_HANDLE_LENGTH) != 0 &&
+	    memcmp(msg->oldpgfid, w->gfid, GFAPI_HANDLE_LENGTH) != 0) {
+		return 0;
+	}
+
+	if (msg->flags & (GFAPI_UP_RENAME | GFAPI_UP_NLINK |
+			  GFAPI_UP_PARENT_TIMES)) {
+		filter |= FILE_NOTIFY_CHANGE_FILE_NAME |
+			  FILE_NOTIFY_CHANGE_DIR_NAME;
+	}
+	if (msg->flags & GFAPI_UP_SIZE) {
+		filter |= FILE_NOTIFY_CHANGE_SIZE;
+	}
+	if (msg->flags & GFAPI_UP_TIMES) {
+		filter |= FILE_NOTIFY_CHANGE_LAST_WRITE;
+	}
+	if (msg->flags & (GFAPI_UP_MODE | GFAPI_UP_OWN)) {
+		filter |= FILE_NOTIFY_CHANGE_ATTRIBUTES |
+			  FILE_NOTIFY_CHANGE_SECURITY;
+	}
+	if (msg->flags & (GFAPI_UP_XATTR | GFAPI_UP_XATTR_RM)) {
+		filter |= FILE_NOTIFY_CHANGE_EA |
+			  FILE_NOTIFY_CHANGE_ATTRIBUTES;
+	}
+
+	return filter;
+}
+
+static void glusterfs_notify_deliver(struct tevent_context *ev_ctx,
+				     struct tevent_timer *te,
+				     struct timeval now, void *private_data)
+{
+	struct glusterfs_notify_watch *w, *next;
+	struct notify_event ev;
+
+	notify_timer = NULL;
+
+	for (w = notify_watches; w != NULL; w = next) {
+		next = w->next;
+		if (w->pending == 0) {
+			continue;
+		}
+		w->pending = 0;
+
+		ev.action = NOTIFY_ACTION_MODIFIED;
+		ev.path = "";
+		ev.private_data = NULL;
+		w->callback(w->ctx, w->private_data, &ev);
+	}
+}
+
+static void glusterfs_notify_handler(struct tevent_context *ev_ctx,
+				     struct tevent_fd *fde,
+				     uint16_t flags, void *private_data)
+{
+	struct glusterfs_notify_msg msg;
+	struct glusterfs_notify_watch *w;
+	bool pending = false;
+
+	while (sys_read(notify_pipe_read_fd, &msg, sizeof(msg)) ==
+	       sizeof(msg)) {
+		for (w = notify_watches; w != NULL; w = w->next) {
+			if (w->fs == msg.fs) {
+				w->pending |= glusterfs_notify_filter(w, &msg) &
+					      w->filter;
+			}
+		}
+		/* parked fds skip the permission check of an open */
+		if (msg.flags & (GFAPI_UP_NLINK | GFAPI_UP_RENAME |
+				 GFAPI_UP_FORGET | GFAPI_UP_MODE |
+				 GFAPI_UP_OWN | GFAPI_UP_XATTR |
+				 GFAPI_UP_XATTR_RM)) {
+			glusterfs_fd_cache_upcall(msg.fs, msg.gfid);
+		}
+#ifdef HAVE_GLFS_HANDLES
+		if (msg.flags & (GFAPI_UP_NLINK | GFAPI_UP_RENAME |
+				 GFAPI_UP_FORGET)) {
+			glusterfs_handle_upcall(msg.fs, msg.gfid);
+		}
+#endif
+	}
+
+	if (notify_overflow) {
+		notify_overflow = false;
+		for (w = notify_watches; w != NULL; w = w->next) {
+			w->pending = w->filter;
+		}
+		glusterfs_fd_cache_upcall(NULL, NULL);
+#ifdef HAVE_GLFS_HANDLES
+		glusterfs_handle_upcall_overflow();
+#endif
+	}
+
+	for (w = notify_watches; w != NULL; w = w->next) {
+		pending |= (w->pending != 0);
+	}
+
+	if (pending && notify_timer == NULL) {
+		notify_timer = tevent_add_timer(server_event_context(), NULL,
+				timeval_current_ofs_msec(notify_delay),
+				glusterfs_notify_deliver, NULL);
+	}
+}
+
+static bool glusterfs_notify_init(void)
+{
+	int fds[2];
+
+	if (notify_read_event != NULL) {
+		return true;
+	}
+
+	if (pipe(fds) == -1) {
+		DEBUG(0, ("Failed to create notify pipe (%s)\n",
+			  strerror(errno)));
+		return false;
+	}
+
+	/* the upcall thread must never block, the main thread drains */
+	set_blocking(fds[0], false);
+	set_blocking(fds[1], false);
+
+	notify_pipe_read_fd = fds[0];
+	notify_pipe_write_fd = fds[1];
+
+	notify_read_event = tevent_add_fd(server_event_context(), NULL,
+					  notify_pipe_read_fd, TEVENT_FD_READ,
+					  glusterfs_notify_handler, NULL);
+	if (notify_read_event == NULL) {
+		DEBUG(0, ("Failed to register notify pipe\n"));
+		close(notify_pipe_read_fd);
+		close(notify_pipe_write_fd);
+		notify_pipe_read_fd = -1;
+		notify_pipe_write_fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/* Have conn->fs deliver upcalls to the notify pipe. */
+static bool glusterfs_upcall_init(struct glusterfs_conn *conn)
+{
+	struct glfs_preopened *preopened = conn->preopened;
+
+	if (preopened->upcall_registered) {
+		return true;
+	}
+	if (preopened->upcall_failed) {
+		return false;
+	}
+
+	if (!glusterfs_notify_init()) {
+		preopened->upcall_failed = true;
+		return false;
+	}
+
+	if (glfs_upcall_register(conn->fs, GLFS_EVENT_INODE_INVALIDATE,
+				 glusterfs_upcall, NULL) == -1) {
+		DEBUG(1, ("glfs_upcall_register failed: %s, caches that rely "
+			  "on upcalls are disabled for volume %s\n",
+			  strerror(errno), preopened->volume));
+		preopened->upcall_failed = true;
+		return false;
+	}
+	preopened->upcall_registered = true;
+
+	return true;
+}
+
+static int glusterfs_notify_watch_destructor(struct glusterfs_notify_watch *w)
+{
+	DLIST_REMOVE(notify_watches, w);
+	return 0;
+}
+
+static NTSTATUS glusterfs_notify_watch(struct vfs_handle_struct *handle,
+				       struct sys_notify_context *ctx,
+				       struct notify_entry *e,
+				       void (*callback) (struct sys_notify_context *ctx,
+							 void *private_data,
+							 struct notify_event *ev),
+				       void *private_data, void *handle_p)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct glusterfs_notify_watch *w;
+	struct glfs_object *object;
+	struct stat st;
+
+	if (!glusterfs_upcall_init(conn)) {
+		return NT_STATUS_NOT_IMPLEMENTED;
+	}
+
+	object = glfs_h_lookupat(conn->fs, NULL, e->path, &st, 1);
+	if (object == NULL) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	w = talloc_zero(ctx, struct glusterfs_notify_watch);
+	if (w == NULL) {
+		glfs_h_close(object);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	if (glfs_h_extract_handle(object, w->gfid, GFAPI_HANDLE_LENGTH) < 0) {
+		glfs_h_close(object);
+		TALLOC_FREE(w);
+		return map_nt_error_from_unix(errno);
+	}
+	glfs_h_close(object);
+
+	notify_delay = lp_parm_int(SNUM(handle->conn), "glusterfs",
+				   "notify_delay", DEFAULT_NOTIFY_DELAY);
+
+	w->fs = conn->fs;
+	w->filter = e->filter;
+	w->ctx = ctx;
+	w->callback = callback;
+	w->private_data = private_data;
+
+	DLIST_ADD(notify_watches, w);
+	talloc_set_destructor(w, glusterfs_notify_watch_destructor);
+
+	*(void **)handle_p = w;
+
+	return NT_STATUS_OK;
+}
+
+#endif /* HAVE_GLFS_UPCALL_REGISTER */
+
+static NTSTATUS vfs_gluster_notify_watch(struct vfs_handle_struct *handle,
+					 struct sys_notify_context *ctx,
+					 struct notify_entry *e,
+					 void (*callback) (struct sys_notify_context *ctx,
+							   void *private_data,
+							   struct notify_event *ev),
+					 void *private_data, void *handle_p)
+{
+#ifdef HAVE_GLFS_UPCALL_REGISTER
+	NTSTATUS status;
+
+	GLUSTER_PROF_START(notify_watch);
+	status = glusterfs_notify_watch(handle, ctx, e, callback,
+					private_data, handle_p);
+	GLUSTER_PROF_END(notify_watch, !NT_STATUS_IS_OK(status), 0);
+
+	return status;
+#else
+	return NT_STATUS_NOT_IMPLEMENTED;
+#endif
+}
+
+static int vfs_gluster_chflags(struct vfs_handle_struct *handle,
+			       const char *path, unsigned int flags)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static int glusterfs_get_real_filename(struct vfs_handle_struct *handle,
+				       const char *path, const char *name,
+				       TALLOC_CTX *mem_ctx, char **found_name)
+{
+	struct gluster_cache *cache = gluster_name_cache(handle);
+	struct gluster_name_entry *entry = NULL;
+	char *key = NULL;
+	int ret;
+	char key_buf[NAME_MAX + 64];
+	char val_buf[NAME_MAX + 1];
+
+	if (strlen(name) >= NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (cache != NULL) {
+		key = gluster_name_cache_key(talloc_tos(), path, name);
+	}
+
+	if (key != NULL) {
+		entry = gluster_cache_lookup(cache, key);
+		if (entry != NULL) {
+			TALLOC_FREE(key);
+			if (entry->found_name == NULL) {
+				errno = ENOENT;
+				return -1;
+			}
+			*found_name = talloc_strdup(mem_ctx,
+						    entry->found_name);
+			if (found_name[0] == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	snprintf(key_buf, NAME_MAX + 64,
+		 "glusterfs.get_real_filename:%s", name);
+
+	ret = glfs_getxattr(vfs_gluster_fs(handle), path, key_buf, val_buf, NAME_MAX + 1);
+	if (ret < 0) {
+		if (errno == ENOENT && key != NULL) {
+			entry = talloc_zero(NULL, struct gluster_name_entry);
+			if (entry != NULL) {
+				gluster_cache_add(cache, key, entry);
+			}
+			errno = ENOENT;
+		}
+		TALLOC_FREE(key);
+		if (errno == ENODATA) {
+			errno = EOPNOTSUPP;
+		}
+		return -1;
+	}
+
+	if ((size_t)ret < sizeof(val_buf)) {
+		val_buf[ret] = '\0';
+	} else {
+		val_buf[NAME_MAX] = '\0';
+	}
+
+	if (key != NULL) {
+		entry = talloc_zero(NULL, struct gluster_name_entry);
+		if (entry != NULL) {
+			entry->found_name = talloc_strdup(entry, val_buf);
+			gluster_cache_add(cache, key, entry);
+		}
+		TALLOC_FREE(key);
+	}
+
+	*found_name = talloc_strdup(mem_ctx, val_buf);
+	if (found_name[0] == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static int vfs_gluster_get_real_filename(struct vfs_handle_struct *handle,
+					 const char *path, const char *name,
+					 TALLOC_CTX *mem_ctx, char **found_name)
+{
+	GLUSTER_PROF_START(get_real_filename);
+	glusterfs_meta_drain(handle);
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET(get_real_filename, -1);
+	}
+	return GLUSTER_PROF_RET(get_real_filename,
+		glusterfs_get_real_filename(handle, path, name, mem_ctx,
+					    found_name));
+}
+
+static const char *vfs_gluster_connectpath(struct vfs_handle_struct *handle,
+					   const char *filename)
+{
+	return handle->conn->connectpath;
+}
+
+/*
+ * Server side copy (FSCTL_SRV_COPYCHUNK). The data is copied between the
+ * two gfapi fds without going through the client, with
+ * glfs_copy_file_range where gfapi has it and a pipelined read/write
+ * loop through the connection's copy buffers otherwise.
+ *
+ * Only copies within the same tree connect are offloaded, the resume key
+ * handed out identifies the source by file id and fnum.
+ */
+
+#ifndef FSCTL_SRV_REQUEST_RESUME_KEY
+#define FSCTL_SRV_REQUEST_RESUME_KEY 0x00140078
+#endif
+#ifndef FSCTL_SRV_COPYCHUNK
+#define FSCTL_SRV_COPYCHUNK 0x001440F2
+#endif
+#ifndef FSCTL_SRV_COPYCHUNK_WRITE
+#define FSCTL_SRV_COPYCHUNK_WRITE 0x001480F2
+#endif
+
+/* limits from MS-SMB2 3.3.3, also reported to clients exceeding them */
+#define COPYCHUNK_MAX_CHUNKS 256
+#define COPYCHUNK_MAX_CHUNK_LEN (1024 * 1024)
+#define COPYCHUNK_MAX_TOTAL_LEN (16 * 1024 * 1024)
+
+#define COPYCHUNK_RESUME_KEY_LEN 24
+#define COPYCHUNK_HDR_LEN (COPYCHUNK_RESUME_KEY_LEN + 8)
+#define COPYCHUNK_ENTRY_LEN 24
+#define COPYCHUNK_RSP_LEN 12
+
+static void glusterfs_resume_key(files_struct *fsp, uint8_t *key)
+{
+	SBVAL(key, 0, fsp->file_id.devid);
+	SBVAL(key, 8, fsp->file_id.inode);
+	SBVAL(key, 16, ((uint64_t)fsp->file_id.extid << 32) |
+		       (uint32_t)fsp->fnum);
+}
+
+static files_struct *glusterfs_resume_key_fsp(struct vfs_handle_struct *handle,
+					      const uint8_t *key)
+{
+	struct file_id id;
+	files_struct *fsp;
+	uint32_t fnum;
+
+	id.devid = BVAL(key, 0);
+	id.inode = BVAL(key, 8);
+	id.extid = BVAL(key, 16) >> 32;
+	fnum = BVAL(key, 16) & 0xffffffff;
+
+	for (fsp = file_find_di_first(handle->conn->sconn, id); fsp != NULL;
+	     fsp = file_find_di_next(fsp)) {
+		if ((uint32_t)fsp->fnum == fnum && fsp->conn == handle->conn) {
+			return fsp;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy len bytes from src to dst. Returns the number of bytes written,
+ * with errno set if that is less than len.
+ */
+static ssize_t glusterfs_copy_range(struct glusterfs_conn *conn,
+				    glfs_fd_t *src, off_t src_off,
+				    glfs_fd_t *dst, off_t dst_off, size_t len)
+{
+	struct glusterfs_write_io io;
+	char *buf[2];
+	int cur = 0;
+	size_t total = 0;
+	size_t total_written = 0;
+	ssize_t nread;
+	ssize_t ret;
+	int saved_errno = 0;
+
+#ifdef HAVE_GLFS_COPY_FILE_RANGE
+	while (total < len) {
+		off_t in = src_off + total;
+		off_t out = dst_off + total;
+
+		ret = glfs_copy_file_range(src, &in, dst, &out, len - total,
+					   0, NULL, NULL, NULL);
+		if (ret <= 0) {
+			if (ret == 0) {
+				/* the range was checked against the size */
+				errno = EIO;
+			}
+			break;
+		}
+		total += ret;
+	}
+	if (total == len) {
+		return total;
+	}
+	if (total > 0 || (errno != ENOSYS && errno != EXDEV &&
+			  errno != EOPNOTSUPP && errno != EINVAL)) {
+		return total;
+	}
+	/* no server side copy for this pair, copy it ourselves */
+#endif
+
+	if (conn->copy_buf == NULL) {
+		conn->copy_buf = glusterfs_alloc_iobuf(&conn->copy_bufsize, 2);
+		if (conn->copy_buf == NULL) {
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+
+	buf[0] = conn->copy_buf;
+	buf[1] = conn->copy_buf + conn->copy_bufsize;
+
+	ZERO_STRUCT(io);
+	pthread_mutex_init(&io.mutex, NULL);
+	pthread_cond_init(&io.cond, NULL);
+
+	while (total < len && saved_errno == 0) {
+		nread = glfs_pread(src, buf[cur],
+				   MIN(conn->copy_bufsize, len - total),
+				   src_off + total, 0);
+		if (nread <= 0) {
+			/* the range was checked against the size */
+			saved_errno = (nread == 0) ? EIO : errno;
+			break;
+		}
+
+		/* the previous chunk has to be out before we queue this one */
+		if (glusterfs_write_wait(&io, &total_written) == -1) {
+			saved_errno = errno;
+			break;
+		}
+
+		io.busy = true;
+		io.len = nread;
+		ret = glfs_pwrite_async(dst, buf[cur], nread, dst_off + total,
+					0, glusterfs_write_done, &io);
+		if (ret < 0) {
+			io.busy = false;
+			io.len = 0;
+			saved_errno = errno;
+			break;
+		}
+
+		/*
+		 * Reading the next chunk of the same file before the write
+		 * is out may see stale data if the ranges overlap.
+		 */
+		if (src == dst) {
+			if (glusterfs_write_wait(&io, &total_written) == -1) {
+				saved_errno = errno;
+				break;
+			}
+		}
+
+		total += nread;
+		cur ^= 1;
+	}
+
+	if (glusterfs_write_wait(&io, &total_written) == -1 &&
+	    saved_errno == 0) {
+		saved_errno = errno;
+	}
+
+	pthread_mutex_destroy(&io.mutex);
+	pthread_cond_destroy(&io.cond);
+
+	if (total_written < len && saved_errno == 0) {
+		saved_errno = EIO;
+	}
+	if (saved_errno) {
+		errno = saved_errno;
+	}
+
+	return total_written;
+}
+
+static NTSTATUS glusterfs_copychunk(struct vfs_handle_struct *handle,
+				    files_struct *fsp, uint32_t function,
+				    const uint8_t *in_data, uint32_t in_len,
+				    uint8_t *rsp, uint64_t *copied)
+{
+	struct glusterfs_conn *conn = handle->data;
+	files_struct *src_fsp;
+	glfs_fd_t *src_fd;
+	glfs_fd_t *dst_fd;
+	struct stat st;
+	struct lock_struct src_lock;
+	struct lock_struct dst_lock;
+	const uint8_t *chunk;
+	uint32_t num_chunks;
+	uint32_t chunks_written = 0;
+	uint64_t src_off, dst_off;
+	uint32_t len;
+	uint64_t total_len = 0;
+	uint32_t i;
+	ssize_t ret;
+	NTSTATUS status = NT_STATUS_OK;
+
+	if (in_len < COPYCHUNK_HDR_LEN) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	num_chunks = IVAL(in_data, COPYCHUNK_RESUME_KEY_LEN);
+	if (in_len < COPYCHUNK_HDR_LEN +
+		     (uint64_t)num_chunks * COPYCHUNK_ENTRY_LEN) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		chunk = in_data + COPYCHUNK_HDR_LEN + i * COPYCHUNK_ENTRY_LEN;
+		len = IVAL(chunk, 16);
+		if (len == 0 || len > COPYCHUNK_MAX_CHUNK_LEN) {
+			break;
+		}
+		total_len += len;
+	}
+	if (num_chunks > COPYCHUNK_MAX_CHUNKS || i < num_chunks ||
+	    total_len > COPYCHUNK_MAX_TOTAL_LEN) {
+		SIVAL(rsp, 0, COPYCHUNK_MAX_CHUNKS);
+		SIVAL(rsp, 4, COPYCHUNK_MAX_CHUNK_LEN);
+		SIVAL(rsp, 8, COPYCHUNK_MAX_TOTAL_LEN);
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	src_fsp = glusterfs_resume_key_fsp(handle, in_data);
+	if (src_fsp == NULL || src_fsp->is_directory || fsp->is_directory) {
+		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	if (!(src_fsp->access_mask & FILE_READ_DATA) ||
+	    !(fsp->access_mask & FILE_WRITE_DATA) ||
+	    (function == FSCTL_SRV_COPYCHUNK &&
+	     !(fsp->access_mask & FILE_READ_DATA))) {
+		return NT_STATUS_ACCESS_DENIED;
+	}
+
+	glusterfs_fd_prepare_read(handle, src_fsp);
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	src_fd = vfs_gluster_fetch_glfd(handle, src_fsp);
+	dst_fd = vfs_gluster_fetch_glfd(handle, fsp);
+
+	if (glfs_fstat(src_fd, &st) != 0) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+
+	for (i = 0; i < num_chunks; i++) {
+		chunk = in_data + COPYCHUNK_HDR_LEN + i * COPYCHUNK_ENTRY_LEN;
+		src_off = BVAL(chunk, 0);
+		dst_off = BVAL(chunk, 8);
+		len = IVAL(chunk, 16);
+
+		if (src_off > (uint64_t)st.st_size ||
+		    len > (uint64_t)st.st_size - src_off) {
+			status = NT_STATUS_INVALID_VIEW_SIZE;
+			break;
+		}
+
+		init_strict_lock_struct(src_fsp, src_fsp->fnum, src_off, len,
+					READ_LOCK, &src_lock);
+		init_strict_lock_struct(fsp, fsp->fnum, dst_off, len,
+					WRITE_LOCK, &dst_lock);
+
+		if (!SMB_VFS_STRICT_LOCK(src_fsp->conn, src_fsp, &src_lock)) {
+			status = NT_STATUS_FILE_LOCK_CONFLICT;
+			break;
+		}
+		if (!SMB_VFS_STRICT_LOCK(fsp->conn, fsp, &dst_lock)) {
+			SMB_VFS_STRICT_UNLOCK(src_fsp->conn, src_fsp,
+					      &src_lock);
+			status = NT_STATUS_FILE_LOCK_CONFLICT;
+			break;
+		}
+
+		ret = glusterfs_copy_range(conn, src_fd, src_off, dst_fd,
+					   dst_off, len);
+
+		SMB_VFS_STRICT_UNLOCK(fsp->conn, fsp, &dst_lock);
+		SMB_VFS_STRICT_UNLOCK(src_fsp->conn, src_fsp, &src_lock);
+
+		if (ret < 0) {
+			ret = 0;
+		}
+		*copied += ret;
+		if ((uint64_t)ret < len) {
+			DEBUG(1, ("copychunk: %s -> %s: copied %zd of %u bytes: "
+				  "%s\n", fsp_str_dbg(src_fsp),
+				  fsp_str_dbg(fsp), ret, len,
+				  strerror(errno)));
+			status = map_nt_error_from_unix(errno);
+			break;
+		}
+		chunks_written++;
+	}
+
+	SIVAL(rsp, 0, chunks_written);
+	SIVAL(rsp, 4, 0);
+	SIVAL(rsp, 8, *copied);
+
+	return status;
+}
+
+/*
+ * FSCTL_SET_ZERO_DATA: punch a hole into sparse files, zero the range in
+ * place in all others. Neither extends the file.
+ */
+
+#ifndef FSCTL_SET_ZERO_DATA
+#define FSCTL_SET_ZERO_DATA 0x000980C8
+#endif
+
+static NTSTATUS glusterfs_set_zero_data(struct vfs_handle_struct *handle,
+					files_struct *fsp,
+					const uint8_t *in_data,
+					uint32_t in_len)
+{
+	glfs_fd_t *glfd;
+	struct stat st;
+	struct lock_struct lock;
+	uint64_t offset, end;
+	int ret = -1;
+
+	if (in_len < 16 || fsp->is_directory) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	offset = BVAL(in_data, 0);
+	end = BVAL(in_data, 8);
+	if (end < offset) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	if (!(fsp->access_mask & FILE_WRITE_DATA)) {
+		return NT_STATUS_ACCESS_DENIED;
+	}
+
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	glfd = vfs_gluster_fetch_glfd(handle, fsp);
+
+	if (glfs_fstat(glfd, &st) != 0) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	end = MIN(end, (uint64_t)st.st_size);
+	if (offset >= end) {
+		return NT_STATUS_OK;
+	}
+
+	init_strict_lock_struct(fsp, fsp->fnum, offset, end - offset,
+				WRITE_LOCK, &lock);
+	if (!SMB_VFS_STRICT_LOCK(fsp->conn, fsp, &lock)) {
+		return NT_STATUS_FILE_LOCK_CONFLICT;
+	}
+
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+
+	errno = EOPNOTSUPP;
+#ifdef HAVE_GLFS_DISCARD
+	if (fsp->is_sparse) {
+		ret = glfs_discard(glfd, offset, end - offset);
+	}
+#endif
+#ifdef HAVE_GLFS_ZEROFILL
+	if (ret == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+		ret = glfs_zerofill(glfd, offset, end - offset);
+	}
+#endif
+
+	SMB_VFS_STRICT_UNLOCK(fsp->conn, fsp, &lock);
+
+	if (ret == -1) {
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			return NT_STATUS_NOT_SUPPORTED;
+		}
+		return map_nt_error_from_unix(errno);
+	}
+
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS vfs_gluster_fsctl(struct vfs_handle_struct *handle,
+				  struct files_struct *fsp,
+				  TALLOC_CTX *ctx,
+				  uint32_t function,
+				  uint16_t req_flags,
+				  const uint8_t *in_data,
+				  uint32_t in_len,
+				  uint8_t **out_data,
+				  uint32_t max_out_len,
+				  uint32_t *out_len)
+{
+	uint8_t *out;
+	uint64_t copied = 0;
+	NTSTATUS status;
+
+	switch (function) {
+	case FSCTL_SRV_REQUEST_RESUME_KEY:
+		/* key, context length and a (unused) context */
+		if (max_out_len < COPYCHUNK_RESUME_KEY_LEN + 8) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		out = talloc_zero_array(ctx, uint8_t,
+					COPYCHUNK_RESUME_KEY_LEN + 8);
+		if (out == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		glusterfs_resume_key(fsp, out);
+		*out_data = out;
+		*out_len = COPYCHUNK_RESUME_KEY_LEN + 8;
+		return NT_STATUS_OK;
+
+	case FSCTL_SRV_COPYCHUNK:
+	case FSCTL_SRV_COPYCHUNK_WRITE:
+		if (max_out_len < COPYCHUNK_RSP_LEN) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		out = talloc_zero_array(ctx, uint8_t, COPYCHUNK_RSP_LEN);
+		if (out == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+
+		{
+			GLUSTER_PROF_START(copychunk);
+			status = glusterfs_copychunk(handle, fsp, function,
+						     in_data, in_len, out,
+						     &copied);
+			GLUSTER_PROF_END(copychunk, !NT_STATUS_IS_OK(status),
+					 copied);
+		}
+
+		*out_data = out;
+		*out_len = COPYCHUNK_RSP_LEN;
+		return status;
+
+	case FSCTL_SET_ZERO_DATA: {
+		GLUSTER_PROF_START(set_zero_data);
+		status = glusterfs_set_zero_data(handle, fsp, in_data, in_len);
+		GLUSTER_PROF_END(set_zero_data, !NT_STATUS_IS_OK(status), 0);
+		return status;
+	}
+
+	default:
+		break;
+	}
+
+	return SMB_VFS_NEXT_FSCTL(handle, fsp, ctx, function, req_flags,
+				  in_data, in_len, out_data, max_out_len,
+				  out_len);
+}
+
+/* EA Operations */
+
+static ssize_t vfs_gluster_getxattr(struct vfs_handle_struct *handle,
+				    const char *path, const char *name,
+				    void *value, size_t size)
+{
+	ssize_t ret;
+
+	GLUSTER_PROF_START(getxattr);
+	glusterfs_meta_wait(handle, path);
+	if (gluster_xattr_cache_fetch(handle, path, name, value, size, &ret)) {
+		return GLUSTER_PROF_RET_BYTES(getxattr, ret);
+	}
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET_BYTES(getxattr, -1);
+	}
+	return GLUSTER_PROF_RET_BYTES(getxattr,
+		glusterfs_path_getxattr(handle, path, name, value, size));
+}
+
+static ssize_t vfs_gluster_lgetxattr(struct vfs_handle_struct *handle,
+				     const char *path, const char *name,
+				     void *value, size_t size)
+{
+	GLUSTER_PROF_START(lgetxattr);
+	glusterfs_meta_wait(handle, path);
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET_BYTES(lgetxattr, -1);
+	}
+	return GLUSTER_PROF_RET_BYTES(lgetxattr,
+		glfs_lgetxattr(vfs_gluster_fs(handle), path, name, value, size));
+}
+
+static ssize_t vfs_gluster_fgetxattr(struct vfs_handle_struct *handle,
+				     files_struct *fsp, const char *name,
+				     void *value, size_t size)
+{
+	ssize_t ret;
+
+	GLUSTER_PROF_START(fgetxattr);
+	if (gluster_xattr_cache_fetch(handle, fsp->fsp_name->base_name, name,
+				      value, size, &ret)) {
+		return GLUSTER_PROF_RET_BYTES(fgetxattr, ret);
+	}
+	return GLUSTER_PROF_RET_BYTES(fgetxattr,
+		glfs_fgetxattr(vfs_gluster_fetch_glfd(handle, fsp),
+			       name, value, size));
+}
+
+static ssize_t vfs_gluster_listxattr(struct vfs_handle_struct *handle,
+				     const char *path, char *list, size_t size)
+{
+	GLUSTER_PROF_START(listxattr);
+	glusterfs_meta_wait(handle, path);
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET_BYTES(listxattr, -1);
+	}
+	return GLUSTER_PROF_RET_BYTES(listxattr,
+		glfs_listxattr(vfs_gluster_fs(handle), path, list, size));
+}
+
+static ssize_t vfs_gluster_llistxattr(struct vfs_handle_struct *handle,
+				      const char *path, char *list, size_t size)
 {
-	return glfs_unlink(handle->data, smb_fname->base_name);
+	GLUSTER_PROF_START(llistxattr);
+	glusterfs_meta_wait(handle, path);
+	path = glusterfs_snapshot_path(handle, path);
+	if (path == NULL) {
+		return GLUSTER_PROF_RET_BYTES(llistxattr, -1);
+	}
+	return GLUSTER_PROF_RET_BYTES(llistxattr,
+		glfs_llistxattr(vfs_gluster_fs(handle), path, list, size));
 }
 
-static int vfs_gluster_chmod(struct vfs_handle_struct *handle,
-			     const char *path, mode_t mode)
+static ssize_t vfs_gluster_flistxattr(struct vfs_handle_struct *handle,
+				      files_struct *fsp, char *list,
+				      size_t size)
 {
-	return glfs_chmod(handle->data, path, mode);
+	GLUSTER_PROF_START(flistxattr);
+	return GLUSTER_PROF_RET_BYTES(flistxattr,
+		glfs_flistxattr(vfs_gluster_fetch_glfd(handle, fsp),
+				list, size));
 }
 
-static int vfs_gluster_fchmod(struct vfs_handle_struct *handle,
-			      files_struct *fsp, mode_t mode)
+static int vfs_gluster_removexattr(struct vfs_handle_struct *handle,
+				   const char *path, const char *name)
 {
-	return glfs_fchmod(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), mode);
+	GLUSTER_PROF_START(removexattr);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(removexattr,
+		glfs_removexattr(vfs_gluster_fs(handle), path, name));
 }
 
-static int vfs_gluster_chown(struct vfs_handle_struct *handle,
-			     const char *path, uid_t uid, gid_t gid)
+static int vfs_gluster_lremovexattr(struct vfs_handle_struct *handle,
+				    const char *path, const char *name)
 {
-	return glfs_chown(handle->data, path, uid, gid);
+	GLUSTER_PROF_START(lremovexattr);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(lremovexattr,
+		glfs_lremovexattr(vfs_gluster_fs(handle), path, name));
 }
 
-static int vfs_gluster_fchown(struct vfs_handle_struct *handle,
-			      files_struct *fsp, uid_t uid, gid_t gid)
+static int vfs_gluster_fremovexattr(struct vfs_handle_struct *handle,
+				    files_struct *fsp, const char *name)
 {
-	return glfs_fchown(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), uid, gid);
+	GLUSTER_PROF_START(fremovexattr);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	gluster_xattr_cache_invalidate(handle, fsp->fsp_name->base_name);
+	return GLUSTER_PROF_RET(fremovexattr,
+		glfs_fremovexattr(vfs_gluster_fetch_glfd(handle, fsp), name));
 }
 
-static int vfs_gluster_lchown(struct vfs_handle_struct *handle,
-			      const char *path, uid_t uid, gid_t gid)
+static int vfs_gluster_setxattr(struct vfs_handle_struct *handle,
+				const char *path, const char *name,
+				const void *value, size_t size, int flags)
 {
-	return glfs_lchown(handle->data, path, uid, gid);
+	int ret;
+
+	GLUSTER_PROF_START(setxattr);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	ret = glfs_setxattr(vfs_gluster_fs(handle), path, name, value, size,
+			    flags);
+	if ((ret == 0) && gluster_xattr_cached_name(handle, name)) {
+		/* written through, the next read is served from memory */
+		gluster_xattr_cache_store(handle, path, name, value, size);
+	}
+	return GLUSTER_PROF_RET(setxattr, ret);
 }
 
-static int vfs_gluster_chdir(struct vfs_handle_struct *handle, const char *path)
+static int vfs_gluster_lsetxattr(struct vfs_handle_struct *handle,
+				 const char *path, const char *name,
+				 const void *value, size_t size, int flags)
 {
-	return glfs_chdir(handle->data, path);
+	GLUSTER_PROF_START(lsetxattr);
+	glusterfs_meta_wait(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	gluster_xattr_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(lsetxattr,
+		glfs_lsetxattr(vfs_gluster_fs(handle), path, name, value,
+			          size, flags));
 }
 
-static char *vfs_gluster_getwd(struct vfs_handle_struct *handle, char *path)
+static int vfs_gluster_fsetxattr(struct vfs_handle_struct *handle,
+				 files_struct *fsp, const char *name,
+				 const void *value, size_t size, int flags)
 {
-	return glfs_getcwd(handle->data, path, PATH_MAX);
+	int ret;
+
+	GLUSTER_PROF_START(fsetxattr);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+	gluster_xattr_cache_invalidate(handle, fsp->fsp_name->base_name);
+	ret = glfs_fsetxattr(vfs_gluster_fetch_glfd(handle, fsp), name, value,
+			     size, flags);
+	if ((ret == 0) && gluster_xattr_cached_name(handle, name)) {
+		gluster_xattr_cache_store(handle, fsp->fsp_name->base_name,
+					  name, value, size);
+	}
+	return GLUSTER_PROF_RET(fsetxattr, ret);
 }
 
-static int vfs_gluster_ntimes(struct vfs_handle_struct *handle,
-			      const struct smb_filename *smb_fname,
-			      struct smb_file_time *ft)
+/* AIO Operations */
+
+/*
+ * gfapi runs the completion callbacks of its *_async calls on its own
+ * threads. The callback just records the result and pushes the request
+ * down a pipe whose read end is hooked into the smbd event loop, so the
+ * request is completed towards smbd from the main thread.
+ */
+
+struct glusterfs_aio_state {
+	struct glusterfs_aio_state *prev, *next;
+	SMB_STRUCT_AIOCB *aiocb;
+	ssize_t ret;
+	int err;
+	bool done;
+	bool write;
+	enum gluster_prof_op prof_op;
+	struct timespec prof_start;
+};
+
+static struct glusterfs_aio_state *aio_pending;
+static int aio_pipe_read_fd = -1;
+static int aio_pipe_write_fd = -1;
+static struct tevent_fd *aio_read_event;
+
+static void aio_glusterfs_done(glfs_fd_t *fd, ssize_t ret, void *data)
 {
-	struct timespec times[2];
+	struct glusterfs_aio_state *state = data;
+	ssize_t sts;
 
-	if (null_timespec(ft->atime)) {
-		times[0].tv_sec = smb_fname->st.st_ex_atime.tv_sec;
-		times[0].tv_nsec = smb_fname->st.st_ex_atime.tv_nsec;
-	} else {
-		times[0].tv_sec = ft->atime.tv_sec;
-		times[0].tv_nsec = ft->atime.tv_nsec;
-	}
+	state->ret = ret;
+	state->err = (ret < 0) ? errno : 0;
 
-	if (null_timespec(ft->mtime)) {
-		times[1].tv_sec = smb_fname->st.st_ex_mtime.tv_sec;
-		times[1].tv_nsec = smb_fname->st.st_ex_mtime.tv_nsec;
-	} else {
-		times[1].tv_sec = ft->mtime.tv_sec;
-		times[1].tv_nsec = ft->mtime.tv_nsec;
+	do {
+		sts = sys_write(aio_pipe_write_fd, &state, sizeof(state));
+	} while (sts < 0 && errno == EINTR);
+
+	if (sts != sizeof(state)) {
+		DEBUG(0, ("Write to aio pipe failed (%s)\n", strerror(errno)));
 	}
+}
 
-	if ((timespec_compare(&times[0],
-			      &smb_fname->st.st_ex_atime) == 0) &&
-	    (timespec_compare(&times[1],
-			      &smb_fname->st.st_ex_mtime) == 0)) {
-		return 0;
+static struct glusterfs_aio_state *aio_glusterfs_find(const SMB_STRUCT_AIOCB *aiocb)
+{
+	struct glusterfs_aio_state *state = NULL;
+
+	for (state = aio_pending; state; state = state->next) {
+		if (state->aiocb == aiocb) {
+			return state;
+		}
 	}
 
-	return glfs_utimens(handle->data, smb_fname->base_name, times);
+	return NULL;
 }
 
-static int vfs_gluster_ftruncate(struct vfs_handle_struct *handle,
-				 files_struct *fsp, off_t offset)
+/*
+ * Hand a finished request back to smbd. smbd calls our aio_error_fn and
+ * aio_return_fn from within smbd_aio_complete_aio_ex(), after which the
+ * request is no longer referenced and can go away.
+ */
+static void aio_glusterfs_complete(struct glusterfs_aio_state *state)
 {
-	return glfs_ftruncate(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), offset);
+	struct aio_extra *aio_ex;
+
+	state->done = true;
+
+	gluster_prof_record(state->prof_op, &state->prof_start,
+			    state->ret < 0,
+			    state->prof_op == GLUSTER_PROF_aio_fsync ?
+			    0 : MAX(state->ret, 0));
+
+	aio_ex = (struct aio_extra *)state->aiocb->aio_sigevent.sigev_value.sival_ptr;
+	smbd_aio_complete_aio_ex(aio_ex);
+
+	DLIST_REMOVE(aio_pending, state);
+	talloc_free(state);
 }
 
-static int vfs_gluster_fallocate(struct vfs_handle_struct *handle,
-				 struct files_struct *fsp,
-				 enum vfs_fallocate_mode mode,
-				 off_t offset, off_t len)
+static struct glusterfs_aio_state *aio_glusterfs_read_pipe(void)
 {
-	errno = ENOTSUP;
-	return -1;
+	struct glusterfs_aio_state *state = NULL;
+	ssize_t sts;
+
+	sts = sys_read(aio_pipe_read_fd, &state, sizeof(state));
+	if (sts != sizeof(state)) {
+		DEBUG(0, ("Read from aio pipe failed (%s)\n", strerror(errno)));
+		return NULL;
+	}
+
+	return state;
 }
 
-static char *vfs_gluster_realpath(struct vfs_handle_struct *handle,
-				  const char *path)
+static void aio_glusterfs_handler(struct tevent_context *ev,
+				  struct tevent_fd *fde,
+				  uint16_t flags, void *private_data)
 {
-	return glfs_realpath(handle->data, path, 0);
+	struct glusterfs_aio_state *state = NULL;
+
+	if (!(flags & TEVENT_FD_READ)) {
+		return;
+	}
+
+	state = aio_glusterfs_read_pipe();
+	if (state == NULL) {
+		return;
+	}
+
+	aio_glusterfs_complete(state);
 }
 
-static bool vfs_gluster_lock(struct vfs_handle_struct *handle,
-			     files_struct *fsp, int op, off_t offset,
-			     off_t count, int type)
+static bool init_gluster_aio(void)
 {
-	struct flock flock = { 0, };
-	int ret;
+	int fds[2];
 
-	flock.l_type = type;
-	flock.l_whence = SEEK_SET;
-	flock.l_start = offset;
-	flock.l_len = count;
-	flock.l_pid = 0;
-
-	ret = glfs_posix_lock(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), op, &flock);
+	if (aio_read_event != NULL) {
+		/* Already initialized. */
+		return true;
+	}
 
-	if (op == F_GETLK) {
-		/* lock query, true if someone else has locked */
-		if ((ret != -1) &&
-		    (flock.l_type != F_UNLCK) &&
-		    (flock.l_pid != 0) && (flock.l_pid != getpid()))
-			return true;
-		/* not me */
+	if (pipe(fds) == -1) {
+		DEBUG(0, ("Failed to create aio pipe (%s)\n", strerror(errno)));
 		return false;
 	}
 
-	if (ret == -1) {
+	aio_pipe_read_fd = fds[0];
+	aio_pipe_write_fd = fds[1];
+
+	aio_read_event = tevent_add_fd(server_event_context(), NULL,
+				       aio_pipe_read_fd, TEVENT_FD_READ,
+				       aio_glusterfs_handler, NULL);
+	if (aio_read_event == NULL) {
+		DEBUG(0, ("Failed to register aio pipe\n"));
+		close(aio_pipe_read_fd);
+		close(aio_pipe_write_fd);
+		aio_pipe_read_fd = -1;
+		aio_pipe_write_fd = -1;
 		return false;
 	}
 
 	return true;
 }
 
-static int vfs_gluster_kernel_flock(struct vfs_handle_struct *handle,
-				    files_struct *fsp, uint32 share_mode,
-				    uint32_t access_mask)
-{
-	return 0;
-}
-
-static int vfs_gluster_linux_setlease(struct vfs_handle_struct *handle,
-				      files_struct *fsp, int leasetype)
-{
-	errno = ENOSYS;
-	return -1;
-}
-
-static bool vfs_gluster_getlock(struct vfs_handle_struct *handle,
-				files_struct *fsp, off_t *poffset,
-				off_t *pcount, int *ptype, pid_t *ppid)
+static struct glusterfs_aio_state *aio_glusterfs_state_new(SMB_STRUCT_AIOCB *aiocb,
+							   enum gluster_prof_op op)
 {
-	struct flock flock = { 0, };
-	int ret;
-
-	flock.l_type = *ptype;
-	flock.l_whence = SEEK_SET;
-	flock.l_start = *poffset;
-	flock.l_len = *pcount;
-	flock.l_pid = 0;
+	struct glusterfs_aio_state *state = NULL;
 
-	ret = glfs_posix_lock(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), F_GETLK, &flock);
+	if (!init_gluster_aio()) {
+		/* smbd falls back to synchronous I/O on EAGAIN */
+		errno = EAGAIN;
+		return NULL;
+	}
 
-	if (ret == -1) {
-		return false;
+	state = talloc_zero(NULL, struct glusterfs_aio_state);
+	if (state == NULL) {
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	*ptype = flock.l_type;
-	*poffset = flock.l_start;
-	*pcount = flock.l_len;
-	*ppid = flock.l_pid;
+	state->aiocb = aiocb;
+	state->prof_op = op;
+	if (gluster_prof != NULL) {
+		clock_gettime_mono(&state->prof_start);
+	}
+	DLIST_ADD_END(aio_pending, state, struct glusterfs_aio_state *);
 
-	return true;
+	return state;
 }
 
-static int vfs_gluster_symlink(struct vfs_handle_struct *handle,
-			       const char *oldpath, const char *newpath)
+/* the request could not be submitted */
+static void aio_glusterfs_state_free(struct glusterfs_aio_state *state)
 {
-	return glfs_symlink(handle->data, oldpath, newpath);
+	gluster_prof_record(state->prof_op, &state->prof_start, true, 0);
+	DLIST_REMOVE(aio_pending, state);
+	talloc_free(state);
 }
 
-static int vfs_gluster_readlink(struct vfs_handle_struct *handle,
-				const char *path, char *buf, size_t bufsiz)
+static int vfs_gluster_aio_read(struct vfs_handle_struct *handle,
+				struct files_struct *fsp,
+				SMB_STRUCT_AIOCB *aiocb)
 {
-	return glfs_readlink(handle->data, path, buf, bufsiz);
-}
+	struct glusterfs_aio_state *state = NULL;
+	int ret;
 
-static int vfs_gluster_link(struct vfs_handle_struct *handle,
-			    const char *oldpath, const char *newpath)
-{
-	return glfs_link(handle->data, oldpath, newpath);
-}
+	glusterfs_fd_prepare_read(handle, fsp);
 
-static int vfs_gluster_mknod(struct vfs_handle_struct *handle, const char *path,
-			     mode_t mode, SMB_DEV_T dev)
-{
-	return glfs_mknod(handle->data, path, mode, dev);
-}
+	state = aio_glusterfs_state_new(aiocb, GLUSTER_PROF_aio_read);
+	if (state == NULL) {
+		return -1;
+	}
 
-static NTSTATUS vfs_gluster_notify_watch(struct vfs_handle_struct *handle,
-					 struct sys_notify_context *ctx,
-					 struct notify_entry *e,
-					 void (*callback) (struct sys_notify_context *ctx,
-							   void *private_data,
-							   struct notify_event *ev),
-					 void *private_data, void *handle_p)
-{
-	return NT_STATUS_NOT_IMPLEMENTED;
-}
+	ret = glfs_pread_async(vfs_gluster_fetch_glfd(handle, fsp),
+			       (void *)aiocb->aio_buf, aiocb->aio_nbytes,
+			       aiocb->aio_offset, 0, aio_glusterfs_done, state);
+	if (ret < 0) {
+		aio_glusterfs_state_free(state);
+		return -1;
+	}
 
-static int vfs_gluster_chflags(struct vfs_handle_struct *handle,
-			       const char *path, unsigned int flags)
-{
-	errno = ENOSYS;
-	return -1;
+	return 0;
 }
 
-static int vfs_gluster_get_real_filename(struct vfs_handle_struct *handle,
-					 const char *path, const char *name,
-					 TALLOC_CTX *mem_ctx, char **found_name)
+static int vfs_gluster_aio_write(struct vfs_handle_struct *handle,
+				 struct files_struct *fsp,
+				 SMB_STRUCT_AIOCB *aiocb)
 {
+	struct glusterfs_aio_state *state = NULL;
 	int ret;
-	char key_buf[NAME_MAX + 64];
-	char val_buf[NAME_MAX + 1];
 
-	if (strlen(name) >= NAME_MAX) {
-		errno = ENAMETOOLONG;
+	/* smbd falls back to a synchronous write, which reports it */
+	if (glusterfs_fd_prepare_write(handle, fsp) == -1) {
 		return -1;
 	}
 
-	snprintf(key_buf, NAME_MAX + 64,
-		 "glusterfs.get_real_filename:%s", name);
-
-	ret = glfs_getxattr(handle->data, path, key_buf, val_buf, NAME_MAX + 1);
-	if (ret == -1) {
-		if (errno == ENODATA) {
-			errno = EOPNOTSUPP;
-		}
+	state = aio_glusterfs_state_new(aiocb, GLUSTER_PROF_aio_write);
+	if (state == NULL) {
 		return -1;
 	}
 
-	*found_name = talloc_strdup(mem_ctx, val_buf);
-	if (found_name[0] == NULL) {
-		errno = ENOMEM;
+	state->write = true;
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+
+	ret = glfs_pwrite_async(vfs_gluster_fetch_glfd(handle, fsp),
+				(const void *)aiocb->aio_buf, aiocb->aio_nbytes,
+				aiocb->aio_offset, 0, aio_glusterfs_done, state);
+	if (ret < 0) {
+		aio_glusterfs_state_free(state);
 		return -1;
 	}
+
 	return 0;
 }
 
-static const char *vfs_gluster_connectpath(struct vfs_handle_struct *handle,
-					   const char *filename)
+static ssize_t vfs_gluster_aio_return(struct vfs_handle_struct *handle,
+				      struct files_struct *fsp,
+				      SMB_STRUCT_AIOCB *aiocb)
 {
-	return handle->conn->connectpath;
-}
+	struct glusterfs_aio_state *state = NULL;
 
-/* EA Operations */
+	state = aio_glusterfs_find(aiocb);
+	if (state == NULL || !state->done) {
+		errno = EINVAL;
+		return -1;
+	}
 
-static ssize_t vfs_gluster_getxattr(struct vfs_handle_struct *handle,
-				    const char *path, const char *name,
-				    void *value, size_t size)
-{
-	return glfs_getxattr(handle->data, path, name, value, size);
+	/* a stat may have been cached while the write was in flight */
+	if (state->write) {
+		gluster_stat_cache_invalidate_fsp(handle, fsp);
+	}
+
+	if (state->ret < 0) {
+		errno = state->err;
+	}
+
+	return state->ret;
 }
 
-static ssize_t vfs_gluster_lgetxattr(struct vfs_handle_struct *handle,
-				     const char *path, const char *name,
-				     void *value, size_t size)
+static int vfs_gluster_aio_cancel(struct vfs_handle_struct *handle,
+				  struct files_struct *fsp,
+				  SMB_STRUCT_AIOCB *aiocb)
 {
-	return glfs_lgetxattr(handle->data, path, name, value, size);
+	/* gfapi has no way to abort a fop once it has been wound. */
+	return AIO_NOTCANCELED;
 }
 
-static ssize_t vfs_gluster_fgetxattr(struct vfs_handle_struct *handle,
-				     files_struct *fsp, const char *name,
-				     void *value, size_t size)
+static int vfs_gluster_aio_error(struct vfs_handle_struct *handle,
+				 struct files_struct *fsp,
+				 SMB_STRUCT_AIOCB *aiocb)
 {
-	return glfs_fgetxattr(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), name, value, size);
+	struct glusterfs_aio_state *state = NULL;
+
+	state = aio_glusterfs_find(aiocb);
+	if (state == NULL) {
+		return EINVAL;
+	}
+
+	if (!state->done) {
+		return EINPROGRESS;
+	}
+
+	return state->err;
 }
 
-static ssize_t vfs_gluster_listxattr(struct vfs_handle_struct *handle,
-				     const char *path, char *list, size_t size)
-{
-	return glfs_listxattr(handle->data, path, list, size);
+static int vfs_gluster_aio_fsync(struct vfs_handle_struct *handle,
+				 struct files_struct *fsp, int op,
+				 SMB_STRUCT_AIOCB *aiocb)
+{
+	struct glusterfs_aio_state *state = NULL;
+	glfs_fd_t *glfd;
+	int ret;
+
+	state = aio_glusterfs_state_new(aiocb, GLUSTER_PROF_aio_fsync);
+	if (state == NULL) {
+		return -1;
+	}
+
+	/* a failed flush is kept for the next fsync or close */
+	glusterfs_fd_flush_deferred(vfs_gluster_fetch_fd(handle, fsp));
+
+	glfd = vfs_gluster_fetch_glfd(handle, fsp);
+
+	if (op == O_DSYNC) {
+		ret = glfs_fdatasync_async(glfd, aio_glusterfs_done, state);
+	} else {
+		ret = glfs_fsync_async(glfd, aio_glusterfs_done, state);
+	}
+	if (ret < 0) {
+		aio_glusterfs_state_free(state);
+		return -1;
+	}
+
+	return 0;
 }
 
-static ssize_t vfs_gluster_llistxattr(struct vfs_handle_struct *handle,
-				      const char *path, char *list, size_t size)
+static bool aio_glusterfs_in_array(const struct glusterfs_aio_state *state,
+				   const SMB_STRUCT_AIOCB * const aiocb_array[],
+				   int n)
 {
-	return glfs_llistxattr(handle->data, path, list, size);
-}
+	int i;
 
-static ssize_t vfs_gluster_flistxattr(struct vfs_handle_struct *handle,
-				      files_struct *fsp, char *list,
-				      size_t size)
-{
-	return glfs_flistxattr(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), list, size);
-}
+	for (i = 0; i < n; i++) {
+		if (aiocb_array[i] == state->aiocb) {
+			return true;
+		}
+	}
 
-static int vfs_gluster_removexattr(struct vfs_handle_struct *handle,
-				   const char *path, const char *name)
-{
-	return glfs_removexattr(handle->data, path, name);
+	return false;
 }
 
-static int vfs_gluster_lremovexattr(struct vfs_handle_struct *handle,
-				    const char *path, const char *name)
+static int vfs_gluster_aio_suspend(struct vfs_handle_struct *handle,
+				   struct files_struct *fsp,
+				   const SMB_STRUCT_AIOCB * const aiocb_array[],
+				   int n, const struct timespec *timeout)
 {
-	return glfs_lremovexattr(handle->data, path, name);
-}
+	struct glusterfs_aio_state *state = NULL;
+	struct timespec start, now;
+	struct pollfd pfd;
+	int timeout_ms = -1;
+	int elapsed_ms;
+	bool found;
+	int ret;
 
-static int vfs_gluster_fremovexattr(struct vfs_handle_struct *handle,
-				    files_struct *fsp, const char *name)
-{
-	return glfs_fremovexattr(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), name);
-}
+	if (aio_read_event == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
 
-static int vfs_gluster_setxattr(struct vfs_handle_struct *handle,
-				const char *path, const char *name,
-				const void *value, size_t size, int flags)
-{
-	return glfs_setxattr(handle->data, path, name, value, size, flags);
-}
+	clock_gettime_mono(&start);
+
+	while (true) {
+		if (timeout != NULL) {
+			clock_gettime_mono(&now);
+			elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+				     (now.tv_nsec - start.tv_nsec) / 1000000;
+			timeout_ms = timeout->tv_sec * 1000 +
+				     timeout->tv_nsec / 1000000 - elapsed_ms;
+			if (timeout_ms < 0) {
+				timeout_ms = 0;
+			}
+		}
 
-static int vfs_gluster_lsetxattr(struct vfs_handle_struct *handle,
-				 const char *path, const char *name,
-				 const void *value, size_t size, int flags)
-{
-	return glfs_lsetxattr(handle->data, path, name, value, size, flags);
-}
+		pfd.fd = aio_pipe_read_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
-static int vfs_gluster_fsetxattr(struct vfs_handle_struct *handle,
-				 files_struct *fsp, const char *name,
-				 const void *value, size_t size, int flags)
-{
-	return glfs_fsetxattr(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp), name, value, size,
-			      flags);
-}
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
 
-/* AIO Operations */
+		state = aio_glusterfs_read_pipe();
+		if (state == NULL) {
+			return -1;
+		}
+
+		/* Completing the request frees it, check first. */
+		found = aio_glusterfs_in_array(state, aiocb_array, n);
+
+		aio_glusterfs_complete(state);
+
+		if (found) {
+			return 0;
+		}
+	}
+}
 
 static bool vfs_gluster_aio_force(struct vfs_handle_struct *handle,
 				  files_struct *fsp)
@@ -979,42 +8383,93 @@ struct gluster_acl_header {
 	struct gluster_ace entries[];
 };
 
-static int gluster_ace_cmp (const void *val1, const void *val2)
-{
-	const struct gluster_ace *ace1 = NULL;
-	const struct gluster_ace *ace2 = NULL;
-	int                        ret = 0;
+/*
+ * The xattr holds the entries little endian and sorted by tag, and by id
+ * within the named user and group entries, which is what the bricks
+ * expect. Both directions convert each entry in a single pass, with
+ * SVAL/SIVAL doing the byte order in the same load or store (plain
+ * accesses on little endian hosts). The tag order is fixed, so encoding
+ * places every entry straight into the run of its tag instead of
+ * sorting afterwards.
+ */
+
+/* canonical order of the tags in the xattr */
+enum gluster_acl_slot {
+	GLUSTER_ACL_SLOT_USER_OBJ,
+	GLUSTER_ACL_SLOT_USER,
+	GLUSTER_ACL_SLOT_GROUP_OBJ,
+	GLUSTER_ACL_SLOT_GROUP,
+	GLUSTER_ACL_SLOT_MASK,
+	GLUSTER_ACL_SLOT_OTHER,
+	GLUSTER_ACL_NUM_SLOTS
+};
 
-	ace1 = val1;
-	ace2 = val2;
+static const uint16_t gluster_acl_slot_tags[GLUSTER_ACL_NUM_SLOTS] = {
+	GLUSTER_ACL_USER_OBJ,
+	GLUSTER_ACL_USER,
+	GLUSTER_ACL_GROUP_OBJ,
+	GLUSTER_ACL_GROUP,
+	GLUSTER_ACL_MASK,
+	GLUSTER_ACL_OTHER,
+};
 
-	ret = (ace1->tag - ace2->tag);
-	if (!ret)
-		ret = (ace1->id - ace2->id);
 
-	return ret;
-}
+#if (GLUSTER_ACL_READ == SMB_ACL_READ) && \
+	(GLUSTER_ACL_WRITE == SMB_ACL_WRITE) && \
+	(GLUSTER_ACL_EXECUTE == SMB_ACL_EXECUTE)
+#define GLUSTER_ACL_PERM_MASK (GLUSTER_ACL_READ | GLUSTER_ACL_WRITE | \
+			       GLUSTER_ACL_EXECUTE)
+#define gluster_to_smb_perm(perm) ((perm) & GLUSTER_ACL_PERM_MASK)
+#define smb_to_gluster_perm(perm) ((perm) & GLUSTER_ACL_PERM_MASK)
+#else
+#define gluster_to_smb_perm(perm) \
+	((((perm) & GLUSTER_ACL_READ) ? SMB_ACL_READ : 0) | \
+	 (((perm) & GLUSTER_ACL_WRITE) ? SMB_ACL_WRITE : 0) | \
+	 (((perm) & GLUSTER_ACL_EXECUTE) ? SMB_ACL_EXECUTE : 0))
+#define smb_to_gluster_perm(perm) \
+	((((perm) & SMB_ACL_READ) ? GLUSTER_ACL_READ : 0) | \
+	 (((perm) & SMB_ACL_WRITE) ? GLUSTER_ACL_WRITE : 0) | \
+	 (((perm) & SMB_ACL_EXECUTE) ? GLUSTER_ACL_EXECUTE : 0))
+#endif
 
-static void gluster_acl_normalize (struct gluster_acl_header *acl, int count)
+/* xattr tag to SMB tag, -1 for anything unknown */
+static int gluster_to_smb_tag(uint16_t tag)
 {
-	qsort (acl->entries, count, sizeof (struct gluster_ace *),
-	       gluster_ace_cmp);
+	switch (tag) {
+	case GLUSTER_ACL_USER_OBJ:
+		return SMB_ACL_USER_OBJ;
+	case GLUSTER_ACL_USER:
+		return SMB_ACL_USER;
+	case GLUSTER_ACL_GROUP_OBJ:
+		return SMB_ACL_GROUP_OBJ;
+	case GLUSTER_ACL_GROUP:
+		return SMB_ACL_GROUP;
+	case GLUSTER_ACL_MASK:
+		return SMB_ACL_MASK;
+	case GLUSTER_ACL_OTHER:
+		return SMB_ACL_OTHER;
+	default:
+		return -1;
+	}
 }
 
-static void gluster_acl_to_xattr (struct gluster_acl_header *acl, int count)
+static int smb_acl_slot(SMB_ACL_TAG_T type)
 {
-	struct gluster_ace *ace;
-	int i;
-
-	ace = acl->entries;
-
-	SIVAL(&acl->version, 0, acl->version);
-
-	for (i = 0; i < count; i++) {
-		SSVAL(&ace->tag, 0, ace->tag);
-		SSVAL(&ace->perm, 0, ace->perm);
-		SIVAL(&ace->id, 0, ace->id);
-		ace++;
+	switch (type) {
+	case SMB_ACL_USER_OBJ:
+		return GLUSTER_ACL_SLOT_USER_OBJ;
+	case SMB_ACL_USER:
+		return GLUSTER_ACL_SLOT_USER;
+	case SMB_ACL_GROUP_OBJ:
+		return GLUSTER_ACL_SLOT_GROUP_OBJ;
+	case SMB_ACL_GROUP:
+		return GLUSTER_ACL_SLOT_GROUP;
+	case SMB_ACL_MASK:
+		return GLUSTER_ACL_SLOT_MASK;
+	case SMB_ACL_OTHER:
+		return GLUSTER_ACL_SLOT_OTHER;
+	default:
+		return -1;
 	}
 }
 
@@ -1022,13 +8477,13 @@ static SMB_ACL_T gluster_to_smb_acl(const char *buf, size_t xattr_size)
 {
 	int count;
 	size_t size;
-	struct gluster_ace *ace;
+	const struct gluster_ace *ace;
 	struct smb_acl_entry *smb_ace;
-	struct gluster_acl_header *hdr;
+	const struct gluster_acl_header *hdr;
 	struct smb_acl_t *result;
 	int i;
 	uint16_t tag;
-	uint16_t perm;
+	int type;
 	uint32_t id;
 
 	size = xattr_size;
@@ -1051,11 +8506,12 @@ static SMB_ACL_T gluster_to_smb_acl(const char *buf, size_t xattr_size)
 
 	count = size / sizeof(*ace);
 
-	hdr = (void *)buf;
+	hdr = (const void *)buf;
 
 	if (GLUSTER_ACL_VERSION != IVAL(&hdr->version, 0)) {
 		DEBUG(0, ("Unknown gluster ACL version: %d\n",
 			  IVAL(&hdr->version, 0)));
+		errno = EINVAL;
 		return NULL;
 	}
 
@@ -1070,58 +8526,25 @@ static SMB_ACL_T gluster_to_smb_acl(const char *buf, size_t xattr_size)
 	smb_ace = result->acl;
 	ace = hdr->entries;
 
-	for (i = 0; i < count; i++) {
+	for (i = 0; i < count; i++, ace++, smb_ace++) {
 		tag = SVAL(&ace->tag, 0);
-
-		switch(tag) {
-		case GLUSTER_ACL_USER:
-			smb_ace->a_type = SMB_ACL_USER;
-			break;
-		case GLUSTER_ACL_USER_OBJ:
-			smb_ace->a_type = SMB_ACL_USER_OBJ;
-			break;
-		case GLUSTER_ACL_GROUP:
-			smb_ace->a_type = SMB_ACL_GROUP;
-			break;
-		case GLUSTER_ACL_GROUP_OBJ:
-			smb_ace->a_type = SMB_ACL_GROUP_OBJ;
-			break;
-		case GLUSTER_ACL_OTHER:
-			smb_ace->a_type = SMB_ACL_OTHER;
-			break;
-		case GLUSTER_ACL_MASK:
-			smb_ace->a_type = SMB_ACL_MASK;
-			break;
-		default:
+		type = gluster_to_smb_tag(tag);
+		if (type == -1) {
 			DEBUG(0, ("unknown tag type %d\n", (unsigned int) tag));
+			SAFE_FREE(result);
+			errno = EINVAL;
 			return NULL;
 		}
 
-		id = IVAL(&ace->id, 0);
+		smb_ace->a_type = type;
+		smb_ace->a_perm = gluster_to_smb_perm(SVAL(&ace->perm, 0));
 
-		switch(smb_ace->a_type) {
-		case SMB_ACL_USER:
+		id = IVAL(&ace->id, 0);
+		if (tag == GLUSTER_ACL_USER) {
 			smb_ace->uid = id;
-			break;
-		case SMB_ACL_GROUP:
+		} else if (tag == GLUSTER_ACL_GROUP) {
 			smb_ace->gid = id;
-			break;
-		default:
-			break;
 		}
-
-		perm = SVAL(&ace->perm, 0);
-
-		smb_ace->a_perm = 0;
-		smb_ace->a_perm |=
-			((perm & GLUSTER_ACL_READ) ? SMB_ACL_READ : 0);
-		smb_ace->a_perm |=
-			((perm & GLUSTER_ACL_WRITE) ? SMB_ACL_WRITE : 0);
-		smb_ace->a_perm |=
-			((perm & GLUSTER_ACL_EXECUTE) ? SMB_ACL_EXECUTE : 0);
-
-		ace++;
-		smb_ace++;
 	}
 
 	return result;
@@ -1130,13 +8553,16 @@ static SMB_ACL_T gluster_to_smb_acl(const char *buf, size_t xattr_size)
 static ssize_t smb_to_gluster_acl(SMB_ACL_T theacl, char *buf, size_t len)
 {
 	ssize_t size;
+	struct gluster_ace *entries;
 	struct gluster_ace *ace;
 	struct smb_acl_entry *smb_ace;
 	struct gluster_acl_header *hdr;
+	int first[GLUSTER_ACL_NUM_SLOTS];
+	int next[GLUSTER_ACL_NUM_SLOTS] = { 0, };
 	int i;
+	int pos;
+	int slot;
 	int count;
-	uint16_t tag;
-	uint16_t perm;
 	uint32_t id;
 
 	count = theacl->count;
@@ -1151,46 +8577,40 @@ static ssize_t smb_to_gluster_acl(SMB_ACL_T theacl, char *buf, size_t len)
 		return -1;
 	}
 
-	hdr = (void *)buf;
-	ace = hdr->entries;
+	/* count the entries of each tag to know where their run starts */
 	smb_ace = theacl->acl;
-
-	hdr->version = GLUSTER_ACL_VERSION;
-
-	for (i = 0; i < count; i++) {
-		switch(smb_ace->a_type) {
-		case SMB_ACL_USER:
-			tag = GLUSTER_ACL_USER;
-			break;
-		case SMB_ACL_USER_OBJ:
-			tag = GLUSTER_ACL_USER_OBJ;
-			break;
-		case SMB_ACL_GROUP:
-			tag = GLUSTER_ACL_GROUP;
-			break;
-		case SMB_ACL_GROUP_OBJ:
-			tag = GLUSTER_ACL_GROUP_OBJ;
-			break;
-		case SMB_ACL_OTHER:
-			tag = GLUSTER_ACL_OTHER;
-			break;
-		case SMB_ACL_MASK:
-			tag = GLUSTER_ACL_MASK;
-			break;
-		default:
+	for (i = 0; i < count; i++, smb_ace++) {
+		slot = smb_acl_slot(smb_ace->a_type);
+		if (slot == -1) {
 			DEBUG(0, ("Unknown tag value %d\n",
 				  smb_ace->a_type));
 			errno = EINVAL;
 			return -1;
 		}
+		next[slot]++;
+	}
 
-		ace->tag = tag;
+	pos = 0;
+	for (slot = 0; slot < GLUSTER_ACL_NUM_SLOTS; slot++) {
+		first[slot] = pos;
+		pos += next[slot];
+		next[slot] = first[slot];
+	}
+
+	hdr = (void *)buf;
+	entries = hdr->entries;
+
+	SIVAL(&hdr->version, 0, GLUSTER_ACL_VERSION);
 
-		switch(smb_ace->a_type) {
-		case SMB_ACL_USER:
+	smb_ace = theacl->acl;
+	for (i = 0; i < count; i++, smb_ace++) {
+		slot = smb_acl_slot(smb_ace->a_type);
+
+		switch (slot) {
+		case GLUSTER_ACL_SLOT_USER:
 			id = smb_ace->uid;
 			break;
-		case SMB_ACL_GROUP:
+		case GLUSTER_ACL_SLOT_GROUP:
 			id = smb_ace->gid;
 			break;
 		default:
@@ -1198,33 +8618,187 @@ static ssize_t smb_to_gluster_acl(SMB_ACL_T theacl, char *buf, size_t len)
 			break;
 		}
 
-		ace->id = id;
+		/*
+		 * Keep the named entries ordered by id. They nearly always
+		 * arrive ordered, then nothing moves.
+		 */
+		pos = next[slot]++;
+		while ((pos > first[slot]) &&
+		       (IVAL(&entries[pos - 1].id, 0) > id)) {
+			entries[pos] = entries[pos - 1];
+			pos--;
+		}
+
+		ace = &entries[pos];
+		SSVAL(&ace->tag, 0, gluster_acl_slot_tags[slot]);
+		SSVAL(&ace->perm, 0, smb_to_gluster_perm(smb_ace->a_perm));
+		SIVAL(&ace->id, 0, id);
+	}
+
+	return size;
+}
+
+/*
+ * ACL xattrs are fetched into one buffer per connection, sized for
+ * typical ACLs and only grown when a getxattr reports ERANGE, instead of
+ * asking for the size first on every call.
+ *
+ * Parsed ACLs are cached per inode and ACL type with the ctime the file
+ * had when the ACL was read. Any ACL change updates the ctime, so an
+ * entry is used only while the ctime still matches. The ctime comes from
+ * the stat cache when it has the file, which it normally does during the
+ * access checks of an open. A file without an ACL of the requested type
+ * is remembered as such.
+ */
+
+struct gluster_acl_entry {
+	struct timespec ctime;
+	/* NULL with err set if the file has no such ACL */
+	struct smb_acl_t *acl;
+	size_t size;
+	int err;
+};
+
+static size_t gluster_smb_acl_size(const struct smb_acl_t *acl)
+{
+	return sizeof(struct smb_acl_t) +
+		(sizeof(struct smb_acl_entry) * acl->count);
+}
+
+static char *gluster_acl_cache_key(TALLOC_CTX *mem_ctx,
+				   const SMB_STRUCT_STAT *st,
+				   SMB_ACL_TYPE_T type)
+{
+	return talloc_asprintf(mem_ctx, "%llu:%llu:%d",
+			       (unsigned long long)st->st_ex_dev,
+			       (unsigned long long)st->st_ex_ino, (int)type);
+}
 
-		ace->perm = 0;
-		ace->perm |=
-			((smb_ace->a_perm & SMB_ACL_READ) ? GLUSTER_ACL_READ : 0);
-		ace->perm |=
-			((smb_ace->a_perm & SMB_ACL_WRITE) ? GLUSTER_ACL_WRITE : 0);
-		ace->perm |=
-			((smb_ace->a_perm & SMB_ACL_EXECUTE) ? GLUSTER_ACL_EXECUTE : 0);
+/* Attributes to validate the cache with, from the stat cache if it can. */
+static bool glusterfs_acl_stat(struct vfs_handle_struct *handle,
+			       const char *path, glfs_fd_t *glfd,
+			       SMB_STRUCT_STAT *sbuf)
+{
+	struct stat st;
+	int ret;
 
-		ace++;
-		smb_ace++;
+	if (gluster_stat_cache_fetch(handle, path, false, sbuf)) {
+		return true;
 	}
 
-	gluster_acl_normalize (hdr, count);
-	gluster_acl_to_xattr (hdr, count);
+	if (glfd != NULL) {
+		ret = glfs_fstat(glfd, &st);
+	} else {
+		ret = glusterfs_path_stat(handle, path, true, &st);
+	}
+	if (ret != 0) {
+		return false;
+	}
 
-	return size;
+	smb_stat_ex_from_stat(sbuf, &st);
+	gluster_stat_cache_store(handle, path, false, sbuf);
+	return true;
 }
 
+static void glusterfs_acl_cache_store(struct vfs_handle_struct *handle,
+				      const char *key,
+				      const SMB_STRUCT_STAT *st,
+				      const struct smb_acl_t *acl, int err)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct gluster_acl_entry *entry;
 
-static SMB_ACL_T vfs_gluster_sys_acl_get_file(struct vfs_handle_struct *handle,
-					      const char *path_p,
-					      SMB_ACL_TYPE_T type)
+	entry = talloc_zero(NULL, struct gluster_acl_entry);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->ctime = st->st_ex_ctime;
+	entry->err = err;
+
+	if (acl != NULL) {
+		entry->size = gluster_smb_acl_size(acl);
+		entry->acl = talloc_memdup(entry, acl, entry->size);
+		if (entry->acl == NULL) {
+			talloc_free(entry);
+			return;
+		}
+	}
+
+	gluster_cache_add(conn->acl_cache, key, entry);
+}
+
+/*
+ * Fetch the xattr key into the connection's ACL buffer. Returns its
+ * length, the data stays valid until the next call.
+ */
+static ssize_t glusterfs_acl_getxattr(struct vfs_handle_struct *handle,
+				      const char *path, glfs_fd_t *glfd,
+				      const char *key)
 {
-	struct smb_acl_t *result;
+	struct glusterfs_conn *conn = handle->data;
 	char *buf;
+	ssize_t ret;
+
+	if (conn->acl_buf == NULL) {
+		conn->acl_buf = SMB_MALLOC(conn->acl_bufsize);
+		if (conn->acl_buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* prefetched along with the stat of the file? */
+	if (gluster_xattr_cache_fetch(handle, path, key, conn->acl_buf,
+				      conn->acl_bufsize, &ret) &&
+	    ((ret != -1) || (errno != ERANGE))) {
+		return ret;
+	}
+
+	for (;;) {
+		if (glfd != NULL) {
+			ret = glfs_fgetxattr(glfd, key, conn->acl_buf,
+					     conn->acl_bufsize);
+		} else {
+			ret = glusterfs_path_getxattr(handle, path, key,
+						      conn->acl_buf,
+						      conn->acl_bufsize);
+		}
+		if ((ret != -1) || (errno != ERANGE)) {
+			return ret;
+		}
+
+		/* larger than any ACL so far, the buffer grows for good */
+		if (glfd != NULL) {
+			ret = glfs_fgetxattr(glfd, key, 0, 0);
+		} else {
+			ret = glusterfs_path_getxattr(handle, path, key, 0, 0);
+		}
+		if (ret <= 0) {
+			return ret;
+		}
+
+		buf = realloc(conn->acl_buf, ret);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		conn->acl_buf = buf;
+		conn->acl_bufsize = ret;
+		/* and retry, the ACL may have grown again meanwhile */
+	}
+}
+
+static SMB_ACL_T glusterfs_sys_acl_get(struct vfs_handle_struct *handle,
+				       const char *path, glfs_fd_t *glfd,
+				       SMB_ACL_TYPE_T type)
+{
+	struct glusterfs_conn *conn = handle->data;
+	struct gluster_acl_entry *entry;
+	struct smb_acl_t *result = NULL;
+	SMB_STRUCT_STAT st;
+	bool have_st = false;
+	char *cache_key = NULL;
 	const char *key;
 	ssize_t ret;
 
@@ -1240,51 +8814,98 @@ static SMB_ACL_T vfs_gluster_sys_acl_get_file(struct vfs_handle_struct *handle,
 		return NULL;
 	}
 
-	ret = glfs_getxattr(handle->data, path_p, key, 0, 0);
-	if (ret <= 0) {
-		return NULL;
+	if (conn->acl_cache != NULL) {
+		have_st = glusterfs_acl_stat(handle, path, glfd, &st);
+	}
+	if (have_st) {
+		cache_key = gluster_acl_cache_key(talloc_tos(), &st, type);
 	}
 
-	buf = alloca(ret);
-	ret = glfs_getxattr(handle->data, path_p, key, buf, ret);
-	if (ret <= 0) {
-		return NULL;
+	if (cache_key != NULL) {
+		entry = gluster_cache_lookup(conn->acl_cache, cache_key);
+		if ((entry != NULL) &&
+		    (timespec_compare(&entry->ctime, &st.st_ex_ctime) == 0)) {
+			TALLOC_FREE(cache_key);
+			if (entry->acl == NULL) {
+				errno = entry->err;
+				return NULL;
+			}
+			result = SMB_MALLOC(entry->size);
+			if (result == NULL) {
+				errno = ENOMEM;
+				return NULL;
+			}
+			memcpy(result, entry->acl, entry->size);
+			return result;
+		}
+	}
+
+	ret = glusterfs_acl_getxattr(handle, path, glfd, key);
+	if (ret > 0) {
+		result = gluster_to_smb_acl(conn->acl_buf, ret);
 	}
 
-	result = gluster_to_smb_acl(buf, ret);
+	if (cache_key != NULL) {
+		if (result != NULL) {
+			glusterfs_acl_cache_store(handle, cache_key, &st,
+						  result, 0);
+		} else if ((ret == -1) && (errno == ENODATA)) {
+			glusterfs_acl_cache_store(handle, cache_key, &st,
+						  NULL, ENODATA);
+			errno = ENODATA;
+		}
+		TALLOC_FREE(cache_key);
+	}
 
 	return result;
 }
 
-static SMB_ACL_T vfs_gluster_sys_acl_get_fd(struct vfs_handle_struct *handle,
-					    struct files_struct *fsp)
+/* ACLs written by us are dropped, not trusted to change the ctime */
+static void glusterfs_acl_cache_invalidate(struct vfs_handle_struct *handle,
+					   const char *path,
+					   SMB_ACL_TYPE_T type)
 {
-	struct smb_acl_t *result;
-	int ret;
-	char *buf;
-	glfs_fd_t *glfd;
+	struct glusterfs_conn *conn = handle->data;
+	SMB_STRUCT_STAT st;
+	char *cache_key;
 
-	glfd = *(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp);
-	ret = glfs_fgetxattr(glfd, "system.posix_acl_access", 0, 0);
-	if (ret <= 0) {
-		return NULL;
+	if (conn->acl_cache == NULL) {
+		return;
 	}
 
-	buf = alloca(ret);
-	ret = glfs_fgetxattr(glfd, "system.posix_acl_access", buf, ret);
-	if (ret <= 0) {
-		return NULL;
+	if (!gluster_stat_cache_fetch(handle, path, false, &st)) {
+		/* unknown inode, the ctime check has to do */
+		return;
+	}
+
+	cache_key = gluster_acl_cache_key(talloc_tos(), &st, type);
+	if (cache_key == NULL) {
+		gluster_cache_flush(conn->acl_cache);
+		return;
 	}
+	gluster_cache_delete(conn->acl_cache, cache_key);
+	TALLOC_FREE(cache_key);
+}
 
-	result = gluster_to_smb_acl(buf, ret);
+static SMB_ACL_T glusterfs_sys_acl_get_file(struct vfs_handle_struct *handle,
+					    const char *path_p,
+					    SMB_ACL_TYPE_T type)
+{
+	return glusterfs_sys_acl_get(handle, path_p, NULL, type);
+}
 
-	return result;
+static SMB_ACL_T glusterfs_sys_acl_get_fd(struct vfs_handle_struct *handle,
+					  struct files_struct *fsp)
+{
+	return glusterfs_sys_acl_get(handle, fsp->fsp_name->base_name,
+				     vfs_gluster_fetch_glfd(handle, fsp),
+				     SMB_ACL_TYPE_ACCESS);
 }
 
-static int vfs_gluster_sys_acl_set_file(struct vfs_handle_struct *handle,
-					const char *name,
-					SMB_ACL_TYPE_T acltype,
-					SMB_ACL_T theacl)
+static int glusterfs_sys_acl_set_file(struct vfs_handle_struct *handle,
+				      const char *name,
+				      SMB_ACL_TYPE_T acltype,
+				      SMB_ACL_T theacl)
 {
 	int ret;
 	const char *key;
@@ -1311,14 +8932,19 @@ static int vfs_gluster_sys_acl_set_file(struct vfs_handle_struct *handle,
 		return -1;
 	}
 
-	ret = glfs_setxattr(handle->data, name, key, buf, size, 0);
+	/* the mode bits follow the ACL */
+	glusterfs_acl_cache_invalidate(handle, name, acltype);
+	gluster_xattr_cache_invalidate(handle, name);
+	gluster_stat_cache_invalidate(handle, name);
+
+	ret = glfs_setxattr(vfs_gluster_fs(handle), name, key, buf, size, 0);
 
 	return ret;
 }
 
-static int vfs_gluster_sys_acl_set_fd(struct vfs_handle_struct *handle,
-				      struct files_struct *fsp,
-				      SMB_ACL_T theacl)
+static int glusterfs_sys_acl_set_fd(struct vfs_handle_struct *handle,
+				    struct files_struct *fsp,
+				    SMB_ACL_T theacl)
 {
 	int ret;
 	char *buf;
@@ -1332,15 +8958,80 @@ static int vfs_gluster_sys_acl_set_fd(struct vfs_handle_struct *handle,
 		return -1;
 	}
 
-	ret = glfs_fsetxattr(*(glfs_fd_t **)VFS_FETCH_FSP_EXTENSION(handle, fsp),
+	glusterfs_acl_cache_invalidate(handle, fsp->fsp_name->base_name,
+				       SMB_ACL_TYPE_ACCESS);
+	gluster_xattr_cache_invalidate(handle, fsp->fsp_name->base_name);
+	gluster_stat_cache_invalidate_fsp(handle, fsp);
+
+	ret = glfs_fsetxattr(vfs_gluster_fetch_glfd(handle, fsp),
 			     "system.posix_acl_access", buf, size, 0);
 	return ret;
 }
 
+/* the ACL conversion sits in helpers so that it is profiled as a whole */
+
+static SMB_ACL_T vfs_gluster_sys_acl_get_file(struct vfs_handle_struct *handle,
+					      const char *path_p,
+					      SMB_ACL_TYPE_T type)
+{
+	SMB_ACL_T result;
+
+	GLUSTER_PROF_START(sys_acl_get_file);
+	glusterfs_meta_wait(handle, path_p);
+	path_p = glusterfs_snapshot_path(handle, path_p);
+	if (path_p == NULL) {
+		GLUSTER_PROF_END(sys_acl_get_file, true, 0);
+		return NULL;
+	}
+	result = glusterfs_sys_acl_get_file(handle, path_p, type);
+	GLUSTER_PROF_END(sys_acl_get_file, result == NULL, 0);
+
+	return result;
+}
+
+static SMB_ACL_T vfs_gluster_sys_acl_get_fd(struct vfs_handle_struct *handle,
+					    struct files_struct *fsp)
+{
+	SMB_ACL_T result;
+
+	GLUSTER_PROF_START(sys_acl_get_fd);
+	result = glusterfs_sys_acl_get_fd(handle, fsp);
+	GLUSTER_PROF_END(sys_acl_get_fd, result == NULL, 0);
+
+	return result;
+}
+
+static int vfs_gluster_sys_acl_set_file(struct vfs_handle_struct *handle,
+					const char *name,
+					SMB_ACL_TYPE_T acltype,
+					SMB_ACL_T theacl)
+{
+	GLUSTER_PROF_START(sys_acl_set_file);
+	glusterfs_meta_wait(handle, name);
+	return GLUSTER_PROF_RET(sys_acl_set_file,
+		glusterfs_sys_acl_set_file(handle, name, acltype, theacl));
+}
+
+static int vfs_gluster_sys_acl_set_fd(struct vfs_handle_struct *handle,
+				      struct files_struct *fsp,
+				      SMB_ACL_T theacl)
+{
+	GLUSTER_PROF_START(sys_acl_set_fd);
+	return GLUSTER_PROF_RET(sys_acl_set_fd,
+		glusterfs_sys_acl_set_fd(handle, fsp, theacl));
+}
+
 static int vfs_gluster_sys_acl_delete_def_file(struct vfs_handle_struct *handle,
 					       const char *path)
 {
-	return glfs_removexattr(handle->data, path, "system.posix_acl_default");
+	GLUSTER_PROF_START(sys_acl_delete_def_file);
+	glusterfs_meta_wait(handle, path);
+	glusterfs_acl_cache_invalidate(handle, path, SMB_ACL_TYPE_DEFAULT);
+	gluster_xattr_cache_invalidate(handle, path);
+	gluster_stat_cache_invalidate(handle, path);
+	return GLUSTER_PROF_RET(sys_acl_delete_def_file,
+		glfs_removexattr(vfs_gluster_fs(handle), path,
+				 "system.posix_acl_default"));
 }
 
 static struct vfs_fn_pointers glusterfs_fns = {
@@ -1352,6 +9043,7 @@ static struct vfs_fn_pointers glusterfs_fns = {
 	.disk_free = vfs_gluster_disk_free,
 	.get_quota = vfs_gluster_get_quota,
 	.set_quota = vfs_gluster_set_quota,
+	.get_shadow_copy_data = vfs_gluster_get_shadow_copy_data,
 	.statvfs = vfs_gluster_statvfs,
 	.fs_capabilities = vfs_gluster_fs_capabilities,
 
@@ -1420,6 +9112,7 @@ static struct vfs_fn_pointers glusterfs_fns = {
 	.strict_lock = NULL,
 	.strict_unlock = NULL,
 	.translate_name = NULL,
+	.fsctl = vfs_gluster_fsctl,
 
 	/* NT ACL Operations */
 	.fget_nt_acl = NULL,
@@ -1468,13 +9161,13 @@ static struct vfs_fn_pointers glusterfs_fns = {
 	.fsetxattr = vfs_gluster_fsetxattr,
 
 	/* AIO Operations */
-	.aio_read = NULL,
-	.aio_write = NULL,
-	.aio_return_fn = NULL,
-	.aio_cancel = NULL,
-	.aio_error_fn = NULL,
-	.aio_fsync = NULL,
-	.aio_suspend = NULL,
+	.aio_read = vfs_gluster_aio_read,
+	.aio_write = vfs_gluster_aio_write,
+	.aio_return_fn = vfs_gluster_aio_return,
+	.aio_cancel = vfs_gluster_aio_cancel,
+	.aio_error_fn = vfs_gluster_aio_error,
+	.aio_fsync = vfs_gluster_aio_fsync,
+	.aio_suspend = vfs_gluster_aio_suspend,
 	.aio_force = vfs_gluster_aio_force,
 
 	/* Offline Operations */